@@ -0,0 +1,303 @@
+// Usage: smoke-bench [-n sizes] [-r repetitions] [-t ms] [-j threads] [-S simd] [-k filter] [-F format] [-o file]
+//        Microbenchmarks of the parts of a simulation step and of the visualization kernels, on a range of grid
+//        sizes. Every benchmark is repeated, each repetition calls the kernel as often as fits in the given time,
+//        and the statistics over the repetitions are written as JSON or CSV, so runs of different builds can be
+//        compared. 'make bench' runs it with the defaults and writes bench.json.
+//--------------------------------------------------------------------------------------------------
+#include <stdio.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include "model.h"              //Simulation part of the application
+#include "visualization.h"      //Visualization part of the application, only the kernels that do not draw
+
+// BenchResult: Time per call of one benchmark on one grid size, over all repetitions, in microseconds
+typedef struct bench_result {
+    std::string name;
+    int n;
+    int repetitions;
+    long iterations;            // calls per repetition
+    double min, median, mean, stddev, max;
+} BenchResult;
+
+// BenchOptions: What to run, and how often
+typedef struct bench_options {
+    std::vector<int> sizes;
+    int repetitions;
+    double repetition_ms;       // time of one repetition, the number of calls is chosen to fill it
+    std::string filter;         // only run the benchmarks whose name contains this
+} BenchOptions;
+
+void printUsage(const char* name)
+{
+    std::cout << "Usage: " << name << " [options]" << std::endl;
+    std::cout << "  -n SIZES      comma-separated grid sizes (default 64,128,256,512)" << std::endl;
+    std::cout << "  -r REPS       repetitions of every benchmark (default 10)" << std::endl;
+    std::cout << "  -t MS         duration of a repetition in milliseconds (default 20)" << std::endl;
+    std::cout << "  -j THREADS    number of simulation threads (default 1)" << std::endl;
+    std::cout << "  -S SIMD       advection kernel: scalar, avx2 or avx512 (default: best supported)" << std::endl;
+    std::cout << "  -k FILTER     only run the benchmarks whose name contains FILTER" << std::endl;
+    std::cout << "  -F FORMAT     output format: json or csv (default json)" << std::endl;
+    std::cout << "  -o FILE       write the results to FILE instead of standard output, and print a summary" << std::endl;
+    std::cout << "  -h            show this help" << std::endl;
+}
+
+// parse_sizes: Read a comma-separated list of grid sizes. Returns false if one is not a size.
+bool parse_sizes(const char* list, std::vector<int>& sizes)
+{
+    std::istringstream input(list);
+    std::string item;
+    sizes.clear();
+    while (std::getline(input, item, ','))
+    {
+        int n = atoi(item.c_str());
+        if (n < 2)
+            return false;
+        sizes.push_back(n);
+    }
+    return !sizes.empty();
+}
+
+// time_calls: Milliseconds 'iterations' calls of 'kernel' take
+double time_calls(const std::function<void()>& kernel, long iterations)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++)
+        kernel();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// run_benchmark: Time 'kernel' and append the statistics to 'results'. After a warm-up call, the number of calls per
+//                repetition is doubled until they take a quarter of a repetition, and then scaled up to fill one.
+void run_benchmark(const BenchOptions& options, const std::string& name, int n, const std::function<void()>& kernel,
+                   std::vector<BenchResult>& results)
+{
+    if (name.find(options.filter) == std::string::npos)
+        return;
+    kernel();
+    long iterations = 1;
+    double ms;
+    while ((ms = time_calls(kernel, iterations)) < options.repetition_ms / 4 && iterations < (1L << 30))
+        iterations *= 2;
+    iterations = std::max(1L, (long)(iterations * options.repetition_ms / std::max(ms, 1e-6)));
+
+    std::vector<double> times;
+    for (int r = 0; r < options.repetitions; r++)
+        times.push_back(1000.0 * time_calls(kernel, iterations) / iterations);
+    std::sort(times.begin(), times.end());
+
+    BenchResult result;
+    result.name = name;
+    result.n = n;
+    result.repetitions = options.repetitions;
+    result.iterations = iterations;
+    result.min = times.front();
+    result.max = times.back();
+    size_t middle = times.size() / 2;
+    result.median = times.size() % 2 ? times[middle] : 0.5 * (times[middle - 1] + times[middle]);
+    result.mean = 0.0;
+    for (double t : times)
+        result.mean += t;
+    result.mean /= times.size();
+    result.stddev = 0.0;
+    for (double t : times)
+        result.stddev += (t - result.mean) * (t - result.mean);
+    result.stddev = times.size() > 1 ? sqrt(result.stddev / (times.size() - 1)) : 0.0;
+    results.push_back(result);
+}
+
+// init_model: A swirling velocity field that carries a checkerboard of smoke, stepped until the history is full and
+//             seeded with a grid of stream tubes, so every kernel works on a realistic state
+void init_model(Model& model)
+{
+    const int n = model.DIM;
+    for (int j = 0; j < n; j++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            double x = 2.0 * M_PI * i / n, y = 2.0 * M_PI * j / n;
+            model.fx[i + n * j] = 0.5 * sin(y) * cos(x);
+            model.fy[i + n * j] = -0.5 * sin(x) * cos(y);
+            model.rho[i + n * j] = (i / 8 + j / 8) % 2 ? 1.0f : 0.0f;
+        }
+    }
+    for (unsigned int s = 0; s < model.history_size; s++)
+        model.do_one_simulation_step(n);
+    model.streamTubes.add_grid(0, 0, n - 1, n - 1, 8, 8, -(double)model.history_size);
+    model.streamtube_flow();
+}
+
+// benchmark_size: Run all benchmarks on an n x n grid
+void benchmark_size(Model& model, Visualization& vis, const BenchOptions& options, int n, std::vector<BenchResult>& results)
+{
+    model.resize(n);
+    init_model(model);
+    const fftw_real dt = model.dt;
+    fftw_real *vx = model.vx, *vy = model.vy, *vx0 = model.vx0, *vy0 = model.vy0;
+
+    // Model::solve, and its three parts: the advection, the FFT there and back, and the projection in between
+    run_benchmark(options, "solve", n, [&]() { model.solve(n, vx, vy, vx0, vy0, model.visc, dt); }, results);
+    const fftw_real* src[2] = {vx0, vy0};
+    fftw_real* dst[2] = {vx, vy};
+    run_benchmark(options, "solve/advection", n, [&]() { model.advect(n, vx0, vy0, dt, 2, src, dst); }, results);
+    run_benchmark(options, "solve/fft", n, [&]() {
+        model.kernels.pad(n, vx, vy, vx0, vy0);
+        model.FFT_velocity(1);
+        model.FFT_velocity(-1);
+    }, results);
+    model.build_filter(n, model.visc, dt);
+    model.kernels.pad(n, vx, vy, vx0, vy0);
+    model.FFT_velocity(1);
+    run_benchmark(options, "solve/projection", n, [&]() {
+        model.workers.run(0, n, [&](int j_begin, int j_end) { model.apply_filter_rows(n, vx0, vy0, j_begin, j_end); });
+    }, results);
+    model.resize(n);
+    init_model(model);
+    vx = model.vx; vy = model.vy; vx0 = model.vx0; vy0 = model.vy0;
+
+    run_benchmark(options, "diffuse_matter", n, [&]() { model.diffuse_matter(n, vx, vy, model.rho, model.rho0, dt); }, results);
+    run_benchmark(options, "set_forces", n, [&]() { model.set_forces(n); }, results);
+    run_benchmark(options, "compute_stats", n, [&]() { model.compute_stats(); }, results);
+    run_benchmark(options, "store_history", n, [&]() { model.store_history(); }, results);
+    // The tubes are only extended by new time slices, retrace them from scratch to time a full trace
+    run_benchmark(options, "streamtube_flow", n, [&]() {
+        model.streamTubes.reset();
+        model.streamtube_flow();
+    }, results);
+    run_benchmark(options, "do_one_simulation_step", n, [&]() { model.do_one_simulation_step(n); }, results);
+
+    FieldSnapshot frame;
+    model.view(frame);
+    std::vector<fftw_real> values;
+    values.reserve((size_t)n * n);
+    run_benchmark(options, "divergence", n, [&]() {
+        values.clear();
+        vis.divergence(frame.vx, frame.vy, values, n);
+    }, results);
+    const char* datasets[] = {"rho", "velocity", "force", "div_velocity", "div_force"};
+    const int dataset_idx[] = {Visualization::FLUID_DENSITY, Visualization::FLUID_VELOCITY, Visualization::FORCE_FIELD,
+                               Visualization::DIVERGENCE_VELOCITY, Visualization::DIVERGENCE_FORCE};
+    for (int d = 0; d < 5; d++)
+    {
+        fftw_real min, max;
+        run_benchmark(options, std::string("determineValuesMinMax/") + datasets[d], n, [&]() {
+            vis.determineValuesMinMax(&frame, dataset_idx[d], values, &min, &max);
+        }, results);
+    }
+}
+
+// write_json, write_csv: Write the results in a machine-readable format
+void write_json(FILE* out, const Model& model, const std::vector<BenchResult>& results)
+{
+    fprintf(out, "{\n  \"threads\": %d,\n  \"simd\": \"%s\",\n  \"fft\": \"%s\",\n  \"results\": [\n",
+            model.workers.size(), simd_name(model.simd_level), model.fft ? model.fft->name().c_str() : "");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult& r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"n\": %d, \"repetitions\": %d, \"iterations\": %ld, \"min_us\": %.4f, "
+                     "\"median_us\": %.4f, \"mean_us\": %.4f, \"stddev_us\": %.4f, \"max_us\": %.4f}%s\n",
+                r.name.c_str(), r.n, r.repetitions, r.iterations, r.min, r.median, r.mean, r.stddev, r.max,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+void write_csv(FILE* out, const std::vector<BenchResult>& results)
+{
+    fprintf(out, "name,n,repetitions,iterations,min_us,median_us,mean_us,stddev_us,max_us\n");
+    for (const BenchResult& r : results)
+        fprintf(out, "%s,%d,%d,%ld,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+                r.name.c_str(), r.n, r.repetitions, r.iterations, r.min, r.median, r.mean, r.stddev, r.max);
+}
+
+//main: The main program
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    options.sizes = {64, 128, 256, 512};
+    options.repetitions = 10;
+    options.repetition_ms = 20.0;
+    int threads = 1;
+    SIMD_LEVEL simd = simd_supported();
+    std::string format = "json";
+    const char* output = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:t:j:S:k:F:o:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                if (!parse_sizes(optarg, options.sizes))
+                {
+                    std::cerr << "Grid sizes must be at least 2: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'r': options.repetitions = atoi(optarg); break;
+            case 't': options.repetition_ms = atof(optarg); break;
+            case 'j': threads = atoi(optarg); break;
+            case 'S':
+                if (!parse_simd_level(optarg, simd))
+                {
+                    std::cerr << "Unknown SIMD level " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'k': options.filter = optarg; break;
+            case 'F': format = optarg; break;
+            case 'o': output = optarg; break;
+            case 'h':
+                printUsage(argv[0]);
+                return 0;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+    if (options.repetitions < 1 || options.repetition_ms <= 0.0 || threads < 1 || (format != "json" && format != "csv"))
+    {
+        std::cerr << "Repetitions, their duration and the threads must be positive, and the format json or csv" << std::endl;
+        return 1;
+    }
+
+    Model model(0);
+    model.history_size = 32;
+    model.set_num_threads(threads);
+    model.set_simd_level(simd);
+    Visualization vis(0, Visualization::COLOR_RAINBOW, 0, 1000.0f);
+    std::vector<BenchResult> results;
+    for (int n : options.sizes)
+    {
+        if (output)
+            std::cout << "Grid " << n << "x" << n << std::endl;
+        size_t first = results.size();
+        benchmark_size(model, vis, options, n, results);
+        for (size_t i = first; output && i < results.size(); i++)
+            printf("  %-34s %12.2f us  (+/- %.2f)\n", results[i].name.c_str(), results[i].median, results[i].stddev);
+    }
+
+    FILE* out = output ? fopen(output, "w") : stdout;
+    if (!out)
+    {
+        perror(output);
+        return 1;
+    }
+    if (format == "json")
+        write_json(out, model, results);
+    else
+        write_csv(out, results);
+    if (output && fclose(out) != 0)
+    {
+        perror(output);
+        return 1;
+    }
+    return 0;
+}
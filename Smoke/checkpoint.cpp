@@ -0,0 +1,265 @@
+#include "checkpoint.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <limits>
+
+static const char checkpoint_magic[8] = {'S', 'M', 'O', 'K', 'E', 'C', 'K', 'P'};
+static const uint32_t checkpoint_byte_order = 0x01020304;
+static const uint32_t checkpoint_max_n = 1 << 15;  // largest grid a checkpoint can hold, so n fits an int and n*n cells do not overflow
+
+//align: Round a file offset up to the next section boundary
+static uint64_t align(uint64_t offset)
+{
+    return (offset + 63) & ~(uint64_t)63;
+}
+
+//padded_cells: Number of reals in a padded field of the FFT, see Model::resize
+static size_t padded_cells(int n)
+{
+    return (size_t)n * 2*(n/2+1);
+}
+
+//layout: Fill in the section offsets and the size of a checkpoint with the sizes in 'header'. Returns false when
+//        the sizes do not fit in a file, which only a damaged header asks for.
+static bool layout(CheckpointHeader& header)
+{
+    // With n bounded the fields and the tubes take well under 2^64 bytes; only the history can still overflow
+    if (header.n < 2 || header.n > checkpoint_max_n)
+        return false;
+    uint64_t cells = (uint64_t)header.n * header.n;
+    uint64_t slice_bytes = 2 * cells * sizeof(fftw_real);
+    header.fields_offset = align(sizeof(CheckpointHeader));
+    header.tubes_offset = align(header.fields_offset + (6 * cells + 2 * padded_cells(header.n)) * sizeof(fftw_real));
+    header.history_offset = align(header.tubes_offset + 3 * (uint64_t)header.tubes * sizeof(double));
+    if (header.history_slices > (std::numeric_limits<uint64_t>::max() - header.history_offset) / slice_bytes)
+        return false;
+    header.file_bytes = header.history_offset + header.history_slices * slice_bytes;
+    return header.file_bytes <= std::numeric_limits<size_t>::max();
+}
+
+CheckpointWriter::CheckpointWriter() : copy_ms(0.0), writing(false), failed(false)
+{
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    wait();
+}
+
+//save: Copy the state of 'model' and start writing it to 'file'. Waits for the previous checkpoint first.
+void CheckpointWriter::save(const Model& model, const std::string& file, bool with_history)
+{
+    wait();
+    auto start = std::chrono::steady_clock::now();
+
+    const int n = model.DIM;
+    const size_t cells = (size_t)n * n;
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.byte_order = checkpoint_byte_order;
+    header.real_size = sizeof(fftw_real);
+    header.flags = with_history ? CHECKPOINT_HISTORY : 0;
+    header.n = n;
+    header.tubes = model.streamTubes.size();
+    header.step = model.step;
+    header.dt = model.dt;
+    header.visc = model.visc;
+    header.base_visc = model.base_visc;
+    header.visc_scale_factor = model.visc_scale_factor;
+    header.tube_disp_factor = model.tube_disp_factor;
+    header.tube_integrator = model.streamTubes.integrator();
+    header.tube_tolerance = model.streamTubes.tolerance();
+    header.history_size = model.history_size;
+    header.history_format = model.history_format;
+    header.history_slices = with_history ? model.history.size() : 0;
+    if (!layout(header))
+    {
+        // Reported by the next 'wait', like a failed write
+        error = "the " + std::to_string(n) + "x" + std::to_string(n) + " grid is too large for a checkpoint";
+        failed = true;
+        return;
+    }
+
+    buffer.assign(header.file_bytes, 0);
+    memcpy(&buffer[0], &header, sizeof(header));
+
+    fftw_real* fields = (fftw_real*)&buffer[header.fields_offset];
+    const fftw_real* cell_fields[6] = {model.vx, model.vy, model.fx, model.fy, model.rho, model.rho0};
+    for (int k = 0; k < 6; k++, fields += cells)
+        memcpy(fields, cell_fields[k], cells * sizeof(fftw_real));
+    memcpy(fields, model.vx0, 2 * padded_cells(n) * sizeof(fftw_real));
+
+    double* seeds = (double*)&buffer[header.tubes_offset];
+    for (int t = 0; t < model.streamTubes.size(); t++)
+    {
+        Point3d seed = model.streamTubes.seed(t);
+        seeds[3*t] = seed.x; seeds[3*t+1] = seed.y; seeds[3*t+2] = seed.z;
+    }
+
+    fftw_real* slices = (fftw_real*)&buffer[header.history_offset];
+    for (unsigned int i = 0; i < header.history_slices; i++, slices += 2 * cells)
+        model.history.decode(i, slices, slices + cells);
+
+    copy_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    failed = false;
+    writing = true;
+    writer = std::thread(&CheckpointWriter::write, this, file);
+}
+
+//write: Write the buffer to a temporary file next to 'file', and rename it once it is complete, so an interrupted
+//       write never leaves a broken checkpoint behind
+void CheckpointWriter::write(std::string file)
+{
+    std::string temporary = file + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        error = "cannot create " + temporary + " (" + strerror(errno) + ")";
+        failed = true;
+        writing = false;
+        return;
+    }
+    size_t done = 0;
+    while (done < buffer.size())
+    {
+        ssize_t written = ::write(fd, &buffer[done], buffer.size() - done);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+        {
+            error = "cannot write " + temporary + " (" + strerror(errno) + ")";
+            failed = true;
+            break;
+        }
+        done += written;
+    }
+    if (close(fd) != 0 && !failed)
+    {
+        error = "cannot write " + temporary + " (" + strerror(errno) + ")";
+        failed = true;
+    }
+    if (!failed && rename(temporary.c_str(), file.c_str()) != 0)
+    {
+        error = "cannot rename " + temporary + " to " + file + " (" + strerror(errno) + ")";
+        failed = true;
+    }
+    if (failed)
+        unlink(temporary.c_str());
+    writing = false;
+}
+
+//wait: Wait until the checkpoint is written. Returns false, with the reason in 'error', when writing failed.
+bool CheckpointWriter::wait()
+{
+    if (writer.joinable())
+        writer.join();
+    return !failed;
+}
+
+//check_header: Whether 'header' describes a checkpoint of 'bytes' bytes this build can load
+static bool check_header(const CheckpointHeader& header, size_t bytes, std::string& error)
+{
+    if (memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0)
+        error = "not a checkpoint";
+    else if (header.byte_order != checkpoint_byte_order)
+        error = "written on a machine with a different byte order";
+    else if (header.version != CHECKPOINT_VERSION)
+        error = "checkpoint version " + std::to_string(header.version) + ", this build reads version " + std::to_string(CHECKPOINT_VERSION);
+    else if (header.real_size != sizeof(fftw_real))
+        error = "written by a " + std::string(header.real_size == sizeof(double) ? "double" : "single") + " precision build";
+    else if (header.n < 2 || header.n > checkpoint_max_n || header.history_size < 1 || header.history_slices > header.history_size ||
+             header.history_format > HISTORY_Q8 || header.tube_integrator > TUBE_RK45)
+        error = "invalid parameters";
+    else
+    {
+        CheckpointHeader sections = header;
+        if (!layout(sections) || sections.fields_offset != header.fields_offset || sections.tubes_offset != header.tubes_offset ||
+            sections.history_offset != header.history_offset || sections.file_bytes != header.file_bytes)
+            error = "invalid sections";
+        else if (header.file_bytes > bytes)
+            error = "truncated";
+        else
+            return true;
+    }
+    return false;
+}
+
+//load_checkpoint: Replace the state of 'model' by the checkpoint in 'file'
+bool load_checkpoint(Model& model, const std::string& file, std::string& error)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        error = file + ": " + strerror(errno);
+        return false;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(CheckpointHeader))
+    {
+        error = file + ": not a checkpoint";
+        close(fd);
+        return false;
+    }
+    size_t bytes = status.st_size;
+    void* map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        error = file + ": " + strerror(errno);
+        return false;
+    }
+    madvise(map, bytes, MADV_SEQUENTIAL);
+
+    const unsigned char* data = (const unsigned char*)map;
+    CheckpointHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (!check_header(header, bytes, error))
+    {
+        error = file + ": " + error;
+        munmap(map, bytes);
+        return false;
+    }
+
+    // The history is allocated for the checkpoint's size and format by resize, which also forgets the tube tails
+    const int n = header.n;
+    const size_t cells = (size_t)n * n;
+    model.history_size = header.history_size;
+    model.history_format = (HISTORY_FORMAT)header.history_format;
+    model.dt = header.dt;
+    model.visc = header.visc;
+    model.base_visc = header.base_visc;
+    model.visc_scale_factor = header.visc_scale_factor;
+    model.invalidate_filter();
+    model.tube_disp_factor = header.tube_disp_factor;
+    model.streamTubes.set_integrator((TUBE_INTEGRATOR)header.tube_integrator, header.tube_tolerance);
+    model.resize(n);
+
+    const fftw_real* fields = (const fftw_real*)(data + header.fields_offset);
+    fftw_real* cell_fields[6] = {model.vx, model.vy, model.fx, model.fy, model.rho, model.rho0};
+    for (int k = 0; k < 6; k++, fields += cells)
+        memcpy(cell_fields[k], fields, cells * sizeof(fftw_real));
+    memcpy(model.vx0, fields, 2 * padded_cells(n) * sizeof(fftw_real));
+
+    model.streamTubes.clear();
+    const double* seeds = (const double*)(data + header.tubes_offset);
+    for (unsigned int t = 0; t < header.tubes; t++)
+        model.streamTubes.add(seeds[3*t], seeds[3*t+1], seeds[3*t+2]);
+
+    // Compressed slices are encoded again from their decoded values, which may round them slightly differently
+    const fftw_real* slices = (const fftw_real*)(data + header.history_offset);
+    for (unsigned int i = 0; i < header.history_slices; i++, slices += 2 * cells)
+        model.history.push(slices, slices + cells);
+
+    model.step = header.step;
+    model.compute_stats();
+    munmap(map, bytes);
+    return true;
+}
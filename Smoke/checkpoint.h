@@ -0,0 +1,77 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "model.h"
+
+#define CHECKPOINT_VERSION 1
+
+// Flags of a checkpoint
+#define CHECKPOINT_HISTORY 1    // the velocity history is included, so the stream tubes continue where they were
+
+// A checkpoint file: the header, then every section at a multiple of 64 bytes from the start of the file.
+// All numbers are stored in the byte order of the machine that wrote them, which 'byte_order' records.
+typedef struct checkpoint_header {
+    char magic[8];              // "SMOKECKP"
+    uint32_t version;           // CHECKPOINT_VERSION
+    uint32_t byte_order;        // 0x01020304
+    uint32_t real_size;         // sizeof(fftw_real)
+    uint32_t flags;
+    uint32_t n;                 // grid size
+    uint32_t tubes;             // number of stream tube seeds
+    uint64_t step;
+    double dt;
+    float visc, base_visc, visc_scale_factor;
+    int32_t tube_disp_factor;
+    uint32_t tube_integrator;
+    double tube_tolerance;
+    uint32_t history_size, history_format;
+    uint32_t history_slices;    // stored time slices, oldest first, decoded to n x n reals per field
+    uint32_t reserved;
+    uint64_t fields_offset;     // vx, vy, fx, fy, rho, rho0 (n x n reals each), then vx0, vy0 (padded to n x 2*(n/2+1))
+    uint64_t tubes_offset;      // seed x, y and z of every tube (doubles)
+    uint64_t history_offset;
+    uint64_t file_bytes;
+} CheckpointHeader;
+
+// CheckpointWriter: Writes checkpoints on a thread of its own. 'save' copies the state of the model into a buffer
+//                   laid out like the file, which is fast; the solver can step on while the buffer is written.
+//                   The file appears under its name only once it is complete.
+class CheckpointWriter {
+public:
+    CheckpointWriter();
+    ~CheckpointWriter();
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    //save: Copy the state of 'model' and start writing it to 'file'. Waits for the previous checkpoint first.
+    //      The model must not step while it is copied.
+    void save(const Model& model, const std::string& file, bool with_history);
+
+    //wait: Wait until the checkpoint is written. Returns false, with the reason in 'error', when writing failed.
+    bool wait();
+
+    //busy: Whether a checkpoint is still being written. Can be asked from any thread.
+    bool busy() const { return writing.load(std::memory_order_acquire); }
+
+    std::string error;          // why writing failed, only valid after 'wait' returned false
+    double copy_ms;             // time 'save' kept the caller waiting for the copy
+
+private:
+    void write(std::string file);
+
+    std::vector<unsigned char> buffer;
+    std::thread writer;
+    std::atomic<bool> writing;
+    std::atomic<bool> failed;
+};
+
+//load_checkpoint: Replace the state of 'model' by the checkpoint in 'file', which is mapped into memory rather than
+//                 read. Returns false, with the reason in 'error', when the file is not a checkpoint this build can
+//                 load; the model is then left as it was.
+bool load_checkpoint(Model& model, const std::string& file, std::string& error);
+
+#endif
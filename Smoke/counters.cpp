@@ -0,0 +1,107 @@
+#include "counters.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+//counter_name: Human-readable name of a counter
+const char* counter_name(PERF_COUNTER counter)
+{
+    switch (counter)
+    {
+        case COUNTER_CYCLES:        return "cycles";
+        case COUNTER_INSTRUCTIONS:  return "instructions";
+        case COUNTER_LLC_MISSES:    return "LLC misses";
+        case COUNTER_BRANCH_MISSES: return "branch misses";
+        default:                    return "unknown";
+    }
+}
+
+PerfCounters::PerfCounters() : leader(-1), num_open(0)
+{
+    for (int c = 0; c < NUM_COUNTERS; c++)
+        fds[c] = -1;
+}
+
+PerfCounters::~PerfCounters()
+{
+    close();
+}
+
+//open: Start counting the calling thread
+bool PerfCounters::open(std::string& error)
+{
+    close();
+#ifdef __linux__
+    // The last level cache misses are the generic cache misses event, which the kernel maps to the LLC
+    const uint64_t configs[NUM_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    int first_errno = 0;
+    for (int c = 0; c < NUM_COUNTERS; c++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[c];
+        attr.disabled = leader < 0;             // the group starts when the leader is enabled
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        int fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+        if (fd < 0)
+        {
+            if (!first_errno)
+                first_errno = errno;
+            continue;
+        }
+        if (leader < 0)
+            leader = fd;
+        fds[c] = fd;
+        order[num_open++] = c;
+    }
+    if (leader < 0)
+    {
+        error = std::string("perf_event_open: ") + strerror(first_errno);
+        if (first_errno == EACCES || first_errno == EPERM)
+            error += " (lower /proc/sys/kernel/perf_event_paranoid to count user space without privileges)";
+        return false;
+    }
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    error = "hardware counters need Linux";
+    return false;
+#endif
+}
+
+void PerfCounters::close()
+{
+    for (int c = 0; c < NUM_COUNTERS; c++)
+    {
+        if (fds[c] >= 0)
+            ::close(fds[c]);
+        fds[c] = -1;
+    }
+    leader = -1;
+    num_open = 0;
+}
+
+//read: The current values, 0 for the counters that are not available
+void PerfCounters::read(CounterValues& values) const
+{
+    memset(&values, 0, sizeof(values));
+    if (leader < 0)
+        return;
+    // A group read returns the number of counters, followed by their values in the order they were opened
+    uint64_t buffer[1 + NUM_COUNTERS];
+    if (::read(leader, buffer, sizeof(buffer)) < (ssize_t)sizeof(uint64_t))
+        return;
+    for (int i = 0; i < num_open && i < (int)buffer[0]; i++)
+        values.value[order[i]] = buffer[1 + i];
+}
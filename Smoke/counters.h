@@ -0,0 +1,45 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+#include <stdint.h>
+#include <string>
+
+// Hardware performance counters, read with perf_event_open on Linux. A kernel that does not allow them
+// (see /proc/sys/kernel/perf_event_paranoid), a virtual machine without a PMU, or another platform leaves them off.
+enum PERF_COUNTER {COUNTER_CYCLES = 0, COUNTER_INSTRUCTIONS, COUNTER_LLC_MISSES, COUNTER_BRANCH_MISSES, NUM_COUNTERS};
+
+//counter_name: Human-readable name of a counter
+const char* counter_name(PERF_COUNTER counter);
+
+// CounterValues: A value of every counter
+typedef struct counter_values {
+    uint64_t value[NUM_COUNTERS];
+} CounterValues;
+
+// PerfCounters: The counters of one thread, in user space only, read together as one group
+class PerfCounters {
+public:
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    //open: Start counting the calling thread. Counters the CPU does not have are left out. Returns false, with the
+    //      reason in 'error', when no counter can be opened.
+    bool open(std::string& error);
+    void close();
+    bool opened() const { return leader >= 0; }
+
+    //available: Whether 'counter' is counted
+    bool available(PERF_COUNTER counter) const { return fds[counter] >= 0; }
+
+    //read: The current values, 0 for the counters that are not available
+    void read(CounterValues& values) const;
+
+private:
+    int leader;
+    int fds[NUM_COUNTERS];
+    int order[NUM_COUNTERS];    // counter of every value in a group read, in the order the counters were opened
+    int num_open;
+};
+
+#endif
@@ -0,0 +1,142 @@
+#include "fft.h"
+#include <stdio.h>
+#include <chrono>
+#include <sstream>
+#ifdef FFTW_THREADS
+#include <rfftw_threads.h>
+#endif
+
+FFTW2Backend::FFTW2Backend(int n, const FFTOptions& options, WorkerPool* workers) : options(options), workers(workers)
+{
+    // FFTW 2 only knows estimating and measuring; patient planning measures as well.
+    // Plans are thread-safe so the workers can execute them concurrently.
+    int flags = FFTW_IN_PLACE | FFTW_THREADSAFE | FFTW_USE_WISDOM;
+    flags |= options.planning == FFT_ESTIMATE ? FFTW_ESTIMATE : FFTW_MEASURE;
+
+    auto start = std::chrono::steady_clock::now();
+    plan_rc = rfftw2d_create_plan(n, n, FFTW_REAL_TO_COMPLEX, flags);
+    plan_cr = rfftw2d_create_plan(n, n, FFTW_COMPLEX_TO_REAL, flags);
+    auto end = std::chrono::steady_clock::now();
+    planning_ms = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+FFTW2Backend::~FFTW2Backend()
+{
+    rfftwnd_destroy_plan(plan_rc);
+    rfftwnd_destroy_plan(plan_cr);
+}
+
+std::string FFTW2Backend::name()
+{
+    std::ostringstream out;
+    out << "FFTW2 (" << fft_planning_name(options.planning) << ", " << options.num_threads << " thread"
+        << (options.num_threads == 1 ? "" : "s") << ", planned in " << planning_ms << " ms)";
+    return out.str();
+}
+
+void FFTW2Backend::set_num_threads(int num_threads)
+{
+    options.num_threads = num_threads;
+}
+
+// In-place transforms read the padded reals and write complex numbers at the same place, so the distance
+// between two fields of a batch is 'dist' reals for the input and dist/2 complex numbers for the output.
+
+void FFTW2Backend::forward(fftw_real* data, int howmany, int dist)
+{
+#ifdef FFTW_THREADS
+    if (options.num_threads > 1)
+    {
+        rfftwnd_threads_real_to_complex(options.num_threads, plan_rc, howmany, data, 1, dist, (fftw_complex*)data, 1, dist / 2);
+        return;
+    }
+#endif
+    if (workers && options.num_threads > 1 && howmany > 1)
+    {
+        workers->run(0, howmany, [=](int begin, int end) {
+            rfftwnd_real_to_complex(plan_rc, end - begin, data + begin * dist, 1, dist, (fftw_complex*)(data + begin * dist), 1, dist / 2);
+        });
+        return;
+    }
+    rfftwnd_real_to_complex(plan_rc, howmany, data, 1, dist, (fftw_complex*)data, 1, dist / 2);
+}
+
+void FFTW2Backend::inverse(fftw_real* data, int howmany, int dist)
+{
+#ifdef FFTW_THREADS
+    if (options.num_threads > 1)
+    {
+        rfftwnd_threads_complex_to_real(options.num_threads, plan_cr, howmany, (fftw_complex*)data, 1, dist / 2, data, 1, dist);
+        return;
+    }
+#endif
+    if (workers && options.num_threads > 1 && howmany > 1)
+    {
+        workers->run(0, howmany, [=](int begin, int end) {
+            rfftwnd_complex_to_real(plan_cr, end - begin, (fftw_complex*)(data + begin * dist), 1, dist / 2, data + begin * dist, 1, dist);
+        });
+        return;
+    }
+    rfftwnd_complex_to_real(plan_cr, howmany, (fftw_complex*)data, 1, dist / 2, data, 1, dist);
+}
+
+//create_fft_backend: Create the FFT backend for an n x n grid, using the wisdom file when there is one
+FFTBackend* create_fft_backend(int n, const FFTOptions& options, WorkerPool* workers)
+{
+#ifdef FFTW_THREADS
+    static bool threads_initialized = false;
+    if (!threads_initialized && options.num_threads > 1)
+        threads_initialized = fftw_threads_init() == 0;
+#endif
+    if (!options.wisdom_file.empty())
+    {
+        FILE* file = fopen(options.wisdom_file.c_str(), "r");
+        if (file)
+        {
+            if (fftw_import_wisdom_from_file(file) != FFTW_SUCCESS)
+                fprintf(stderr, "Ignoring invalid FFTW wisdom in %s\n", options.wisdom_file.c_str());
+            fclose(file);
+        }
+    }
+
+    FFTBackend* backend = new FFTW2Backend(n, options, workers);
+
+    if (!options.wisdom_file.empty() && options.planning != FFT_ESTIMATE)
+    {
+        FILE* file = fopen(options.wisdom_file.c_str(), "w");
+        if (file)
+        {
+            fftw_export_wisdom_to_file(file);
+            fclose(file);
+        }
+        else
+            fprintf(stderr, "Could not save FFTW wisdom to %s\n", options.wisdom_file.c_str());
+    }
+    return backend;
+}
+
+//fft_planning_name: Human-readable name of a planning level
+const char* fft_planning_name(FFT_PLANNING planning)
+{
+    switch (planning)
+    {
+        case FFT_MEASURE: return "measure";
+        case FFT_PATIENT: return "patient";
+        case FFT_ESTIMATE:
+        default:          return "estimate";
+    }
+}
+
+//parse_fft_planning: Convert the name of a planning level to the level. Returns false for unknown names.
+bool parse_fft_planning(const char* name, FFT_PLANNING& planning)
+{
+    for (int i = FFT_ESTIMATE; i <= FFT_PATIENT; i++)
+    {
+        if (std::string(fft_planning_name((FFT_PLANNING)i)) == name)
+        {
+            planning = (FFT_PLANNING)i;
+            return true;
+        }
+    }
+    return false;
+}
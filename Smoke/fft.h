@@ -0,0 +1,56 @@
+#ifndef FFT_H
+#define FFT_H
+#include <rfftw.h>              //the numerical simulation FFTW library
+#include <string>
+#include "workers.h"
+
+// How much time the backend may spend finding a fast transform for the grid size
+enum FFT_PLANNING {FFT_ESTIMATE = 0, FFT_MEASURE, FFT_PATIENT};
+
+typedef struct fft_options {
+    FFT_PLANNING planning;
+    int num_threads;            // threads per transform, or per batch of transforms
+    std::string wisdom_file;    // planner results are loaded from and saved to this file, empty for none
+} FFTOptions;
+
+// FFTBackend: In-place 2D real <-> complex transforms of n x n fields, stored with rows padded to 2*(n/2+1) reals.
+//             Batches of fields lie 'dist' reals apart in memory. The inverse transform is not normalized.
+class FFTBackend {
+public:
+    virtual ~FFTBackend() {}
+    virtual std::string name() = 0;
+    virtual void set_num_threads(int num_threads) = 0;
+    virtual void forward(fftw_real* data, int howmany, int dist) = 0;
+    virtual void inverse(fftw_real* data, int howmany, int dist) = 0;
+};
+
+// FFTW2Backend: FFTW 2 rfftwnd plans. The transforms of a batch are split over the workers, or over FFTW's own
+//               threads when the build defines FFTW_THREADS and links the FFTW threads library.
+class FFTW2Backend : public FFTBackend {
+public:
+    FFTW2Backend(int n, const FFTOptions& options, WorkerPool* workers);
+    ~FFTW2Backend();
+    std::string name();
+    void set_num_threads(int num_threads);
+    void forward(fftw_real* data, int howmany, int dist);
+    void inverse(fftw_real* data, int howmany, int dist);
+
+    double planning_ms;         // time spent creating the plans
+
+private:
+    FFTOptions options;
+    WorkerPool* workers;
+    rfftwnd_plan plan_rc, plan_cr;
+};
+
+//create_fft_backend: Create the FFT backend for an n x n grid. Loads the wisdom file before planning, and
+//                    saves it afterwards so the next start does not have to plan again.
+FFTBackend* create_fft_backend(int n, const FFTOptions& options, WorkerPool* workers);
+
+//fft_planning_name: Human-readable name of a planning level
+const char* fft_planning_name(FFT_PLANNING planning);
+
+//parse_fft_planning: Convert the name of a planning level to the level. Returns false for unknown names.
+bool parse_fft_planning(const char* name, FFT_PLANNING& planning);
+
+#endif
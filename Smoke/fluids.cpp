@@ -6,12 +6,37 @@
 #include <chrono>
 #include <thread>
 #include <sstream>
+#include <algorithm>
+#include <functional>
+#include <cstdlib>
+#include <unistd.h>
 #include "fluids.h"
 #include "model.h"              //Simulation part of the application
 #include "visualization.h"      //Visualization part of the application
+#include "simulation.h"         //Simulation on its own thread
+#include "checkpoint.h"         //Saving and restoring the simulation state
 
-const int DIM = 50;             //size of simulation grid
+int DIM = 50;                   //size of simulation grid, can be set with -n at startup
 Model model(DIM);
+SimulationThread simulation(&model);
+bool threaded = false;          //run the simulation on its own thread, set with -T at startup
+int tube_disp_factor = 10;      //copied to the model before the next step, see glui_callback
+float step_rate = 0.0f;         //simulation steps per second, 0 for one step per frame. Set with -r or the GUI.
+int tube_integrator = TUBE_EULER; //stream tube integrator and its tolerance, set with -I or the GUI
+float tube_tolerance = 1e-3f;
+int seed_count = 16;            //seeds per rake, and per side of a seed grid
+float rake_x, rake_y;           //first end of the seed rake being placed
+CheckpointWriter checkpoint;    //writes the checkpoints in the background
+std::string checkpoint_file = "smoke.ckp"; //file the GUI saves to and loads from, set with -k
+std::string startup_checkpoint; //checkpoint to start from, set with -l
+int checkpoint_history = 0;     //include the velocity time slices in the checkpoints
+std::string record_file;        //recording of the injections of this session, set with -R
+std::string replay_file;        //recording or script to replay, set with -p
+InjectionRecorder recorder;
+InjectionReplay replay;
+PhaseTimers timers;             //durations of the phases of the simulation steps and of drawing
+std::string timings_file;       //CSV file that receives every duration, set with -c
+std::string trace_file;         //Chrome trace-event file, set with -E to record a trace
 Visualization vis(0, vis.COLOR_RAINBOW, 0, 1000.0f);
 
 int window = -1; // Window ID for GLUT/GLUI
@@ -24,6 +49,97 @@ void printStart()
     return;
 }
 
+void printUsage(const char* name)
+{
+    std::cout << "Usage: " << name << " [options]" << std::endl;
+    std::cout << "  -n DIM        size of the simulation grid (default 50)" << std::endl;
+    std::cout << "  -H SLICES     number of velocity time slices kept for stream tubes (default 100)" << std::endl;
+    std::cout << "  -F FILE       keep the time slices in a memory-mapped FILE instead of in memory" << std::endl;
+    std::cout << "  -C FORMAT     storage of the time slices: float, half, q16, q12 or q8 (default float)" << std::endl;
+    std::cout << "  -j THREADS    number of advection threads (default 1)" << std::endl;
+    std::cout << "  -P PLANNING   FFT planning: estimate, measure or patient (default estimate)" << std::endl;
+    std::cout << "  -W FILE       load FFT wisdom from FILE, and save it after planning" << std::endl;
+    std::cout << "  -I METHOD     stream tube integrator: euler, rk2, rk4 or rk45 (default euler)" << std::endl;
+    std::cout << "  -r RATE       simulation steps per second, independent of the frame rate (default 0: one step per frame)" << std::endl;
+    std::cout << "  -k FILE       checkpoint file of the save and load buttons (default smoke.ckp)" << std::endl;
+    std::cout << "  -l FILE       start from the checkpoint in FILE, which replaces -n, -H and -C" << std::endl;
+    std::cout << "  -R FILE       record the mouse injections to FILE, for replaying them with -p or smoke-headless -f" << std::endl;
+    std::cout << "  -p FILE       replay the injections of a recording, or a script of lines \"step x y fx fy rho\"" << std::endl;
+    std::cout << "  -c FILE       write the duration of every simulation and drawing phase to the CSV file FILE" << std::endl;
+    std::cout << "  -E FILE       record a trace of the simulation and drawing, written to FILE in the Chrome trace-event" << std::endl;
+    std::cout << "                format at exit and when 'd' is pressed" << std::endl;
+    std::cout << "  -T            run the simulation on its own thread, the window draws the latest finished step" << std::endl;
+    std::cout << "  -h            show this help" << std::endl;
+}
+
+// parse_arguments: Read the startup options. Returns false if the program should exit.
+bool parse_arguments(int argc, char **argv, int& exit_code)
+{
+    int opt;
+    exit_code = 0;
+    while ((opt = getopt(argc, argv, "n:H:C:F:j:P:W:I:r:k:l:R:p:c:E:Th")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': DIM = atoi(optarg); break;
+            case 'H': model.history_size = atoi(optarg); break;
+            case 'F': model.history_file = optarg; break;
+            case 'C':
+                if (!parse_history_format(optarg, model.history_format))
+                {
+                    std::cerr << "Unknown history format " << optarg << std::endl;
+                    exit_code = 1;
+                    return false;
+                }
+                break;
+            case 'j': model.set_num_threads(atoi(optarg)); break;
+            case 'P':
+                if (!parse_fft_planning(optarg, model.fft_options.planning))
+                {
+                    std::cerr << "Unknown FFT planning " << optarg << std::endl;
+                    exit_code = 1;
+                    return false;
+                }
+                break;
+            case 'W': model.fft_options.wisdom_file = optarg; break;
+            case 'I':
+            {
+                TUBE_INTEGRATOR integrator;
+                if (!parse_tube_integrator(optarg, integrator))
+                {
+                    std::cerr << "Unknown stream tube integrator " << optarg << std::endl;
+                    exit_code = 1;
+                    return false;
+                }
+                tube_integrator = integrator;
+                break;
+            }
+            case 'r': step_rate = atof(optarg); break;
+            case 'k': checkpoint_file = optarg; break;
+            case 'l': startup_checkpoint = optarg; break;
+            case 'R': record_file = optarg; break;
+            case 'p': replay_file = optarg; break;
+            case 'c': timings_file = optarg; break;
+            case 'E': trace_file = optarg; break;
+            case 'T': threaded = true; break;
+            case 'h':
+                printUsage(argv[0]);
+                return false;
+            default:
+                printUsage(argv[0]);
+                exit_code = 1;
+                return false;
+        }
+    }
+    if (DIM < 2 || (int)model.history_size < 1 || step_rate < 0.0f)
+    {
+        std::cerr << "Grid size must be at least 2, the history at least 1 and the step rate non-negative" << std::endl;
+        exit_code = 1;
+        return false;
+    }
+    return true;
+}
+
 void calcFPS(int theTimeInterval = 1000, std::string theWindowTitle = "NONE")
 {
     // Static values which only get initialised the first time the function runs
@@ -46,6 +162,19 @@ void calcFPS(int theTimeInterval = 1000, std::string theWindowTitle = "NONE")
         // Append the FPS value to the window title details
         theWindowTitle += " | FPS: " + fpsStr;
 
+        // With a fixed step rate, also show how far the simulation is behind the wall clock
+        if (step_rate > 0.0f)
+        {
+            char lag[64];
+            if (simulation.running())
+                snprintf(lag, sizeof(lag), " | lag: %.0f ms, dropped %lu steps", 1000.0 * simulation.lag.load(),
+                         simulation.dropped_steps.load());
+            else
+                snprintf(lag, sizeof(lag), " | lag: %.0f ms, dropped %lu steps", 1000.0 * simulation.scheduler.lag(),
+                         simulation.scheduler.dropped_steps);
+            theWindowTitle += lag;
+        }
+
         // Convert the new window title to a c_str and set it
         const char* pszConstString = theWindowTitle.c_str();
         glutSetWindowTitle(pszConstString);
@@ -64,6 +193,7 @@ const float dist = 0.5f * depth;
 //display: Handle window redrawing events. Simply delegates to visualize().
 void display(void)
 {
+    TraceScope trace("display");
     int tx, ty, tw, th;
     GLUI_Master.get_viewport_area( &tx, &ty, &tw, &th );
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -89,7 +219,14 @@ void display(void)
     // Translate to the middle of the simulation coordinates.
     glTranslatef(-0.5 * tw, -0.5 * th, 0.0f);
 
-    vis.visualize(&model);
+    // Draw the latest snapshot of the simulation thread, or the model itself when it steps in the idle callback
+    FieldSnapshot live;
+    const FieldSnapshot* frame = &live;
+    if (simulation.running())
+        frame = simulation.snapshots.front();
+    else
+        model.view(live);
+    vis.visualize(frame, model.winWidth, model.winHeight);
 
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
@@ -103,6 +240,8 @@ void display(void)
         vis.draw_color_legend(vis.min, vis.max);
     else
         vis.draw_color_legend(vis.min_clamp_value, vis.max_clamp_value);
+    if (vis.showTimings)
+        vis.draw_timings(timers);
 
     glFlush();
     calcFPS(1000, "Real-time smoke simulation and visualization");
@@ -164,35 +303,133 @@ void drag(int mx, int my)
         dx *= 0.1 / len;
         dy *= 0.1 / len;
     }
-    model.fx[Y * DIM + X] += dx;
-    model.fy[Y * DIM + X] += dy;
-    model.rho[Y * DIM + X] = 10.0f;
+    if (simulation.running())
+        simulation.inject(X, Y, dx, dy, 10.0f);
+    else
+        model.inject(X, Y, dx, dy, 10.0f);
     lmx = mx;
     lmy = my;
 }
 
+// keyboard: 't' toggles the timings overlay, 'd' writes the trace recorded so far
+void keyboard(unsigned char key, int x, int y)
+{
+    std::string error;
+    switch (key)
+    {
+        case 't':
+            vis.showTimings = !vis.showTimings;
+            GLUI_Master.sync_live_all();
+            glutPostRedisplay();
+            break;
+        case 'd':
+            if (!trace_enabled())
+                std::cout << "Not tracing, start with -E FILE to record a trace" << std::endl;
+            else if (trace_dump(error))
+                std::cout << "Wrote trace " << trace_file << std::endl;
+            else
+                std::cerr << "Could not write trace " << error << std::endl;
+            break;
+        default:
+            break;
+    }
+}
+
 void do_one_step(void)
 {
-    if (!vis.frozen)
+    TraceScope trace("do_one_step");
+    if (simulation.running())
     {
-        model.do_one_simulation_step(DIM);
-        // Window has to be set explicitly, otherwise
-        // the redisplay might be sent to the GLUI window
-        // in stead of the GLUT window.
-        glutSetWindow(window);
-        glutPostRedisplay();
+        // The simulation thread steps on its own, only redraw when it finished a new step
+        simulation.set_paused(vis.frozen);
+        if (simulation.snapshots.fresh())
+        {
+            glutSetWindow(window);
+            glutPostRedisplay();
+        }
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    else if (!vis.frozen)
+    {
+        // Run as many steps as the scheduler asks for, and only draw once the simulation caught up
+        int due = simulation.scheduler.steps_due();
+        for (int i = 0; i < due; i++)
+            model.do_one_simulation_step(DIM);
+        if (due == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        else if (!simulation.scheduler.skip_frame())
+        {
+            // Window has to be set explicitly, otherwise
+            // the redisplay might be sent to the GLUI window
+            // in stead of the GLUT window.
+            glutSetWindow(window);
+            glutPostRedisplay();
+        }
     }
     else
     {
+        simulation.scheduler.reset();
         // Sleep, otherwise we use too much CPU.
         std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
 }
 
+// load_state: Replace the simulation by the checkpoint in 'file', and take over its grid size and stream tube settings.
+//             The caller holds the simulation lock. Returns false, leaving everything as it was, when the file cannot be loaded.
+bool load_state(const std::string& file)
+{
+    std::string error;
+    if (!load_checkpoint(model, file, error))
+    {
+        std::cerr << "Could not load checkpoint " << error << std::endl;
+        return false;
+    }
+    if (model.DIM != DIM && (recorder.recording() || model.replay))
+    {
+        // Recordings and replays are made for one grid size
+        std::cerr << "The grid size changed, stopped recording and replaying injections" << std::endl;
+        recorder.close();
+        model.recorder = NULL;
+        model.replay = NULL;
+    }
+    DIM = model.DIM;
+    vis.init_jitter(DIM);
+    // The glyphs index the jitter of the new grid, and the seeds the new history
+    vis.num_x_glyphs = std::min(vis.num_x_glyphs, DIM);
+    vis.num_y_glyphs = std::min(vis.num_y_glyphs, DIM);
+    vis.zval = std::max(vis.zval, -(int)model.history_size);
+    if (xsamples)               //NULL when loading at startup, before the GUI exists
+    {
+        xsamples->set_int_limits(0, DIM);
+        ysamples->set_int_limits(0, DIM);
+        z_value_spinner->set_int_limits(-model.history_size, 0);
+    }
+    tube_disp_factor = model.tube_disp_factor;
+    tube_integrator = model.streamTubes.integrator();
+    tube_tolerance = model.streamTubes.tolerance();
+    std::cout << "Loaded checkpoint " << file << ": " << DIM << "x" << DIM << " grid at step " << model.step << std::endl;
+    return true;
+}
+
+// edit_model: Change the model with 'edit'. The simulation thread runs it before its next step, so the GUI does not
+//             wait for the step that is running; without the thread it runs right away.
+void edit_model(std::function<void()> edit)
+{
+    if (simulation.running())
+        simulation.post(edit);
+    else
+        edit();
+}
+
 // some controls generate a callback when they are changed
 void glui_callback(int control)
 {
     int oldNum = vis.numColors;
+    float visc_scale_factor = model.visc_scale_factor;
+    int zval = vis.zval, count = seed_count, disp_factor = tube_disp_factor, integrator = tube_integrator;
+    float tolerance = tube_tolerance, rate = step_rate;
+    int grid = DIM;
     switch(control)
     {
         case HEDGEHOG_SPINNER_ID:
@@ -200,7 +437,10 @@ void glui_callback(int control)
             break;
 
         case VISCOSITY_SPINNER_ID:
-            model.visc = model.base_visc * model.visc_scale_factor;
+            edit_model([=]() {
+                model.visc = model.base_visc * visc_scale_factor;
+                model.invalidate_filter();
+            });
             break;
 
         case MIN_CLAMP_ID:
@@ -247,11 +487,56 @@ void glui_callback(int control)
             getCoordinates = 1;
             break;
         case REMOVE_SEEDPOINT_ID:
-            vis.removeSeedPoint(&model.streamTubes);
+            edit_model([]() { vis.removeSeedPoint(&model.streamTubes); });
+            break;
+        case ADD_SEED_RAKE_ID:
+            getCoordinates = 2;
+            break;
+        case ADD_SEED_GRID_ID:
+            edit_model([=]() { model.streamTubes.add_grid(0, 0, grid - 1, grid - 1, count, count, zval); });
+            break;
+        case REMOVE_ALL_SEEDPOINTS_ID:
+            edit_model([]() { model.streamTubes.clear(); });
             break;
         case Z_VALUE_SPINNER_ID:
-            vis.set_last_z_value(&model.streamTubes, vis.zval);
+            edit_model([=]() { vis.set_last_z_value(&model.streamTubes, zval); });
+            break;
+        case TUBE_DISP_FACTOR_SPINNER_ID:
+            edit_model([=]() { model.tube_disp_factor = disp_factor; });
+            break;
+        case TUBE_INTEGRATOR_ID:
+            edit_model([=]() { model.streamTubes.set_integrator((TUBE_INTEGRATOR)integrator, tolerance); });
+            break;
+        case STEP_RATE_SPINNER_ID:
+            edit_model([=]() { simulation.scheduler.set_rate(rate); });
+            break;
+        case SAVE_CHECKPOINT_ID:
+        {
+            std::string file = checkpoint_file;
+            bool with_history = checkpoint_history;
+            edit_model([=]() {
+                // Saving waits for the previous checkpoint, which would stall the simulation
+                if (checkpoint.busy())
+                {
+                    std::cerr << "Still writing the previous checkpoint, not saving" << std::endl;
+                    return;
+                }
+                if (!checkpoint.wait())
+                    std::cerr << "Could not write checkpoint: " << checkpoint.error << std::endl;
+                checkpoint.save(model, file, with_history);
+                std::cout << "Saving checkpoint " << file << " at step " << model.step << std::endl;
+            });
+            break;
+        }
+        case LOAD_CHECKPOINT_ID:
+        {
+            // Loading also changes the GUI's grid size and controls, so it waits for the step instead of being queued
+            std::lock_guard<std::mutex> lock(simulation.mutex);
+            if (!checkpoint.wait())
+                std::cerr << "Could not write checkpoint: " << checkpoint.error << std::endl;
+            load_state(checkpoint_file);
             break;
+        }
         default:
             // Do no special actions
             break;
@@ -281,11 +566,15 @@ void create_GUI()
     // Add several checkboxes
     new GLUI_Checkbox(generalRollout, "Frozen", &(vis.frozen), ANIMATE_ID, glui_callback);
     new GLUI_Checkbox(generalRollout, "Textures", &(vis.useTextures), TEXTURE_ID, glui_callback);
+    new GLUI_Checkbox(generalRollout, "Draw flat smoke as image", &(vis.flatImage));
+    new GLUI_Checkbox(generalRollout, "Show timings (t)", &(vis.showTimings));
 
     // Add spinners
 
     GLUI_Spinner* viscosity_spinner = new GLUI_Spinner(generalRollout, "Viscosity multiplier", GLUI_SPINNER_FLOAT, &(model.visc_scale_factor), VISCOSITY_SPINNER_ID, glui_callback);
     viscosity_spinner->set_float_limits(-1.0f, 100.0f);
+    GLUI_Spinner* step_rate_spinner = new GLUI_Spinner(generalRollout, "Steps per second (0: per frame)", GLUI_SPINNER_FLOAT, &step_rate, STEP_RATE_SPINNER_ID, glui_callback);
+    step_rate_spinner->set_float_limits(0.0f, 1000.0f);
     // Radio button for Scale / Clamp
     GLUI_Panel* scale_clamp_panel = new GLUI_Panel(generalRollout, "Dataset manipulation");
     GLUI_RadioGroup* scale_clamp = glui->add_radiogroup_to_panel(scale_clamp_panel, &(vis.clamping), SCALE_CLAMP_ID, glui_callback);
@@ -350,12 +639,13 @@ void create_GUI()
     GLUI_Spinner* jitter_spinner = new GLUI_Spinner(glyphRollout, "Jiiter", GLUI_SPINNER_FLOAT, &(vis.jitter), JITTER_SPINNER_ID, glui_callback);
     jitter_spinner->set_float_limits(-10.0f, 10.0f);
 
-    vis.num_x_glyphs = model.DIM;
-    vis.num_y_glyphs = model.DIM;
-    GLUI_Spinner* xsamples = new GLUI_Spinner(glyphRollout, "X samples", GLUI_SPINNER_INT, &(vis.num_x_glyphs), X_GLYPH_SPINNER, glui_callback);
-    xsamples->set_int_limits(0, 200);
-    GLUI_Spinner* ysamples = new GLUI_Spinner(glyphRollout, "Y samples", GLUI_SPINNER_INT, &(vis.num_y_glyphs), Y_GLYPH_SPINNER, glui_callback);
-    ysamples->set_int_limits(0, 200);
+    // Sample at most 200x200 glyphs by default, large grids would otherwise draw millions of glyphs
+    vis.num_x_glyphs = std::min(model.DIM, 200);
+    vis.num_y_glyphs = std::min(model.DIM, 200);
+    xsamples = new GLUI_Spinner(glyphRollout, "X samples", GLUI_SPINNER_INT, &(vis.num_x_glyphs), X_GLYPH_SPINNER, glui_callback);
+    xsamples->set_int_limits(0, model.DIM);
+    ysamples = new GLUI_Spinner(glyphRollout, "Y samples", GLUI_SPINNER_INT, &(vis.num_y_glyphs), Y_GLYPH_SPINNER, glui_callback);
+    ysamples->set_int_limits(0, model.DIM);
 
     GLUI_Listbox *glyph_shape_list = new GLUI_Listbox(glyphRollout, "Glyph shape", &(vis.glyph_shape), GLYPH_SHAPE_ID, glui_callback);
     glyph_shape_list->add_item(0, "Lines");
@@ -397,10 +687,25 @@ void create_GUI()
     new GLUI_Checkbox(streamtubes_rollout, "Enable stream tubes", &(vis.enableStreamtubes), DRAW_STREAMTUBES_ID, glui_callback);
     new GLUI_Button(streamtubes_rollout, "Add seed point", ADD_SEEDPOINT_ID, glui_callback);
     new GLUI_Button(streamtubes_rollout, "Remove seed point", REMOVE_SEEDPOINT_ID, glui_callback);
-    GLUI_Spinner* z_value_spinner = new GLUI_Spinner(streamtubes_rollout, "z-value", GLUI_SPINNER_INT, &(vis.zval), Z_VALUE_SPINNER_ID, glui_callback);
+    new GLUI_Button(streamtubes_rollout, "Add seed rake", ADD_SEED_RAKE_ID, glui_callback);
+    new GLUI_Button(streamtubes_rollout, "Add seed grid", ADD_SEED_GRID_ID, glui_callback);
+    new GLUI_Button(streamtubes_rollout, "Remove all seed points", REMOVE_ALL_SEEDPOINTS_ID, glui_callback);
+    GLUI_Spinner* seed_count_spinner = new GLUI_Spinner(streamtubes_rollout, "Seeds per rake", GLUI_SPINNER_INT, &seed_count);
+    seed_count_spinner->set_int_limits(1, 256);
+    z_value_spinner = new GLUI_Spinner(streamtubes_rollout, "z-value", GLUI_SPINNER_INT, &(vis.zval), Z_VALUE_SPINNER_ID, glui_callback);
     z_value_spinner->set_int_limits(-model.history_size, 0);
-    GLUI_Spinner* tube_disp_factor_spinner = new GLUI_Spinner(streamtubes_rollout, "Displacement factor", GLUI_SPINNER_INT, &(model.tube_disp_factor), TUBE_DISP_FACTOR_SPINNER_ID, glui_callback);
+    GLUI_Spinner* tube_disp_factor_spinner = new GLUI_Spinner(streamtubes_rollout, "Displacement factor", GLUI_SPINNER_INT, &tube_disp_factor, TUBE_DISP_FACTOR_SPINNER_ID, glui_callback);
     tube_disp_factor_spinner->set_int_limits(0, 20);
+    GLUI_Listbox* integrator_list = new GLUI_Listbox(streamtubes_rollout, "Integrator", &tube_integrator, TUBE_INTEGRATOR_ID, glui_callback);
+    for (int i = TUBE_EULER; i <= TUBE_RK45; i++)
+        integrator_list->add_item(i, tube_integrator_name((TUBE_INTEGRATOR)i));
+    GLUI_Spinner* tolerance_spinner = new GLUI_Spinner(streamtubes_rollout, "RK45 tolerance", GLUI_SPINNER_FLOAT, &tube_tolerance, TUBE_INTEGRATOR_ID, glui_callback);
+    tolerance_spinner->set_float_limits(1e-6f, 1.0f);
+
+    GLUI_Rollout *checkpoint_rollout = glui->add_rollout("Checkpoint", false);
+    new GLUI_Button(checkpoint_rollout, "Save checkpoint", SAVE_CHECKPOINT_ID, glui_callback);
+    new GLUI_Button(checkpoint_rollout, "Load checkpoint", LOAD_CHECKPOINT_ID, glui_callback);
+    new GLUI_Checkbox(checkpoint_rollout, "Include time slices", &checkpoint_history);
 }
 
 
@@ -412,10 +717,17 @@ void Mouse(int button,int state,int mx,int my) {
     X = X > (DIM - 1) ? DIM - 1 : (X < 0 ? 0 : X);
     Y = Y > (DIM - 1) ? DIM - 1 : (Y < 0 ? 0 : Y); 
 
-    if(getCoordinates)
+    if(getCoordinates && state == GLUT_DOWN)
     {
-        vis.addSeedPoint(&model.streamTubes, X, Y, vis.zval);
-        getCoordinates = 0;
+        int zval = vis.zval, count = seed_count;
+        float x0 = rake_x, y0 = rake_y;
+        if (getCoordinates == 1)
+            edit_model([=]() { vis.addSeedPoint(&model.streamTubes, X, Y, zval); });
+        else if (getCoordinates == 3)
+            edit_model([=]() { model.streamTubes.add_rake(x0, y0, X, Y, count, zval); });
+        rake_x = X;
+        rake_y = Y;
+        getCoordinates = getCoordinates == 2 ? 3 : 0;
     }
 }
 
@@ -424,6 +736,49 @@ int main(int argc, char **argv)
 {   
     printStart();
     glutInit(&argc, argv);
+    int exit_code;
+    if (!parse_arguments(argc, argv, exit_code))
+        return exit_code;
+    if (startup_checkpoint.empty())
+        model.resize(DIM);
+    else if (!load_state(startup_checkpoint))
+        return 1;
+    model.report_memory(std::cout);
+    std::cout << "FFT: " << model.fft->name() << std::endl;
+    if (startup_checkpoint.empty())
+        vis.init_jitter(DIM);
+    std::string error;
+    if (!replay_file.empty())
+    {
+        if (!replay.load(replay_file, DIM, error))
+        {
+            std::cerr << "Could not read injections " << error << std::endl;
+            return 1;
+        }
+        model.replay = &replay;
+    }
+    if (!record_file.empty())
+    {
+        if (!recorder.open(record_file, DIM, error))
+        {
+            std::cerr << "Could not record injections " << error << std::endl;
+            return 1;
+        }
+        model.recorder = &recorder;
+    }
+    if (!timings_file.empty() && !timers.open_csv(timings_file, error))
+    {
+        std::cerr << "Could not write timings " << error << std::endl;
+        return 1;
+    }
+    model.timers = &timers;
+    vis.timers = &timers;
+    trace_thread_name("main");
+    if (!trace_file.empty())
+        trace_start(trace_file);
+    tube_disp_factor = model.tube_disp_factor;
+    model.streamTubes.set_integrator((TUBE_INTEGRATOR)tube_integrator, tube_tolerance);
+    simulation.scheduler.set_rate(step_rate);
     glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
     glutInitWindowSize(1200,768);
 
@@ -432,6 +787,7 @@ int main(int argc, char **argv)
     GLUI_Master.set_glutReshapeFunc(reshape);
     GLUI_Master.set_glutIdleFunc(do_one_step);
     GLUI_Master.set_glutMouseFunc(Mouse);
+    GLUI_Master.set_glutKeyboardFunc(keyboard);
     glutMotionFunc(drag);
     create_GUI();
 
@@ -454,16 +810,10 @@ int main(int argc, char **argv)
     glHint (GL_LINE_SMOOTH_HINT, GL_DONT_CARE);
     glLineWidth(2);
     vis.create_textures();
+    if (threaded)
+        simulation.start();
 
     glutMainLoop();         //calls do_one_simulation_step, keyboard, display, drag, reshape
-    free(model.rho0);
-    free(model.rho);
-    free(model.fy);
-    free(model.fx);
-    free(model.vy0);
-    free(model.vx0);
-    free(model.vy);
-    free(model.vx);
 
     return 0;
 }
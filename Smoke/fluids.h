@@ -1,7 +1,8 @@
 #ifndef FLUIDS_H
 #define FLUIDS_H
 GLUI_Spinner* minClamp, *maxClamp, *lower_iso_spinner, *upper_iso_spinner;
-int getCoordinates = 0;
+GLUI_Spinner* xsamples, *ysamples, *z_value_spinner; //limits follow the grid and history size of a loaded checkpoint
+int getCoordinates = 0;        //1: next click adds a seed point, 2 and 3: next clicks set the ends of a seed rake
 enum {
 	  ANIMATE_ID, 
 	  DRAW_HEDGEHOGS_ID, 
@@ -45,7 +46,14 @@ enum {
 	  REMOVE_SEEDPOINT_ID,
 	  Z_VALUE_SPINNER_ID,
 	  TUBE_DISP_FACTOR_SPINNER_ID,
-	  JITTER_SPINNER_ID
+	  JITTER_SPINNER_ID,
+	  STEP_RATE_SPINNER_ID,
+	  ADD_SEED_RAKE_ID,
+	  ADD_SEED_GRID_ID,
+	  REMOVE_ALL_SEEDPOINTS_ID,
+	  TUBE_INTEGRATOR_ID,
+	  SAVE_CHECKPOINT_ID,
+	  LOAD_CHECKPOINT_ID
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,671 @@
+// Usage: smoke-headless [-n DIM] [-s steps] [-t dt] [-v viscosity] [-H history] [-C format] [-F file]
+//                      [-j threads] [-S simd] [-P planning] [-W wisdom] [-r rate] [-g seeds] [-I integrator]
+//                      [-e tolerance] [-f script] [-R recording] [-L checkpoint] [-O checkpoint] [-K steps] [-X]
+//                      [-p] [-x] [-c timings] [-E trace] [-b]
+//        Runs the fluid simulation without any window or GUI, so it can be used on machines without a
+//        display server and to time the solver in isolation. Forces and matter are injected from the
+//        script file, one injection per line: "step x y fx fy rho" ('#' starts a comment), or from a
+//        recording of the injections of an earlier run, see InjectionRecorder.
+//--------------------------------------------------------------------------------------------------
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+#include "model.h"              //Simulation part of the application
+#include "scheduler.h"
+#include "checkpoint.h"
+
+void printUsage(const char* name)
+{
+    std::cout << "Usage: " << name << " [options]" << std::endl;
+    std::cout << "  -n DIM        size of the simulation grid (default 50)" << std::endl;
+    std::cout << "  -s STEPS      number of simulation steps (default 1000)" << std::endl;
+    std::cout << "  -t DT         simulation time step (default 0.4)" << std::endl;
+    std::cout << "  -v VISC       fluid viscosity (default 0.001)" << std::endl;
+    std::cout << "  -H SLICES     number of velocity time slices kept for stream tubes (default 100)" << std::endl;
+    std::cout << "  -F FILE       keep the time slices in a memory-mapped FILE instead of in memory" << std::endl;
+    std::cout << "  -C FORMAT     storage of the time slices: float, half, q16, q12 or q8 (default float)" << std::endl;
+    std::cout << "  -j THREADS    number of advection threads (default 1)" << std::endl;
+    std::cout << "  -S SIMD       advection kernel: scalar, avx2 or avx512 (default: best supported)" << std::endl;
+    std::cout << "  -P PLANNING   FFT planning: estimate, measure or patient (default estimate)" << std::endl;
+    std::cout << "  -W FILE       load FFT wisdom from FILE, and save it after planning" << std::endl;
+    std::cout << "  -r RATE       run in real time at RATE steps per second, and report the lag (default: as fast as possible)" << std::endl;
+    std::cout << "  -g SEEDS      trace stream tubes from a SEEDS x SEEDS grid of seed points (default: none)" << std::endl;
+    std::cout << "  -f SCRIPT     replay a recording made with -R or by smoke, or a force-injection script of lines \"step x y fx fy rho\"" << std::endl;
+    std::cout << "  -R FILE       record the injections of this run to FILE" << std::endl;
+    std::cout << "  -I METHOD     stream tube integrator: euler, rk2, rk4 or rk45 (default euler)" << std::endl;
+    std::cout << "  -e TOLERANCE  largest error per time slice in cells for the rk45 integrator (default 0.001)" << std::endl;
+    std::cout << "  -L FILE       continue from the checkpoint in FILE; its grid, parameters and stream tubes replace" << std::endl;
+    std::cout << "                -n, -t, -v, -H, -C, -I, -e and -g, and the script steps count on from the checkpoint's step" << std::endl;
+    std::cout << "  -O FILE       write a checkpoint to FILE after the last step" << std::endl;
+    std::cout << "  -K STEPS      also write the checkpoint every STEPS steps, in the background while the simulation runs" << std::endl;
+    std::cout << "  -X            include the velocity time slices in the checkpoints, so stream tubes continue where they were" << std::endl;
+    std::cout << "  -p            report the p50, p95 and p99 duration of every phase of a step, over the last 256 steps" << std::endl;
+    std::cout << "  -x            report the cycles, instructions per cycle, LLC misses and branch misses of every phase, read" << std::endl;
+    std::cout << "                from the hardware counters; they count the main thread only, so use -j 1 to count all the work" << std::endl;
+    std::cout << "  -c FILE       write the duration of every phase of every step to the CSV file FILE" << std::endl;
+    std::cout << "  -E FILE       record a trace of the run, written to FILE in the Chrome trace-event format at exit" << std::endl;
+    std::cout << "  -b            benchmark STEPS advections per SIMD level, and with 1 to THREADS threads (default: all cores)," << std::endl;
+    std::cout << "                the generic against the specialized solver kernels, and the error against the cost of the" << std::endl;
+    std::cout << "                stream tube integrators" << std::endl;
+    std::cout << "  -h            show this help" << std::endl;
+}
+
+// print_counter: Print the mean of 'counter' per call of a phase in a column of 'width', '-' when it is not counted
+void print_counter(const PerfCounters& counters, const PhaseCounters& phase, PERF_COUNTER counter, int width)
+{
+    if (counters.available(counter))
+        printf(" %*.0f", width, (double)phase.totals.value[counter] / phase.count);
+    else
+        printf(" %*s", width, "-");
+}
+
+// AdvectionBenchmark: Fields for timing the advection of the velocity and the density
+typedef struct advection_benchmark {
+    int n;
+    std::vector<fftw_real> u, v, rho;           // input velocity and density
+    std::vector<fftw_real> vx, vy, out_rho;     // advected velocity and density
+} AdvectionBenchmark;
+
+// init_benchmark: A smooth swirling velocity field, strong enough to trace back over several cells, and a checkerboard density
+void init_benchmark(AdvectionBenchmark& bench, int n)
+{
+    size_t cells = (size_t)n * n;
+    bench.n = n;
+    bench.u.resize(cells);
+    bench.v.resize(cells);
+    bench.rho.resize(cells);
+    bench.vx.assign(cells, 0.0f);
+    bench.vy.assign(cells, 0.0f);
+    bench.out_rho.assign(cells, 0.0f);
+    for (int j = 0; j < n; j++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            double x = 2.0 * M_PI * i / n, y = 2.0 * M_PI * j / n;
+            bench.u[i + n * j] = 0.05 * sin(y) * cos(x);
+            bench.v[i + n * j] = -0.05 * sin(x) * cos(y);
+            bench.rho[i + n * j] = (i / 8 + j / 8) % 2 ? 1.0f : 0.0f;
+        }
+    }
+}
+
+// time_advection: Milliseconds per advection of the velocity and the density, averaged over 'repetitions'
+double time_advection(Model& model, AdvectionBenchmark& bench, int repetitions)
+{
+    int n = bench.n;
+    const fftw_real* velocity_src[2] = {bench.u.data(), bench.v.data()};
+    fftw_real* velocity_dst[2] = {bench.vx.data(), bench.vy.data()};
+    const fftw_real* rho_src[1] = {bench.rho.data()};
+    fftw_real* rho_dst[1] = {bench.out_rho.data()};
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; r++)
+    {
+        model.advect(n, bench.u.data(), bench.v.data(), model.dt, 2, velocity_src, velocity_dst);
+        model.advect(n, bench.vx.data(), bench.vy.data(), model.dt, 1, rho_src, rho_dst);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count() / repetitions;
+}
+
+// poison_benchmark: Give some cells a velocity that backtraces to NaN, to infinity or far outside the grid
+void poison_benchmark(AdvectionBenchmark& bench)
+{
+    const fftw_real values[] = {NAN, INFINITY, -INFINITY, 1e38f, -1e30f, 1e10f, 3e6f};
+    const int num_values = sizeof(values) / sizeof(values[0]);
+    for (int k = 0; k < num_values; k++)
+    {
+        size_t cell = (size_t)k * 37 % bench.u.size();
+        bench.u[cell] = values[k];
+        bench.v[(cell + 1) % bench.v.size()] = values[num_values - 1 - k];
+    }
+}
+
+// is_nan: Whether 'x' is NaN, tested on its bits because -ffast-math lets the compiler assume it never is
+static bool is_nan(fftw_real x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return (bits & 0x7fffffff) > 0x7f800000;
+}
+
+// cell_difference: Difference between two advected values, relative for values beyond 1, where NaN only equals NaN
+static double cell_difference(fftw_real a, fftw_real b)
+{
+    if (is_nan(a) || is_nan(b))
+        return is_nan(a) && is_nan(b) ? 0.0 : INFINITY;
+    return a == b ? 0.0 : fabs((double)a - b) / std::max(1.0, fabs((double)a));
+}
+
+// sane: Whether a velocity is an ordinary one, not NaN and not far beyond the benchmark's
+static bool sane(fftw_real x)
+{
+    return !is_nan(x) && fabs(x) <= 1.0f;
+}
+
+// max_sane_difference: Largest difference between the advected velocities of two poisoned benchmark runs, over the
+//                      cells that have and get a sane velocity in both. What the poisoned cells, and the cells that
+//                      sample them, get depends on the rounding of the backtrace, so it is not compared.
+double max_sane_difference(const AdvectionBenchmark& a, const AdvectionBenchmark& b)
+{
+    double difference = 0.0;
+    for (size_t i = 0; i < a.vx.size(); i++)
+    {
+        if (!sane(a.u[i]) || !sane(a.v[i]) || !sane(a.vx[i]) || !sane(a.vy[i]) || !sane(b.vx[i]) || !sane(b.vy[i]))
+            continue;
+        difference = std::max(difference, cell_difference(a.vx[i], b.vx[i]));
+        difference = std::max(difference, cell_difference(a.vy[i], b.vy[i]));
+    }
+    return difference;
+}
+
+// max_difference: Largest difference between the advected fields of two benchmark runs
+double max_difference(const AdvectionBenchmark& a, const AdvectionBenchmark& b)
+{
+    double difference = 0.0;
+    for (size_t i = 0; i < a.vx.size(); i++)
+    {
+        difference = std::max(difference, cell_difference(a.vx[i], b.vx[i]));
+        difference = std::max(difference, cell_difference(a.vy[i], b.vy[i]));
+        difference = std::max(difference, cell_difference(a.out_rho[i], b.out_rho[i]));
+    }
+    return difference;
+}
+
+// benchmark_simd: Time the advection on a single thread for every SIMD level the CPU supports, compared to the scalar code
+void benchmark_simd(Model& model, int repetitions)
+{
+    SIMD_LEVEL selected = model.simd_level;
+    AdvectionBenchmark scalar, vectorized;
+    init_benchmark(scalar, model.DIM);
+    init_benchmark(vectorized, model.DIM);
+
+    model.set_num_threads(1);
+    std::cout << "Advection kernels on a " << model.DIM << "x" << model.DIM << " grid, " << repetitions << " repetitions" << std::endl;
+    std::cout << "kernel      ms/step   speedup   max difference" << std::endl;
+    model.set_simd_level(SIMD_SCALAR);
+    double scalar_ms = time_advection(model, scalar, repetitions);
+    printf("%-9s %9.3f %9.2f   %g\n", simd_name(SIMD_SCALAR), scalar_ms, 1.0, 0.0);
+    for (int level = SIMD_AVX2; level <= simd_supported(); level++)
+    {
+        model.set_simd_level((SIMD_LEVEL)level);
+        double ms = time_advection(model, vectorized, repetitions);
+        printf("%-9s %9.3f %9.2f   %g\n", simd_name((SIMD_LEVEL)level), ms, scalar_ms / ms, max_difference(scalar, vectorized));
+    }
+
+    // The vector kernels must leave the cells they cannot wrap to the scalar code instead of gathering outside the fields,
+    // and still agree with it on the other cells
+    init_benchmark(scalar, model.DIM);
+    poison_benchmark(scalar);
+    model.set_simd_level(SIMD_SCALAR);
+    time_advection(model, scalar, 1);
+    for (int level = SIMD_AVX2; level <= simd_supported(); level++)
+    {
+        init_benchmark(vectorized, model.DIM);
+        poison_benchmark(vectorized);
+        model.set_simd_level((SIMD_LEVEL)level);
+        time_advection(model, vectorized, 1);
+        printf("%-9s non-finite and far backtraces, max difference %g\n", simd_name((SIMD_LEVEL)level),
+               max_sane_difference(scalar, vectorized));
+    }
+    model.set_simd_level(selected);
+}
+
+// benchmark_scaling: Time the advection of the velocity and the density with 1 to max_threads threads, and check
+//                    that every thread count gives exactly the same fields as the single-threaded run.
+void benchmark_scaling(Model& model, int max_threads, int repetitions)
+{
+    AdvectionBenchmark reference, bench;
+    init_benchmark(reference, model.DIM);
+    init_benchmark(bench, model.DIM);
+    double single_thread_ms = 0.0;
+
+    std::cout << "Advection scaling (" << simd_name(model.simd_level) << ") on a " << model.DIM << "x" << model.DIM
+              << " grid, " << repetitions << " repetitions" << std::endl;
+    std::cout << "threads   ms/step   speedup   bit-identical" << std::endl;
+    for (int threads = 1; threads <= max_threads; threads++)
+    {
+        model.set_num_threads(threads);
+        if (threads == 1)
+        {
+            single_thread_ms = time_advection(model, reference, repetitions);
+            printf("%7d %9.3f %9.2f   %s\n", threads, single_thread_ms, 1.0, "yes");
+            continue;
+        }
+        double ms = time_advection(model, bench, repetitions);
+        bool identical = bench.vx == reference.vx && bench.vy == reference.vy && bench.out_rho == reference.out_rho;
+        printf("%7d %9.3f %9.2f   %s\n", threads, ms, single_thread_ms / ms, identical ? "yes" : "NO");
+    }
+}
+
+// time_step_loops: Milliseconds per run of the loops of a step around the FFT, averaged over 'repetitions'
+double time_step_loops(Model& model, int repetitions)
+{
+    int n = model.DIM;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; r++)
+    {
+        model.kernels.damp(n, model.rho, model.rho0, model.fx, model.fy, model.vx0, model.vy0);
+        model.kernels.add_forces(n, model.vx, model.vy, model.vx0, model.vy0, model.dt);
+        model.kernels.pad(n, model.vx, model.vy, model.vx0, model.vy0);
+        model.kernels.unpad(n, model.vx0, model.vy0, model.vx, model.vy);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count() / repetitions;
+}
+
+// benchmark_kernels: Time the scalar advection and the other loops of a step with the generic kernels and with
+//                    the kernels specialized for the grid size, which must give exactly the same fields
+void benchmark_kernels(Model& model, int repetitions)
+{
+    SolverKernels specialized = solver_kernels(model.DIM);
+    if (specialized.n == 0)
+    {
+        std::cout << "No specialized kernels for a " << model.DIM << "x" << model.DIM << " grid, only for powers of two from "
+                  << SOLVER_MIN_SPECIALIZED << " to " << SOLVER_MAX_SPECIALIZED << std::endl;
+        return;
+    }
+    SIMD_LEVEL selected = model.simd_level;
+    AdvectionBenchmark generic_bench, specialized_bench;
+    init_benchmark(generic_bench, model.DIM);
+    init_benchmark(specialized_bench, model.DIM);
+    model.set_num_threads(1);
+    model.set_simd_level(SIMD_SCALAR);
+
+    std::cout << "Solver kernels on a " << model.DIM << "x" << model.DIM << " grid, " << repetitions << " repetitions" << std::endl;
+    std::cout << "kernels       advect ms   other ms   max difference" << std::endl;
+    model.kernels = solver_kernels(model.DIM, true);
+    double generic_advect = time_advection(model, generic_bench, repetitions);
+    double generic_loops = time_step_loops(model, repetitions);
+    printf("%-12s %10.3f %10.3f   %g\n", "generic", generic_advect, generic_loops, 0.0);
+    model.kernels = specialized;
+    double advect = time_advection(model, specialized_bench, repetitions);
+    double loops = time_step_loops(model, repetitions);
+    printf("%-12s %10.3f %10.3f   %g\n", "specialized", advect, loops, max_difference(generic_bench, specialized_bench));
+    model.set_simd_level(selected);
+}
+
+// init_tube_benchmark: 'slices' time slices of a drifting swirl without divergence, that moves a particle up to a
+//                      cell per slice at displacement factor 10
+void init_tube_benchmark(HistoryRing& history, int n, int slices, double dt)
+{
+    std::vector<fftw_real> u((size_t)n * n), v((size_t)n * n);
+    history.resize(n, slices);
+    for (int s = 0; s < slices; s++)
+    {
+        double phase = 0.1 * s;
+        for (int j = 0; j < n; j++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                double x = 2.0 * M_PI * i / n, y = 2.0 * M_PI * j / n + phase;
+                u[i + n * j] = 0.1 / dt * sin(y) * cos(x);
+                v[i + n * j] = -0.1 / dt * sin(x) * cos(y);
+            }
+        }
+        history.push(u.data(), v.data());
+    }
+}
+
+// tube_errors: Mean and largest distance in cells between the points of two tracings of the same seeds
+void tube_errors(const StreamTubes& tubes, const StreamTubes& reference, double& mean, double& max)
+{
+    size_t points = 0;
+    mean = max = 0.0;
+    for (int t = 0; t < tubes.size(); t++)
+    {
+        for (int k = 0; k < std::min(tubes.length(t), reference.length(t)); k++)
+        {
+            Point3d a = tubes.point(t, k), b = reference.point(t, k);
+            double distance = sqrt((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y));
+            mean += distance;
+            max = std::max(max, distance);
+            points++;
+        }
+    }
+    if (points > 0)
+        mean /= points;
+}
+
+// benchmark_tubes: Trace stream tubes through a known unsteady field with every integrator and displacement factor,
+//                  and compare the cost (velocity samples per tube per slice, time) to the error against a very
+//                  accurate tracing with the same factor
+void benchmark_tubes(Model& model, int repetitions)
+{
+    const int slices = 100;
+    const int factors[] = {5, 10, 20};
+    const struct {
+        TUBE_INTEGRATOR integrator;
+        double tolerance;
+    } methods[] = {{TUBE_EULER, 0.0}, {TUBE_RK2, 0.0}, {TUBE_RK4, 0.0}, {TUBE_RK45, 1e-2}, {TUBE_RK45, 1e-3}, {TUBE_RK45, 1e-5}};
+    int n = model.DIM;
+    HistoryRing history;
+    StreamTubes tubes, reference;
+    init_tube_benchmark(history, n, slices, model.dt);
+    tubes.add_grid(n / 8, n / 8, n - 1 - n / 8, n - 1 - n / 8, 16, 16, -slices);
+    reference.add_grid(n / 8, n / 8, n - 1 - n / 8, n - 1 - n / 8, 16, 16, -slices);
+    model.set_num_threads(1);
+    repetitions = std::max(repetitions / 100, 1);
+
+    std::cout << "Stream tube integrators, " << tubes.size() << " tubes through " << slices << " slices of a "
+              << model.DIM << "x" << model.DIM << " grid, " << repetitions << " repetitions" << std::endl;
+    std::cout << "factor  integrator  tolerance  samples/slice   ms/trace   mean error    max error" << std::endl;
+    for (int factor : factors)
+    {
+        reference.set_integrator(TUBE_RK45, 1e-9);
+        reference.trace(history, model.DIM, model.dt, factor, model.workers);
+        for (auto method : methods)
+        {
+            tubes.set_integrator(method.integrator, method.tolerance);
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < repetitions; r++)
+            {
+                tubes.reset();
+                tubes.trace(history, model.DIM, model.dt, factor, model.workers);
+            }
+            auto end = std::chrono::steady_clock::now();
+            double ms = std::chrono::duration<double, std::milli>(end - start).count() / repetitions;
+            double mean, max;
+            tube_errors(tubes, reference, mean, max);
+            char tolerance[16] = "-";
+            if (method.integrator == TUBE_RK45)
+                snprintf(tolerance, sizeof(tolerance), "%.0e", method.tolerance);
+            printf("%6d  %-10s  %9s  %13.2f  %9.3f  %11.3e  %11.3e\n", factor, tube_integrator_name(method.integrator),
+                   tolerance, (double)tubes.evaluations / ((double)tubes.size() * slices), ms, mean, max);
+        }
+    }
+}
+
+//main: The main program
+int main(int argc, char **argv)
+{
+    int DIM = 50;
+    int steps = 1000;
+    double dt = 0.4;
+    double visc = 0.001;
+    int history = 100;
+    HISTORY_FORMAT history_format = HISTORY_FLOAT;
+    const char* history_file = "";
+    int threads = 0;
+    SIMD_LEVEL simd = simd_supported();
+    FFTOptions fft_options;
+    fft_options.planning = FFT_ESTIMATE;
+    double rate = 0.0;
+    bool benchmark = false;
+    const char* script = NULL;
+    const char* record_file = NULL;
+    int seeds = 0;
+    TUBE_INTEGRATOR integrator = TUBE_EULER;
+    double tolerance = 1e-3;
+    const char* load_file = NULL;
+    const char* save_file = NULL;
+    int save_interval = 0;
+    bool save_history = false;
+    bool phase_report = false;
+    bool counter_report = false;
+    const char* timings_file = NULL;
+    const char* trace_file = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:t:v:H:C:F:j:S:P:W:r:g:I:e:f:R:L:O:K:Xpxc:E:bh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': DIM = atoi(optarg); break;
+            case 's': steps = atoi(optarg); break;
+            case 't': dt = atof(optarg); break;
+            case 'v': visc = atof(optarg); break;
+            case 'H': history = atoi(optarg); break;
+            case 'F': history_file = optarg; break;
+            case 'C':
+                if (!parse_history_format(optarg, history_format))
+                {
+                    std::cerr << "Unknown history format " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'j': threads = atoi(optarg); break;
+            case 'S':
+                if (!parse_simd_level(optarg, simd))
+                {
+                    std::cerr << "Unknown SIMD level " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (!parse_fft_planning(optarg, fft_options.planning))
+                {
+                    std::cerr << "Unknown FFT planning " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'W': fft_options.wisdom_file = optarg; break;
+            case 'r': rate = atof(optarg); break;
+            case 'g': seeds = atoi(optarg); break;
+            case 'I':
+                if (!parse_tube_integrator(optarg, integrator))
+                {
+                    std::cerr << "Unknown stream tube integrator " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'e': tolerance = atof(optarg); break;
+            case 'f': script = optarg; break;
+            case 'R': record_file = optarg; break;
+            case 'L': load_file = optarg; break;
+            case 'O': save_file = optarg; break;
+            case 'K': save_interval = atoi(optarg); break;
+            case 'X': save_history = true; break;
+            case 'p': phase_report = true; break;
+            case 'x': counter_report = true; break;
+            case 'c': timings_file = optarg; break;
+            case 'E': trace_file = optarg; break;
+            case 'b': benchmark = true; break;
+            case 'h':
+                printUsage(argv[0]);
+                return 0;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+    if (DIM < 2 || steps < 0 || history < 1 || rate < 0.0 || seeds < 0 || tolerance <= 0.0)
+    {
+        std::cerr << "Grid size must be at least 2, the number of steps and the rate non-negative and the history at least 1" << std::endl;
+        return 1;
+    }
+    if (save_interval < 0 || (save_interval > 0 && !save_file))
+    {
+        std::cerr << "The checkpoint interval must be non-negative, and needs a checkpoint file (-O)" << std::endl;
+        return 1;
+    }
+
+    Model model(load_file ? 0 : DIM);
+    model.dt = dt;
+    model.base_visc = visc;
+    model.visc = model.base_visc * model.visc_scale_factor;
+    model.history_size = history;
+    model.history_format = history_format;
+    model.history.error_interval = 64;      // enough samples for the reported error, at a small part of the cost
+    model.history_file = history_file;
+    model.set_simd_level(simd);
+    if (load_file)
+    {
+        std::string error;
+        auto load_start = std::chrono::steady_clock::now();
+        if (!load_checkpoint(model, load_file, error))
+        {
+            std::cerr << "Could not load checkpoint " << error << std::endl;
+            return 1;
+        }
+        double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load_start).count();
+        std::cout << "Loaded checkpoint " << load_file << " at step " << model.step << " in " << load_ms << " ms" << std::endl;
+        DIM = model.DIM;
+        history = model.history_size;
+        history_format = model.history_format;
+        integrator = model.streamTubes.integrator();
+        tolerance = model.streamTubes.tolerance();
+    }
+
+    InjectionReplay injections;
+    InjectionRecorder recorder;
+    std::string error;
+    if (script && !injections.load(script, DIM, error))
+    {
+        std::cerr << "Could not read injections " << error << std::endl;
+        return 1;
+    }
+    if (record_file && !recorder.open(record_file, DIM, error))
+    {
+        std::cerr << "Could not record injections " << error << std::endl;
+        return 1;
+    }
+    if (benchmark)
+    {
+        int max_threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        benchmark_simd(model, std::max(steps, 1));
+        benchmark_scaling(model, max_threads, std::max(steps, 1));
+        benchmark_kernels(model, std::max(steps, 1));
+        benchmark_tubes(model, std::max(steps, 1));
+        return 0;
+    }
+    model.set_num_threads(std::max(threads, 1));
+    fft_options.num_threads = model.workers.size();
+    model.set_fft_options(fft_options);
+    model.streamTubes.set_integrator(integrator, tolerance);
+    model.replay = &injections;
+    model.recorder = record_file ? &recorder : NULL;
+    PhaseTimers timers;
+    if (timings_file && !timers.open_csv(timings_file, error))
+    {
+        std::cerr << "Could not write timings " << error << std::endl;
+        return 1;
+    }
+    PerfCounters counters;
+    if (counter_report)
+    {
+        if (counters.open(error))
+            timers.counters = &counters;
+        else
+            std::cerr << "No hardware counters, " << error << std::endl;
+    }
+    model.timers = phase_report || timings_file || timers.counters ? &timers : NULL;
+    trace_thread_name("main");
+    if (trace_file)
+        trace_start(trace_file);
+    if (seeds > 0 && !load_file)
+        model.streamTubes.add_grid(0, 0, DIM - 1, DIM - 1, seeds, seeds, -history);
+
+    std::cout << "Headless fluid flow simulation" << std::endl;
+    std::cout << "==============================" << std::endl;
+    std::cout << "Grid: " << DIM << "x" << DIM << ", steps: " << steps << ", dt: " << model.dt
+              << ", viscosity: " << model.visc << ", threads: " << model.workers.size()
+              << ", advection: " << simd_name(model.simd_level)
+              << ", kernels: " << (model.kernels.n ? "specialized" : "generic")
+              << ", injections: " << injections.size() << ", stream tubes: " << model.streamTubes.size()
+              << " (" << tube_integrator_name(integrator) << ")" << std::endl;
+    std::cout << "FFT: " << model.fft->name() << std::endl;
+    model.report_memory(std::cout);
+
+    StepScheduler scheduler;
+    scheduler.set_rate(rate);
+    CheckpointWriter checkpoint;
+    int checkpoints = 0;
+    double checkpoint_ms = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    // The injections are applied by the model at the step they are scheduled for, so a run continued from a
+    // checkpoint injects what the uninterrupted run would have
+    const long first = model.step, last = first + steps;
+    for (long step = first; step < last; )
+    {
+        int due = scheduler.steps_due();
+        if (due == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::duration<double>(scheduler.time_to_next_step()));
+            continue;
+        }
+        for (; due > 0 && step < last; due--, step++)
+        {
+            model.do_one_simulation_step(DIM);
+            if (save_interval > 0 && (step + 1 - first) % save_interval == 0 && step + 1 < last)
+            {
+                checkpoint.save(model, save_file, save_history);
+                checkpoints++;
+                checkpoint_ms = std::max(checkpoint_ms, checkpoint.copy_ms);
+            }
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (save_file)
+    {
+        checkpoint.save(model, save_file, save_history);
+        checkpoints++;
+        checkpoint_ms = std::max(checkpoint_ms, checkpoint.copy_ms);
+        if (!checkpoint.wait())
+        {
+            std::cerr << "Could not write checkpoint: " << checkpoint.error << std::endl;
+            return 1;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << "Simulated " << steps << " steps in " << seconds << " s" << std::endl;
+    if (steps > 0 && seconds > 0.0)
+    {
+        std::cout << "Steps/second: " << steps / seconds << std::endl;
+        std::cout << "ms/step:      " << 1000.0 * seconds / steps << std::endl;
+        if (history_format != HISTORY_FLOAT)
+            std::cout << "History:      " << history_format_name(history_format) << ", max reconstruction error "
+                      << model.history.max_error << " (every " << model.history.error_interval << "th slice)" << std::endl;
+        if (rate > 0.0)
+            std::cout << "Lag:          " << 1000.0 * scheduler.lag() << " ms behind " << rate << " steps/second, "
+                      << scheduler.dropped_steps << " steps dropped" << std::endl;
+        std::cout << "rho range:    [" << model.stats.rho.min << ", " << model.stats.rho.max << "], mean " << model.stats.rho.mean << std::endl;
+        std::cout << "|v| range:    [" << model.stats.velocity.min << ", " << model.stats.velocity.max << "], mean " << model.stats.velocity.mean << std::endl;
+    }
+    if (phase_report)
+    {
+        printf("\n%-16s %10s %10s %10s\n", "Phase (ms)", "p50", "p95", "p99");
+        for (int p = 0; p < NUM_PHASES; p++)
+        {
+            PhaseStats stats = timers.stats((TIMING_PHASE)p);
+            if (stats.samples > 0)
+                printf("%-16s %10.4f %10.4f %10.4f\n", phase_name((TIMING_PHASE)p), stats.p50, stats.p95, stats.p99);
+        }
+    }
+    if (timers.counters)
+    {
+        printf("\n%-16s %14s %14s %6s %12s %14s\n", "Phase (per call)", "cycles", "instructions", "IPC", "LLC misses",
+               "branch misses");
+        for (int p = 0; p < NUM_PHASES; p++)
+        {
+            PhaseCounters phase = timers.counter_stats((TIMING_PHASE)p);
+            if (phase.count == 0)
+                continue;
+            printf("%-16s", phase_name((TIMING_PHASE)p));
+            print_counter(counters, phase, COUNTER_CYCLES, 14);
+            print_counter(counters, phase, COUNTER_INSTRUCTIONS, 14);
+            if (counters.available(COUNTER_CYCLES) && counters.available(COUNTER_INSTRUCTIONS)
+                && phase.totals.value[COUNTER_CYCLES] > 0)
+                printf(" %6.2f", (double)phase.totals.value[COUNTER_INSTRUCTIONS] / phase.totals.value[COUNTER_CYCLES]);
+            else
+                printf(" %6s", "-");
+            print_counter(counters, phase, COUNTER_LLC_MISSES, 12);
+            print_counter(counters, phase, COUNTER_BRANCH_MISSES, 14);
+            printf("\n");
+        }
+    }
+    if (record_file)
+        std::cout << "Recorded:     " << recorder.count << " injections to " << record_file << std::endl;
+    if (save_file)
+        std::cout << "Checkpoints:  " << checkpoints << " written to " << save_file << " at step " << model.step
+                  << ", the solver waited at most " << checkpoint_ms << " ms for a copy" << std::endl;
+
+    return 0;
+}
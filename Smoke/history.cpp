@@ -0,0 +1,293 @@
+#include "history.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <cfloat>
+#include <string>
+#include <algorithm>
+
+HistoryRing::HistoryRing() : max_error(0.0), error_interval(0), block(NULL), block_bytes(0), file_descriptor(-1), header(NULL), index(NULL),
+                             data(NULL), n(0), cells(0), field_bytes(0), slice_format(HISTORY_FLOAT), slots(0),
+                             first(0), count(0)
+{
+}
+
+HistoryRing::~HistoryRing()
+{
+    release();
+}
+
+void HistoryRing::release()
+{
+    if (mapped())
+    {
+        munmap(block, block_bytes);
+        close(file_descriptor);
+    }
+    else
+        free(block);
+    block = data = NULL;
+    header = NULL;
+    index = NULL;
+    block_bytes = 0;
+    file_descriptor = -1;
+}
+
+//slice_bytes: Memory needed for one time slice of n x n cells in the given format
+size_t HistoryRing::slice_bytes(int n, HISTORY_FORMAT format)
+{
+    size_t cells = (size_t)n * n;
+    switch (format)
+    {
+        case HISTORY_HALF:
+        case HISTORY_Q16:   return 2 * cells * 2;
+        case HISTORY_Q12:   return 2 * (3 * ((cells + 1) / 2));
+        case HISTORY_Q8:    return 2 * cells;
+        case HISTORY_FLOAT:
+        default:            return 2 * cells * sizeof(fftw_real);
+    }
+}
+
+//resize: Allocate room for 'capacity' time slices of n x n cells in the given format. Discards the stored slices.
+void HistoryRing::resize(int n, unsigned int capacity, HISTORY_FORMAT format, const std::string& file)
+{
+    release();
+    this->n = 0;
+    cells = field_bytes = 0;
+    slots = 0;
+    slice_format = format;
+    requested_file = file;
+    max_error = 0.0;
+    first = count = 0;
+    decoded.clear();
+    if (n <= 0 || capacity == 0)
+        return;
+
+    const size_t page = 4096;
+    size_t data_offset = (sizeof(HistoryHeader) + capacity * sizeof(HistorySlice) + page - 1) / page * page;
+    block_bytes = data_offset + capacity * slice_bytes(n, format);
+    if (!file.empty())
+    {
+        file_descriptor = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file_descriptor < 0 || ftruncate(file_descriptor, block_bytes) != 0 ||
+            (block = (unsigned char*) mmap(NULL, block_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0)) == MAP_FAILED)
+        {
+            fprintf(stderr, "Could not map the history file %s (%s), keeping the history in memory\n", file.c_str(), strerror(errno));
+            if (file_descriptor >= 0)
+                close(file_descriptor);
+            file_descriptor = -1;
+            block = NULL;
+        }
+    }
+    if (!block)
+        block = (unsigned char*) calloc(1, block_bytes);
+
+    this->n = n;
+    cells = (size_t)n * n;
+    field_bytes = slice_bytes(n, format) / 2;
+    slots = capacity;
+    header = (HistoryHeader*) block;
+    index = (HistorySlice*) (block + sizeof(HistoryHeader));
+    data = block + data_offset;
+    memcpy(header->magic, "SMOKEHST", 8);
+    header->version = 1;
+    header->n = n;
+    header->format = format;
+    header->slots = slots;
+    header->pushed = 0;
+    clear();
+    if (format != HISTORY_FLOAT)
+        decoded.resize(cells);
+}
+
+//clear: Forget the stored slices, keeping the memory
+void HistoryRing::clear()
+{
+    first = count = 0;
+    if (header)
+        header->first = header->count = 0;
+}
+
+HistoryField HistoryRing::field(unsigned int i, int component) const
+{
+    size_t s = slot(i);
+    HistoryField field;
+    field.format = slice_format;
+    field.data = slot_data(s, component);
+    field.min = index[s].min[component];
+    field.scale = index[s].scale[component];
+    return field;
+}
+
+//prefetch: Ask the kernel to read rows [row_begin, row_end) of time slices [begin, end) from the history file
+void HistoryRing::prefetch(unsigned int begin, unsigned int end, int row_begin, int row_end) const
+{
+    if (!mapped())
+        return;
+    row_begin = std::max(row_begin, 0);
+    row_end = std::min(row_end, n);
+    if (row_begin >= row_end)
+        return;
+    const uintptr_t page = 4096;
+    size_t row_bytes = field_bytes / n;
+    for (unsigned int i = begin; i < std::min(end, count); i++)
+    {
+        for (int component = 0; component < 2; component++)
+        {
+            uintptr_t from = (uintptr_t)(slot_data(slot(i), component) + row_begin * row_bytes) / page * page;
+            uintptr_t to = (uintptr_t)(slot_data(slot(i), component) + std::min((size_t)row_end * row_bytes + 3, field_bytes));
+            madvise((void*)from, to - from, MADV_WILLNEED);
+        }
+    }
+}
+
+//encode: Store the n x n values of 'src' in the format of the ring
+void HistoryRing::encode(const fftw_real* src, unsigned char* dst, float& min, float& scale)
+{
+    min = scale = 0.0f;
+    if (slice_format == HISTORY_FLOAT)
+    {
+        std::copy(src, src + cells, (fftw_real*)dst);
+        return;
+    }
+    if (slice_format == HISTORY_HALF)
+    {
+        fields_to_half(src, (uint16_t*)dst, cells);
+        return;
+    }
+
+    // Quantized: codes 0 .. 2^bits-1 span the range of this field
+    fftw_real lo = FLT_MAX, hi = -FLT_MAX;
+    for (size_t i = 0; i < cells; i++)
+    {
+        lo = std::min(lo, src[i]);
+        hi = std::max(hi, src[i]);
+    }
+    int bits = slice_format == HISTORY_Q16 ? 16 : (slice_format == HISTORY_Q12 ? 12 : 8);
+    float levels = (float)((1 << bits) - 1);
+    min = lo;
+    scale = hi > lo ? (hi - lo) / levels : 0.0f;
+    float inverse = scale > 0.0f ? 1.0f / scale : 0.0f;
+
+    if (slice_format == HISTORY_Q16)
+    {
+        uint16_t* codes = (uint16_t*)dst;
+        for (size_t i = 0; i < cells; i++)
+            codes[i] = (uint16_t)std::min((src[i] - min) * inverse + 0.5f, levels);
+    }
+    else if (slice_format == HISTORY_Q8)
+    {
+        for (size_t i = 0; i < cells; i++)
+            dst[i] = (unsigned char)std::min((src[i] - min) * inverse + 0.5f, levels);
+    }
+    else
+    {
+        for (size_t i = 0; i < cells; i += 2)
+        {
+            unsigned int a = (unsigned int)std::min((src[i] - min) * inverse + 0.5f, levels);
+            unsigned int b = i + 1 < cells ? (unsigned int)std::min((src[i + 1] - min) * inverse + 0.5f, levels) : 0;
+            unsigned char* pair = dst + 3 * (i / 2);
+            pair[0] = a & 0xff;
+            pair[1] = (a >> 8) | (b & 0x0f) << 4;
+            pair[2] = b >> 4;
+        }
+    }
+}
+
+//decode_field: Decode all cells of a field, with the vectorized conversions where there are any
+void HistoryRing::decode_field(const HistoryField& field, fftw_real* dst) const
+{
+    switch (field.format)
+    {
+        case HISTORY_HALF:
+            fields_from_half((const uint16_t*)field.data, dst, cells);
+            break;
+        case HISTORY_Q16:
+            dequantize16((const uint16_t*)field.data, field.min, field.scale, dst, cells);
+            break;
+        case HISTORY_Q12:
+            dequantize12(field.data, field.min, field.scale, dst, cells);
+            break;
+        case HISTORY_Q8:
+            dequantize8(field.data, field.min, field.scale, dst, cells);
+            break;
+        case HISTORY_FLOAT:
+        default:
+            for (size_t i = 0; i < cells; i++)
+                dst[i] = field[i];
+    }
+}
+
+//decode: Decode all cells of time slice i into vx and vy, which hold n x n values each
+void HistoryRing::decode(unsigned int i, fftw_real* vx, fftw_real* vy) const
+{
+    decode_field(this->vx(i), vx);
+    decode_field(this->vy(i), vy);
+}
+
+//push: Store (vx, vy) as the newest time slice. Overwrites the oldest time slice when the ring is full.
+void HistoryRing::push(const fftw_real* vx, const fftw_real* vy)
+{
+    if (slots == 0)
+        return;
+    if (count == slots)
+    {
+        first = (first + 1) % slots;
+        count--;
+    }
+    size_t s = slot(count);
+    encode(vx, slot_data(s, 0), index[s].min[0], index[s].scale[0]);
+    encode(vy, slot_data(s, 1), index[s].min[1], index[s].scale[1]);
+    uint64_t sequence = header->pushed++;
+    index[s].sequence = sequence;
+    count++;
+    header->first = first;
+    header->count = count;
+
+    // Measure what the compression lost, on a sample of the slices
+    if (slice_format != HISTORY_FLOAT && error_interval > 0 && sequence % error_interval == 0)
+    {
+        const fftw_real* fields[2] = {vx, vy};
+        for (int component = 0; component < 2; component++)
+        {
+            decode_field(field(count - 1, component), decoded.data());
+            fftw_real error = 0;
+            for (size_t i = 0; i < cells; i++)
+                error = std::max(error, (fftw_real)fabs(decoded[i] - fields[component][i]));
+            max_error = std::max(max_error, (double)error);
+        }
+    }
+}
+
+//history_format_name: Human-readable name of a history format
+const char* history_format_name(HISTORY_FORMAT format)
+{
+    switch (format)
+    {
+        case HISTORY_HALF:  return "half";
+        case HISTORY_Q16:   return "q16";
+        case HISTORY_Q12:   return "q12";
+        case HISTORY_Q8:    return "q8";
+        case HISTORY_FLOAT:
+        default:            return "float";
+    }
+}
+
+//parse_history_format: Convert the name of a history format to the format. Returns false for unknown names.
+bool parse_history_format(const char* name, HISTORY_FORMAT& format)
+{
+    for (int i = HISTORY_FLOAT; i <= HISTORY_Q8; i++)
+    {
+        if (std::string(history_format_name((HISTORY_FORMAT)i)) == name)
+        {
+            format = (HISTORY_FORMAT)i;
+            return true;
+        }
+    }
+    return false;
+}
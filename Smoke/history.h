@@ -0,0 +1,146 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+#include <rfftw.h>              //the numerical simulation FFTW library
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "simd.h"
+
+// How the time slices of the history are stored. The quantized formats store every field as codes between the
+// minimum and maximum of that field in that time slice.
+enum HISTORY_FORMAT {HISTORY_FLOAT = 0, HISTORY_HALF, HISTORY_Q16, HISTORY_Q12, HISTORY_Q8};
+
+// Number of time slices a stream tube reads ahead in a history file
+#define HISTORY_PREFETCH 16
+
+// HistoryField: One field of a stored time slice. Cells are decoded one at a time when they are read.
+typedef struct history_field {
+    HISTORY_FORMAT format;
+    const unsigned char* data;
+    float min, scale;           // quantized formats: value = min + scale * code
+
+    fftw_real operator[](size_t i) const
+    {
+        switch (format)
+        {
+            case HISTORY_HALF:
+                return half_to_float(((const uint16_t*)data)[i]);
+            case HISTORY_Q16:
+                return min + scale * ((const uint16_t*)data)[i];
+            case HISTORY_Q12:
+                return min + scale * code12(data, i);
+            case HISTORY_Q8:
+                return min + scale * data[i];
+            case HISTORY_FLOAT:
+            default:
+                return ((const fftw_real*)data)[i];
+        }
+    }
+} HistoryField;
+
+// The history block, in memory or in a history file: a header, an index entry for every slot, and the slots
+// themselves from the first page boundary on. The header and index are kept up to date, so the file can be read
+// while or after the simulation runs.
+typedef struct history_header {
+    char magic[8];              // "SMOKEHST"
+    uint32_t version;
+    uint32_t n, format;         // grid size and HISTORY_FORMAT of the slices
+    uint32_t slots;             // capacity of the ring
+    uint32_t first, count;      // slot of the oldest slice, number of stored slices
+    uint64_t pushed;            // number of slices stored since the block was created
+} HistoryHeader;
+
+typedef struct history_slice {
+    uint64_t sequence;          // value of 'pushed' when the slice was stored
+    float min[2], scale[2];     // range of vx and vy, for the quantized formats
+} HistorySlice;
+
+// HistoryRing: The last 'capacity' time slices of the velocity field, in one block that is allocated up front.
+//              Every slice holds the n x n cells of vx followed by those of vy. Once the ring is full, storing a
+//              new slice overwrites the oldest one, so a step never allocates memory.
+//              The block can also be a memory-mapped file, so the history is bounded by the disk instead of the
+//              memory; the page cache then keeps the recently used slices in memory.
+class HistoryRing {
+public:
+    HistoryRing();
+    ~HistoryRing();
+    HistoryRing(const HistoryRing&) = delete;
+    HistoryRing& operator=(const HistoryRing&) = delete;
+
+    //resize: Allocate room for 'capacity' time slices of n x n cells in the given format. Discards the stored slices.
+    //        With a file name the slices are stored in that file, which is created or overwritten; if it cannot be
+    //        mapped the ring falls back to memory. A capacity or size of 0 only releases the memory.
+    void resize(int n, unsigned int capacity, HISTORY_FORMAT format = HISTORY_FLOAT, const std::string& file = "");
+
+    //clear: Forget the stored slices, keeping the memory
+    void clear();
+
+    //push: Store (vx, vy) as the newest time slice
+    void push(const fftw_real* vx, const fftw_real* vy);
+
+    unsigned int size() const { return count; }
+    unsigned int capacity() const { return slots; }
+
+    //pushed: Number of time slices stored since the last resize, including the ones that were overwritten
+    unsigned long pushed() const { return header ? header->pushed : 0; }
+    HISTORY_FORMAT format() const { return slice_format; }
+
+    //bytes: Size of the block that holds the time slices
+    size_t bytes() const { return block_bytes; }
+
+    //mapped: Whether the block is a memory-mapped file
+    bool mapped() const { return file_descriptor >= 0; }
+
+    //file: The file name given to the last resize, also when the ring fell back to memory
+    const std::string& file() const { return requested_file; }
+
+    //prefetch: Ask the kernel to read rows [row_begin, row_end) of time slices [begin, end) from the history file
+    //          in the background. Does nothing when the ring is in memory.
+    void prefetch(unsigned int begin, unsigned int end, int row_begin, int row_end) const;
+
+    //slice_bytes: Memory needed for one time slice of n x n cells in the given format
+    static size_t slice_bytes(int n, HISTORY_FORMAT format);
+
+    //vx, vy: Velocity of time slice i, 0 being the oldest and size()-1 the newest
+    HistoryField vx(unsigned int i) const { return field(i, 0); }
+    HistoryField vy(unsigned int i) const { return field(i, 1); }
+
+    //decode: Decode all cells of time slice i into vx and vy, which hold n x n values each
+    void decode(unsigned int i, fftw_real* vx, fftw_real* vy) const;
+
+    double max_error;               //largest difference between a stored value and the original, since the last resize
+    unsigned int error_interval;    //measure max_error on every error_interval-th pushed slice, 0 to never measure it;
+                                    //a measurement decodes the slice again, which doubles the cost of that push
+
+private:
+    size_t slot(unsigned int i) const { return (first + i) % slots; }
+    unsigned char* slot_data(size_t s, int component) const { return data + (2 * s + component) * field_bytes; }
+    HistoryField field(unsigned int i, int component) const;
+    void encode(const fftw_real* src, unsigned char* dst, float& min, float& scale);
+    void decode_field(const HistoryField& field, fftw_real* dst) const;
+    void release();
+
+    unsigned char* block;           //header, index and slots
+    size_t block_bytes;
+    int file_descriptor;            //history file, -1 when the block is in memory
+    std::string requested_file;     //file name given to the last resize
+    HistoryHeader* header;
+    HistorySlice* index;
+    unsigned char* data;            //the slots
+    int n;
+    size_t cells;                   //cells per field
+    size_t field_bytes;             //bytes per stored field
+    HISTORY_FORMAT slice_format;
+    unsigned int slots;             //number of time slices that fit
+    unsigned int first;             //slot of the oldest time slice
+    unsigned int count;             //number of stored time slices
+    std::vector<fftw_real> decoded; //scratch space to measure the error of a new time slice
+};
+
+//history_format_name: Human-readable name of a history format
+const char* history_format_name(HISTORY_FORMAT format);
+
+//parse_history_format: Convert the name of a history format to the format. Returns false for unknown names.
+bool parse_history_format(const char* name, HISTORY_FORMAT& format);
+
+#endif
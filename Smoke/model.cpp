@@ -6,33 +6,120 @@
 
 Model::Model (int n)
 {
-    int i;
-    size_t dim;
-    DIM      = n;
+    vx = vy = vx0 = vy0 = fx = fy = rho = rho0 = NULL;
+    fft = NULL;
+    recorder = NULL;
+    replay = NULL;
+    timers = NULL;
+    filter_n = 0;
+    fft_options.planning = FFT_ESTIMATE;
+    fft_options.num_threads = 1;
     dt       = 0.4;
     base_visc= 0.001;
     visc_scale_factor = 1.0f;
     visc     = base_visc*visc_scale_factor;
+
+    tube_disp_factor = 10;
+    history_size = 100;
+    history_format = HISTORY_FLOAT;
+    set_simd_level(simd_supported());
+
+    resize(n);
+}
+
+Model::~Model ()
+{
+    resize(0);
+}
+
+//resize: (Re)allocate all simulation data structures for a grid of n x n cells.
+//        A size of 0 only releases the current data structures.
+void Model::resize(int n)
+{
+    int i;
+    size_t dim;
+
+    free(rho0);
+    free(rho);
+    free(fy);
+    free(fx);
+    free(vx0);                      //vy0 is part of the same allocation
+    free(vy);
+    free(vx);
+    vx = vy = vx0 = vy0 = fx = fy = rho = rho0 = NULL;
+    delete fft;
+    fft = NULL;
+    filter_a.clear();
+    filter_b.clear();
+    filter_c.clear();
+    invalidate_filter();
+    history.resize(0, 0);
+    streamTubes.reset();
+
+    DIM      = n;
+    step     = 0;
+    if (n == 0)
+        return;
+    kernels  = solver_kernels(n);
+
     dim      = n * 2*(n/2+1)*sizeof(fftw_real);        //Allocate data structures
     vx       = (fftw_real*) malloc(dim);
     vy       = (fftw_real*) malloc(dim);
-    vx0      = (fftw_real*) malloc(dim);
-    vy0      = (fftw_real*) malloc(dim);
+    vx0      = (fftw_real*) malloc(2 * dim);             //vx0 and vy0 together, so both can be transformed in one batch
+    vy0      = vx0 + n * 2*(n/2+1);
     dim      = n * n * sizeof(fftw_real);
     fx       = (fftw_real*) malloc(dim);
     fy       = (fftw_real*) malloc(dim);
     rho      = (fftw_real*) malloc(dim);
     rho0     = (fftw_real*) malloc(dim);
-    plan_rc  = rfftw2d_create_plan(n, n, FFTW_REAL_TO_COMPLEX, FFTW_IN_PLACE);
-    plan_cr  = rfftw2d_create_plan(n, n, FFTW_COMPLEX_TO_REAL, FFTW_IN_PLACE);
-
-    tube_disp_factor = 10;
-    history_size = 100;
+    fft      = create_fft_backend(n, fft_options, &workers);
+    history.resize(n, history_size, history_format, history_file);
 
     for (i = 0; i < n * n; i++)                      //Initialize data structures to 0
     {
         vx[i] = vy[i] = vx0[i] = vy0[i] = fx[i] = fy[i] = rho[i] = rho0[i] = 0.0f;
     }
+
+    // Accumulate the cell centers the same way for every row, so all workers see identical coordinates
+    cell_centers.resize(n);
+    fftw_real x = 0.5f/n;
+    for (i = 0; i < n; i++, x += 1.0f / n)
+        cell_centers[i] = x;
+    compute_stats();
+}
+
+//field_bytes: Bytes used by the velocity, force and density fields
+size_t Model::field_bytes()
+{
+    size_t padded = (size_t)DIM * 2*(DIM/2+1);
+    size_t cells  = (size_t)DIM * DIM;
+    return (4 * padded + 4 * cells + 3 * padded) * sizeof(fftw_real);   //fields and the spectral filter
+}
+
+//history_bytes: Bytes used by the velocity history once it holds 'history_size' time slices
+size_t Model::history_bytes()
+{
+    return history_size * HistoryRing::slice_bytes(DIM, history_format);
+}
+
+//report_memory: Print the memory footprint of the simulation, so machines can be sized for a grid
+void Model::report_memory(std::ostream& out)
+{
+    const double MB = 1024.0 * 1024.0;
+    out << "Memory footprint for a " << DIM << "x" << DIM << " grid:" << std::endl;
+    out << "  fields:  " << field_bytes() / MB << " MB" << std::endl;
+    out << "  history: " << history_bytes() / MB << " MB (" << history_size << " time slices, "
+        << history_format_name(history_format) << ")";
+    if (!history_file.empty())
+        out << " in " << history_file << ", not counted in the total";
+    out << std::endl;
+    if (history_format != HISTORY_FLOAT)
+    {
+        size_t uncompressed = history_size * HistoryRing::slice_bytes(DIM, HISTORY_FLOAT);
+        out << "           saves " << (uncompressed - history_bytes()) / MB << " MB, "
+            << (double)uncompressed / history_bytes() << "x the time slices fit in the same memory" << std::endl;
+    }
+    out << "  total:   " << (field_bytes() + (history_file.empty() ? history_bytes() : 0)) / MB << " MB" << std::endl;
 }
 
 //FFT: Execute the Fast Fourier Transform on the dataset 'vx'.
@@ -41,53 +128,83 @@ void Model::FFT(int direction, void* vx)
 {
     if (direction==1)
     {
-        rfftwnd_one_real_to_complex(plan_rc,(fftw_real*)vx,(fftw_complex*)vx);
+        fft->forward((fftw_real*)vx, 1, 0);
     }
     else
     {
-        rfftwnd_one_complex_to_real(plan_cr,(fftw_complex*)vx,(fftw_real*)vx);
+        fft->inverse((fftw_real*)vx, 1, 0);
     }
 }
 
-//solve: Solve (compute) one step of the fluid flow simulation
-void Model::solve(int n, fftw_real* vx, fftw_real* vy, fftw_real* vx0, fftw_real* vy0, fftw_real visc, fftw_real dt)
+//FFT_velocity: Execute the Fast Fourier Transform on both vx0 and vy0 in one batch
+void Model::FFT_velocity(int direction)
 {
-    fftw_real x, y, x0, y0, f, r, U[2], V[2], s, t, magnitude;
-    int i, j, i0, j0, i1, j1;
-
-    for (i=0;i<n*n;i++)
+    int dist = vy0 - vx0;
+    if (direction==1)
     {
-        vx[i] += dt*vx0[i]; vx0[i] = vx[i]; vy[i] += dt*vy0[i]; vy0[i] = vy[i];
+        fft->forward(vx0, 2, dist);
     }
-
-    for ( x= 0.5f/n,i=0; i<n; i++, x += 1.0f / n )
+    else
     {
-        for ( y=0.5f/n,j=0 ; j<n ; j++,y+=1.0f/n )
-        {
-            x0 = n*(x-dt*vx0[i+n*j])-0.5f;
-            y0 = n*(y-dt*vy0[i+n*j])-0.5f;
-            i0 = clamp(x0); s = x0-i0;
-            i0 = (n+(i0%n))%n;
-            i1 = (i0+1)%n;
-            j0 = clamp(y0); t = y0-j0;
-            j0 = (n+(j0%n))%n;
-            j1 = (j0+1)%n;
-            vx[i+n*j] = (1-s)*((1-t)*vx0[i0+n*j0]+t*vx0[i0+n*j1])+s*((1-t)*vx0[i1+n*j0]+t*vx0[i1+n*j1]);
-            vy[i+n*j] = (1-s)*((1-t)*vy0[i0+n*j0]+t*vy0[i0+n*j1])+s*((1-t)*vy0[i1+n*j0]+t*vy0[i1+n*j1]);
-        }
+        fft->inverse(vx0, 2, dist);
     }
+}
 
-    for(i=0; i<n; i++)
+//set_fft_options: Change the FFT planning, threads and wisdom file. Plans the transforms again.
+void Model::set_fft_options(const FFTOptions& options)
+{
+    fft_options = options;
+    if (fft)
     {
-        for(j=0; j<n; j++)
-        {
-            vx0[i+(n+2)*j] = vx[i+n*j]; vy0[i+(n+2)*j] = vy[i+n*j];
-        }
+        delete fft;
+        fft = create_fft_backend(DIM, fft_options, &workers);
     }
+}
+
+//set_num_threads: Set the number of threads used for advection
+void Model::set_num_threads(int num_threads)
+{
+    workers.resize(num_threads);
+    fft_options.num_threads = workers.size();
+    if (fft)
+        fft->set_num_threads(fft_options.num_threads);
+}
+
+//set_simd_level: Select the advection and sampling kernels. Levels the CPU does not support fall back to the scalar code.
+void Model::set_simd_level(SIMD_LEVEL level)
+{
+    simd_advect = advect_kernel(level);
+    simd_level = simd_advect ? level : SIMD_SCALAR;
+    simd_sample = sample_kernel(simd_level);
+}
+
+//sample: Bilinearly sample 'num_fields' fields of the grid at the 'count' index coordinates (x[i], y[i])
+void Model::sample(int num_fields, const fftw_real* const* src, const fftw_real* x, const fftw_real* y, size_t count, fftw_real* const* dst, SAMPLE_BOUNDARY boundary)
+{
+    simd_sample(DIM, boundary, num_fields, src, x, y, count, dst);
+}
 
-    FFT(1,vx0);
-    FFT(1,vy0);
+//advect: Semi-Lagrangian advection of 'num_fields' fields through the velocity field (u, v).
+//        The rows are split between the workers, every cell is computed the same way regardless of the split.
+//        The vectorized kernel for simd_level is used when there is one.
+void Model::advect(int n, const fftw_real* u, const fftw_real* v, fftw_real dt, int num_fields, const fftw_real* const* src, fftw_real* const* dst)
+{
+    workers.run(0, n, [=](int j_begin, int j_end) {
+        AdvectKernel kernel = simd_advect ? simd_advect : kernels.advect;
+        kernel(n, cell_centers.data(), u, v, dt, num_fields, src, dst, j_begin, j_end);
+    });
+}
 
+//build_filter: Tabulate the frequency domain part of solve for the wavenumbers of an n x n grid
+void Model::build_filter(int n, fftw_real visc, fftw_real dt)
+{
+    fftw_real x, y, f, r;
+    int i, j;
+    const int stride = 2*(n/2+1);               //the padded rows of the FFT
+
+    filter_a.resize(n*stride);
+    filter_b.resize(n*stride);
+    filter_c.resize(n*stride);
     for (i=0;i<=n;i+=2)
     {
         x = 0.5f*i;
@@ -95,218 +212,298 @@ void Model::solve(int n, fftw_real* vx, fftw_real* vy, fftw_real* vx0, fftw_real
         {
             y = j<=n/2 ? (fftw_real)j : (fftw_real)j-n;
             r = x*x+y*y;
-            if ( r==0.0f )
+            fftw_real a = 1, b = 0, c = 1;          //the mean flow is kept as it is
+            if ( r!=0.0f )
             {
-                continue;
+                f = (fftw_real)exp(-r*dt*visc);
+                a = f*(1-x*x/r);
+                b = f*(-x*y/r);
+                c = f*(1-y*y/r);
             }
-            f = (fftw_real)exp(-r*dt*visc);
-            U[0] = vx0[i  +(n+2)*j];
-            V[0] = vy0[i  +(n+2)*j];
-            U[1] = vx0[i+1+(n+2)*j];
-            V[1] = vy0[i+1+(n+2)*j];
-
-            vx0[i  +(n+2)*j] = f*((1-x*x/r)*U[0]     -x*y/r *V[0]);
-            vx0[i+1+(n+2)*j] = f*((1-x*x/r)*U[1]     -x*y/r *V[1]);
-            vy0[i+  (n+2)*j] = f*(  -y*x/r *U[0] + (1-y*y/r)*V[0]);
-            vy0[i+1+(n+2)*j] = f*(  -y*x/r *U[1] + (1-y*y/r)*V[1]);
+            filter_a[i+stride*j] = filter_a[i+1+stride*j] = a;
+            filter_b[i+stride*j] = filter_b[i+1+stride*j] = b;
+            filter_c[i+stride*j] = filter_c[i+1+stride*j] = c;
         }
     }
+    filter_n = n;
+    filter_visc = visc;
+    filter_dt = dt;
+}
 
-    FFT(-1,vx0);
-    FFT(-1,vy0);
+//invalidate_filter: Build the filter again at the next step, e.g. after the viscosity changed
+void Model::invalidate_filter()
+{
+    filter_n = 0;
+}
 
-    f = 1.0/(n*n);
-    for (i=0;i<n;i++)
+//apply_filter_rows: Apply the filter to rows [j_begin, j_end) of the spectra of vx0 and vy0
+void Model::apply_filter_rows(int n, fftw_real* vx0, fftw_real* vy0, int j_begin, int j_end)
+{
+    // Re and im have their own coefficients, so a row is a plain element-wise loop that the compiler vectorizes
+    const int stride = 2*(n/2+1);
+    const fftw_real* __restrict__ a = filter_a.data() + stride*j_begin;
+    const fftw_real* __restrict__ b = filter_b.data() + stride*j_begin;
+    const fftw_real* __restrict__ c = filter_c.data() + stride*j_begin;
+    fftw_real* __restrict__ u = vx0 + stride*j_begin;
+    fftw_real* __restrict__ v = vy0 + stride*j_begin;
+    int count = stride*(j_end-j_begin);
+    for (int k = 0; k < count; k++)
     {
-        for (j=0;j<n;j++)
-        {
-            vx[i+n*j] = f*vx0[i+(n+2)*j]; 
-            vy[i+n*j] = f*vy0[i+(n+2)*j];
-            // Calculate the min and max magnitude of all velocities per timestep
-            magnitude = sqrt(vx[i+n*j] * vx[i+n*j] + vy[i+n*j] * vy[i+n*j]);
-            if (i == 0 && j == 0)
-            {
-                min_velo = FLT_MAX;
-                max_velo = -FLT_MAX;
-            }
-            else if (magnitude < min_velo)
-            {
-                min_velo = magnitude;
-            }
-            else if (magnitude > max_velo)
-            {
-                max_velo = magnitude;
-            }
-        }
+        fftw_real U = u[k], V = v[k];
+        u[k] = a[k]*U + b[k]*V;
+        v[k] = b[k]*U + c[k]*V;
     }
 }
 
-void Model::streamtube_flow()
+//solve: Solve (compute) one step of the fluid flow simulation
+void Model::solve(int n, fftw_real* vx, fftw_real* vy, fftw_real* vx0, fftw_real* vy0, fftw_real visc, fftw_real dt)
 {
-    for (auto streamtube = streamTubes.begin(); streamtube != streamTubes.end(); ++streamtube)
     {
-        fftw_real interp_x, interp_y;
-        Point3d seed = (*streamtube).seed;
-        Point3d previous = seed;
-        (*streamtube).tail.clear();
-        auto time_slice = time_slices.end();
-        std::advance(time_slice, seed.z);
-        for (; time_slice != time_slices.end(); ++time_slice)
+        ScopedTimer timer(timers, PHASE_ADVECTION);
+        kernels.add_forces(n, vx, vy, vx0, vy0, dt);
+
+        const fftw_real* src[2] = {vx0, vy0};
+        fftw_real* dst[2] = {vx, vy};
+        advect(n, vx0, vy0, dt, 2, src, dst);
+    }
+
+    {
+        ScopedTimer timer(timers, PHASE_FFT_FORWARD);
+        kernels.pad(n, vx, vy, vx0, vy0);
+
+        if (vx0 == this->vx0 && vy0 == this->vy0)
+        {
+            FFT_velocity(1);
+        }
+        else
         {
-            Point3d current;
-            // pair of vx, vy of certain time
-            fftw_real* vel_x = (*time_slice).first;
-            fftw_real* vel_y = (*time_slice).second;
-            // Calculate dx and dy using interpolation
-            interp_x = interpolate(vel_x, previous.x, previous.y);
-            interp_y = interpolate(vel_y, previous.x, previous.y);
-            current.x = previous.x + interp_x * dt * tube_disp_factor;
-            current.y = previous.y + interp_y * dt * tube_disp_factor;
-            current.z = previous.z + 1;
-            current.magnitude = (interp_x * interp_x + interp_y * interp_y) * 10e4;
-            current.magnitude = current.magnitude > 20 ? 20 : current.magnitude;
-            // Insert the newly calculated point
-            (*streamtube).tail.push_back(current);
-            previous = current;
+            FFT(1,vx0);
+            FFT(1,vy0);
         }
     }
+
+    {
+        ScopedTimer timer(timers, PHASE_PROJECTION);
+        if (filter_n != n || filter_visc != visc || filter_dt != dt)
+            build_filter(n, visc, dt);
+        workers.run(0, n, [=](int j_begin, int j_end) {
+            apply_filter_rows(n, vx0, vy0, j_begin, j_end);
+        });
+    }
+
+    ScopedTimer timer(timers, PHASE_FFT_INVERSE);
+    if (vx0 == this->vx0 && vy0 == this->vy0)
+    {
+        FFT_velocity(-1);
+    }
+    else
+    {
+        FFT(-1,vx0);
+        FFT(-1,vy0);
+    }
+
+    kernels.unpad(n, vx0, vy0, vx, vy);
 }
 
-void Model::store_history()
+// Statistics are accumulated per field in a local FieldStats, reset_stats and add_stat keep the loops simple
+// enough for the compiler to vectorize them.
+static inline void reset_stats(FieldStats& stats)
 {
-    // Store the last 50 timeframes, if queue exceeds 50 frames, pop first before push
-    if (time_slices.size() >= history_size)
+    stats.min = FLT_MAX;
+    stats.max = -FLT_MAX;
+    stats.sum = 0.0;
+}
+
+static inline void add_stat(FieldStats& stats, fftw_real value)
+{
+    stats.min = std::min(stats.min, value);
+    stats.max = std::max(stats.max, value);
+    stats.sum += value;
+}
+
+static inline void merge_stats(FieldStats& stats, const FieldStats& row)
+{
+    stats.min = std::min(stats.min, row.min);
+    stats.max = std::max(stats.max, row.max);
+    stats.sum += row.sum;
+}
+
+//compute_row_stats: Statistics of all datasets over grid row j. The divergence is the central difference
+//                   with periodic boundaries, as in Visualization::divergence.
+void Model::compute_row_stats(int j, SimulationStats& row)
+{
+    int n = DIM;
+    const fftw_real* vx_row = vx + n * j;
+    const fftw_real* vy_row = vy + n * j;
+    const fftw_real* fx_row = fx + n * j;
+    const fftw_real* fy_row = fy + n * j;
+    const fftw_real* vy_prev = vy + n * ((j - 1 + n) % n);
+    const fftw_real* vy_next = vy + n * ((j + 1) % n);
+    const fftw_real* fy_prev = fy + n * ((j - 1 + n) % n);
+    const fftw_real* fy_next = fy + n * ((j + 1) % n);
+    FieldStats rho_stats, velocity, force, div_velocity, div_force;
+    reset_stats(rho_stats);
+    reset_stats(velocity);
+    reset_stats(force);
+    reset_stats(div_velocity);
+    reset_stats(div_force);
+
+    // The first and last column wrap around, the interior columns are a plain loop that the compiler vectorizes
+    auto add_cell = [&](int i, int prev, int next) {
+        add_stat(rho_stats, rho[i + n * j]);
+        add_stat(velocity, sqrt(vx_row[i] * vx_row[i] + vy_row[i] * vy_row[i]));
+        add_stat(force, sqrt(fx_row[i] * fx_row[i] + fy_row[i] * fy_row[i]));
+        add_stat(div_velocity, vx_row[next] - vx_row[prev] + vy_next[i] - vy_prev[i]);
+        add_stat(div_force, fx_row[next] - fx_row[prev] + fy_next[i] - fy_prev[i]);
+    };
+    add_cell(0, n - 1, 1 % n);
+    for (int i = 1; i < n - 1; i++)
+        add_cell(i, i - 1, i + 1);
+    if (n > 1)
+        add_cell(n - 1, n - 2, 0);
+    row.rho = rho_stats;
+    row.velocity = velocity;
+    row.force = force;
+    row.div_velocity = div_velocity;
+    row.div_force = div_force;
+}
+
+//compute_stats: Compute the statistics of all datasets in a single pass over the grid
+void Model::compute_stats()
+{
+    int n = DIM;
+    row_stats.resize(n);
+    workers.run(0, n, [this](int j_begin, int j_end) {
+        for (int j = j_begin; j < j_end; j++)
+            compute_row_stats(j, row_stats[j]);
+    });
+
+    FieldStats* fields[] = {&stats.rho, &stats.velocity, &stats.force, &stats.div_velocity, &stats.div_force};
+    for (FieldStats* field : fields)
+        reset_stats(*field);
+    for (int j = 0; j < n; j++)
     {
-        auto tmppair = time_slices.front();
-        free(tmppair.first);
-        free(tmppair.second);
-        time_slices.pop_front();
+        merge_stats(stats.rho, row_stats[j].rho);
+        merge_stats(stats.velocity, row_stats[j].velocity);
+        merge_stats(stats.force, row_stats[j].force);
+        merge_stats(stats.div_velocity, row_stats[j].div_velocity);
+        merge_stats(stats.div_force, row_stats[j].div_force);
     }
-    // Copy all current simulation velocities and push them in to the queue
-    size_t dim = DIM * 2 * (DIM/2+1);
-    copied_vx = (fftw_real*) malloc(dim * sizeof(fftw_real));
-    copied_vy = (fftw_real*) malloc(dim * sizeof(fftw_real));
-    std::copy(vx, vx + dim, copied_vx);
-    std::copy(vy, vy + dim, copied_vy);
-    auto pair = std::make_pair(copied_vx, copied_vy);
-    time_slices.push_back(pair);
+    for (FieldStats* field : fields)
+        field->mean = field->sum / ((double)n * n);
+}
+
+//streamtube_flow: Extend every stream tube with the time slices stored since the previous step
+void Model::streamtube_flow()
+{
+    streamTubes.trace(history, DIM, dt, tube_disp_factor, workers);
+}
+
+void Model::store_history()
+{
+    // Keep the last 'history_size' time slices; the oldest one is overwritten once the ring is full. A history file
+    // that could not be mapped is not retried until another one is asked for, the ring stays in memory meanwhile.
+    if (history.capacity() != history_size || history.format() != history_format || history.file() != history_file)
+        history.resize(DIM, history_size, history_format, history_file);
+    history.push(vx, vy);
 }
 //do_one_simulation_step: Do one complete cycle of the simulation:
+//      - replay:           inject the replayed forces and matter of this step
 //      - set_forces:
 //      - solve:            read forces from the user
 //      - diffuse_matter:   compute a new set of velocities
+//      - compute_stats:    min, max, mean and sum of all datasets
 //      - gluPostRedisplay: draw a new visualization frame
 void Model::do_one_simulation_step(const int DIM)
 {
-    set_forces(DIM);
+    ScopedTimer step_timer(timers, PHASE_STEP);
+    if (replay)
+        replay->apply(*this);
+    {
+        ScopedTimer timer(timers, PHASE_SET_FORCES);
+        set_forces(DIM);
+    }
     solve(DIM, vx, vy, vx0, vy0, visc, dt);
-    diffuse_matter(DIM, vx, vy, rho, rho0, dt);
-    streamtube_flow();
-    store_history();
+    {
+        ScopedTimer timer(timers, PHASE_DIFFUSE_MATTER);
+        diffuse_matter(DIM, vx, vy, rho, rho0, dt);
+    }
+    {
+        ScopedTimer timer(timers, PHASE_COMPUTE_STATS);
+        compute_stats();
+    }
+    {
+        ScopedTimer timer(timers, PHASE_STREAMTUBE_FLOW);
+        streamtube_flow();
+    }
+    {
+        ScopedTimer timer(timers, PHASE_STORE_HISTORY);
+        store_history();
+    }
+    step++;
+}
+
+//view: Let 'frame' point at the current fields of the model. It is only valid until the next step.
+void Model::view(FieldSnapshot& frame)
+{
+    frame.DIM = DIM;
+    frame.step = step;
+    frame.vx = vx;
+    frame.vy = vy;
+    frame.fx = fx;
+    frame.fy = fy;
+    frame.rho = rho;
+    frame.stats = stats;
+    frame.streamTubes = &streamTubes;
+}
+
+//capture: Copy the current fields into 'frame'. Reuses the frame's storage when the grid size did not change.
+void Model::capture(FieldSnapshot& frame)
+{
+    size_t cells = (size_t)DIM * DIM;
+    frame.fields.resize(5 * cells);
+    fftw_real* fields = frame.fields.data();
+    std::copy(vx, vx + cells, fields);
+    std::copy(vy, vy + cells, fields + cells);
+    std::copy(fx, fx + cells, fields + 2 * cells);
+    std::copy(fy, fy + cells, fields + 3 * cells);
+    std::copy(rho, rho + cells, fields + 4 * cells);
+    frame.tubes = streamTubes;
+
+    frame.DIM = DIM;
+    frame.step = step;
+    frame.vx = fields;
+    frame.vy = fields + cells;
+    frame.fx = fields + 2 * cells;
+    frame.fy = fields + 3 * cells;
+    frame.rho = fields + 4 * cells;
+    frame.stats = stats;
+    frame.streamTubes = &frame.tubes;
 }
 
+//inject: Add a force (fx, fy) and set the matter density to 'density' at grid cell (X, Y)
+void Model::inject(int X, int Y, fftw_real fx, fftw_real fy, fftw_real density)
+{
+    this->fx[Y * DIM + X] += fx;
+    this->fy[Y * DIM + X] += fy;
+    rho[Y * DIM + X] = density;
+    if (recorder)
+        recorder->record({step, X, Y, fx, fy, density});
+}
 
 // diffuse_matter: This function diffuses matter that has been placed in the velocity field. It's almost identical to the
 // velocity diffusion step in the function above. The input matter densities are in rho0 and the result is written into rho.
 void Model::diffuse_matter(int n, fftw_real *vx, fftw_real *vy, fftw_real *rho, fftw_real *rho0, fftw_real dt)
 {
-    fftw_real x, y, x0, y0, s, t, tmp;
-    int i, j, i0, j0, i1, j1;
-    for ( x=0.5f/n,i=0 ; i<n ; i++,x+=1.0f/n )
-    {
-        for ( y=0.5f/n,j=0 ; j<n ; j++,y+=1.0f/n )
-        {
-            x0 = n*(x-dt*vx[i+n*j])-0.5f;
-            y0 = n*(y-dt*vy[i+n*j])-0.5f;
-            i0 = clamp(x0);
-            s = x0-i0;
-            i0 = (n+(i0%n))%n;
-            i1 = (i0+1)%n;
-            j0 = clamp(y0);
-            t = y0-j0;
-            j0 = (n+(j0%n))%n;
-            j1 = (j0+1)%n;
-            tmp = (1-s)*((1-t)*rho0[i0+n*j0]+t*rho0[i0+n*j1])+s*((1-t)*rho0[i1+n*j0]+t*rho0[i1+n*j1]);
-            // Calculate min and max rho values per timestep
-            if (i == 0 && j == 0)
-            {
-                min_rho = FLT_MAX;
-                max_rho = -FLT_MAX;
-            }
-            else if (tmp < min_rho)
-            {
-                min_rho = tmp;
-            }
-            else if (tmp > max_rho)
-            {
-                max_rho = tmp;
-            }
-            rho[i+n*j] = tmp;
-        }
-    }
+    const fftw_real* src[1] = {rho0};
+    fftw_real* dst[1] = {rho};
+    advect(n, vx, vy, dt, 1, src, dst);
 }
 
 //set_forces: copy user-controlled forces to the force vectors that are sent to the solver.
 //            Also dampen forces and matter density to get a stable simulation.
 void Model::set_forces(const int DIM)
 {
-    int i;
-    fftw_real magnitude;
-    for (i = 0; i < DIM * DIM; i++)
-    {
-        rho0[i]  = 0.995 * rho[i];
-        fx[i] *= 0.85;
-        fy[i] *= 0.85;
-        vx0[i]    = fx[i];
-        vy0[i]    = fy[i];
-        // Calculate the min and max magnitude of all force fields per timestep
-        magnitude = sqrt(fx[i] * fx[i] + fy[i] * fy[i]);
-        if (i == 0)
-        {
-            min_force = FLT_MAX;
-            max_force = -FLT_MAX;
-        }
-        else if (magnitude < min_force)
-        {
-            min_force = magnitude;
-        }
-        else if (magnitude > max_force)
-        {
-            max_force = magnitude;
-        }
-    }
+    kernels.damp(DIM, rho, rho0, fx, fy, vx0, vy0);
 }
 
-// Use interpolation to calculate the value of the dataset v at index coordinates (x, y)
-fftw_real Model::interpolate(fftw_real *v, double x, double y)
-{
-    int x_lower = floor(x);
-    int x_upper = ceil(x);
-    int y_lower = floor(y);
-    int y_upper = ceil(y);
-
-    if (x_lower > DIM || x_lower < 0 ||
-        x_upper > DIM || x_upper < 0 ||
-        y_lower > DIM || y_lower < 0 ||
-        y_upper > DIM || y_upper < 0)
-        return 0;
-
-    // The fraction (between 0 and 1) of how far the point is in between the gridpoints
-    double alpha_x = x - x_lower;
-    double alpha_y = y - y_lower;
-
-    fftw_real upper_left =  v[y_upper * DIM + x_lower];
-    fftw_real upper_right = v[y_upper * DIM + x_upper];
-    fftw_real lower_left =  v[y_lower * DIM + x_lower];
-    fftw_real lower_right = v[y_lower * DIM + x_upper];
-
-    // See http://en.wikipedia.org/wiki/Bilinear_interpolation#mediaviewer/File:Bilinear_interpolation_visualisation.svg
-    fftw_real red =     lower_right * alpha_x       * (1 - alpha_y);
-    fftw_real green =   lower_left  * (1 - alpha_x) * (1 - alpha_y);
-    fftw_real blue =    upper_right * alpha_x       * alpha_y;
-    fftw_real yellow =  upper_left  * (1 - alpha_x) * alpha_y;
-
-    fftw_real value = red + green + blue + yellow;
-    
-    return value;
-}
@@ -5,43 +5,94 @@
 #include <cfloat>
 #include <queue>
 #include <list>
+#include <algorithm>
 #include <iostream>
+#include <vector>
+#include "workers.h"
+#include "simd.h"
+#include "fft.h"
+#include "history.h"
+#include "tubes.h"
+#include "solver.h"
+#include "recording.h"
+#include "timing.h"
 
 using namespace std;
 
-typedef struct point3d {
-    double x, y, z;
-    double magnitude;
-} Point3d;
+typedef struct field_stats {
+    fftw_real min, max;
+    double mean, sum;
+} FieldStats;
 
-typedef struct streamtube {
-    Point3d seed;
-    std::list<Point3d> tail;
-} streamTube;
+// Statistics of every scalar dataset, computed once after each simulation step
+typedef struct simulation_stats {
+    FieldStats rho;             // smoke density
+    FieldStats velocity;        // magnitude of the velocity
+    FieldStats force;           // magnitude of the force
+    FieldStats div_velocity;    // divergence of the velocity
+    FieldStats div_force;       // divergence of the force
+} SimulationStats;
+
+// FieldSnapshot: Everything the visualization draws from. The fields either point into the model ('view') or
+//                into the snapshot's own copy of them ('capture'), so a copy can be drawn while the model keeps stepping.
+typedef struct field_snapshot {
+    int DIM;
+    unsigned long step;                         // number of simulation steps done when the snapshot was taken
+    const fftw_real *vx, *vy, *fx, *fy, *rho;   // DIM x DIM fields
+    SimulationStats stats;
+    const StreamTubes* streamTubes;
+    std::vector<fftw_real> fields;              // storage of the copied fields
+    StreamTubes tubes;                          // storage of the copied stream tubes
+} FieldSnapshot;
 
 class Model {
 public:
     Model (int);
+    ~Model ();
+
+    //resize: (Re)allocate all simulation data structures for a grid of n x n cells.
+    //        Existing field values and history are discarded.
+    void resize(int n);
+
+    //field_bytes, history_bytes: Bytes used by the simulation fields, and by a full history of 'history_size' time slices
+    size_t field_bytes();
+    size_t history_bytes();
+
+    //report_memory: Print the memory footprint of the simulation, so machines can be sized for a grid
+    void report_memory(std::ostream& out);
 
     //--- SIMULATION PARAMETERS ------------------------------------------------------------------------
     int DIM;
     double dt;            //simulation time step
     float visc, base_visc, visc_scale_factor;          //fluid viscosity
     int winWidth, winHeight;          //size of the graphics window, in pixels
-    std::deque<std::pair<fftw_real*, fftw_real*>> time_slices; // Time slices
+    HistoryRing history;            //velocity of the last 'history_size' time steps, for the stream tubes
     fftw_real *vx, *vy;             //(vx,vy)   = velocity field at the current moment
-    fftw_real *vx0, *vy0;           //(vx0,vy0) = velocity field at the previous moment
+    fftw_real *vx0, *vy0;           //(vx0,vy0) = velocity field at the previous moment, vy0 directly follows vx0 in memory
     fftw_real *fx, *fy;             //(fx,fy)   = user-controlled simulation forces, steered with the mouse
     fftw_real *rho, *rho0;          //smoke density at the current (rho) and previous (rho0) moment
-    fftw_real *copied_vx, *copied_vy, *copied_fx, *copied_fy; //pointer for copied values to store in queue
-    fftw_real min_rho, max_rho;     // Min and max values of the 2d rho matrix
-    fftw_real min_velo, max_velo;   // Min and max magnitudes of the velocities
-    fftw_real min_force, max_force; // Min and max magnitudes of the forces
-    fftw_real min_div, max_div; // Min and max magnitudes of the forces
-    rfftwnd_plan plan_rc, plan_cr;  //simulation domain discretization
-    std::list<streamTube> streamTubes;
+    SimulationStats stats;          // Min, max, mean and sum of all datasets at the current moment
+    std::vector<SimulationStats> row_stats; // Statistics per grid row, merged into 'stats'
+    FFTBackend* fft;                //simulation domain discretization
+    FFTOptions fft_options;
+    StreamTubes streamTubes;
     int tube_disp_factor;
     unsigned int history_size;
+    HISTORY_FORMAT history_format;  //how the time slices are stored, compressed formats keep longer histories
+    std::string history_file;       //memory-mapped file for the time slices, empty to keep them in memory
+    WorkerPool workers;             //threads that share the advection rows
+    SIMD_LEVEL simd_level;          //instruction set used for advection
+    AdvectKernel simd_advect;       //vectorized advection kernel, NULL for the scalar code
+    SampleKernel simd_sample;       //sampling kernel for simd_level
+    SolverKernels kernels;          //loops of a step, specialized for the grid size when it is a common one
+    std::vector<fftw_real> cell_centers; //x (and y) coordinate of the center of every column (and row), in [0,1]
+    unsigned long step;             //number of simulation steps since the last resize
+    InjectionRecorder* recorder;    //appends every injection to a recording when set
+    const InjectionReplay* replay;  //injections applied at the start of every step when set
+    PhaseTimers* timers;            //receives the duration of every phase of a step when set
+    std::vector<fftw_real> filter_a, filter_b, filter_c; //spectral projection and diffusion filter, see build_filter
+    int filter_n;                   //grid size, viscosity and time step the filter was built for, 0 when it is invalid
+    fftw_real filter_visc, filter_dt;
 
     //------ SIMULATION CODE STARTS HERE -----------------------------------------------------------------
 
@@ -49,6 +100,34 @@ public:
     //     'direction' indicates if we do the direct (1) or inverse (-1) Fourier Transform
     void FFT(int direction, void* vx);
 
+    //FFT_velocity: Execute the Fast Fourier Transform on both vx0 and vy0 in one batch
+    void FFT_velocity(int direction);
+
+    //set_fft_options: Change the FFT planning, threads and wisdom file. Plans the transforms again.
+    void set_fft_options(const FFTOptions& options);
+
+    //advect: Semi-Lagrangian advection of 'num_fields' fields through the velocity field (u, v).
+    //        Every cell traces back along the velocity and takes the bilinear interpolation of src[k] there, which
+    //        is written into dst[k]. The rows are split between the workers; the result does not depend on their number.
+    void advect(int n, const fftw_real* u, const fftw_real* v, fftw_real dt, int num_fields, const fftw_real* const* src, fftw_real* const* dst);
+
+    //set_num_threads: Set the number of threads used for advection
+    void set_num_threads(int num_threads);
+
+    //set_simd_level: Select the advection and sampling kernels. Levels the CPU does not support fall back to the scalar code.
+    void set_simd_level(SIMD_LEVEL level);
+
+    //build_filter: Tabulate the frequency domain part of solve for the wavenumbers of an n x n grid. Every velocity
+    //              (U, V) in the padded spectrum becomes (a*U + b*V, b*U + c*V): the projection onto the divergence free
+    //              fields, damped by the viscosity. The coefficients are stored per real, so re and im share a value.
+    void build_filter(int n, fftw_real visc, fftw_real dt);
+
+    //invalidate_filter: Build the filter again at the next step, e.g. after the viscosity changed
+    void invalidate_filter();
+
+    //apply_filter_rows: Apply the filter to rows [j_begin, j_end) of the spectra of vx0 and vy0
+    void apply_filter_rows(int n, fftw_real* vx0, fftw_real* vy0, int j_begin, int j_end);
+
     //solve: Solve (compute) one step of the fluid flow simulation
     void solve(int n, fftw_real* vx, fftw_real* vy, fftw_real* vx0, fftw_real* vy0, fftw_real visc, fftw_real dt);
 
@@ -70,18 +149,36 @@ public:
     //            Also dampen forces and matter density to get a stable simulation.
     void set_forces(const int DIM);
 
+    //compute_stats: Compute the statistics of all datasets in a single pass over the grid.
+    //               The rows are split between the workers and merged in row order, so the result does not depend on their number.
+    void compute_stats();
+    void compute_row_stats(int j, SimulationStats& row);
+
+    //streamtube_flow: Extend every stream tube with the time slices stored since the previous step, see StreamTubes::trace
     void streamtube_flow();
     void store_history();
     //do_one_simulation_step: Do one complete cycle of the simulation:
+    //      - replay:           inject the replayed forces and matter of this step
     //      - set_forces:
     //      - solve:            read forces from the user
     //      - diffuse_matter:   compute a new set of velocities
+    //      - compute_stats:    min, max, mean and sum of all datasets
     //      - gluPostRedisplay: draw a new visualization frame
     void do_one_simulation_step(const int DIM);
 
-    // Use interpolation to calculate the value of the vector field v at index coordinates (x, y)
-    fftw_real interpolate(fftw_real *v, double x, double y);
-    fftw_real interpolate_vec(std::vector<fftw_real> &v, double x, double y);
+    //view: Let 'frame' point at the current fields of the model. It is only valid until the next step.
+    void view(FieldSnapshot& frame);
+
+    //capture: Copy the current fields into 'frame'. Reuses the frame's storage when the grid size did not change.
+    void capture(FieldSnapshot& frame);
+
+    //inject: Add a force (fx, fy) and set the matter density to 'density' at grid cell (X, Y). It is recorded when
+    //        'recorder' is set, as an injection before the next step.
+    void inject(int X, int Y, fftw_real fx, fftw_real fy, fftw_real density);
+
+    //sample: Bilinearly sample 'num_fields' DIM x DIM fields at the 'count' index coordinates (x[i], y[i]) into
+    //        dst[k][i], with the sampling kernel of simd_level. See SampleKernel.
+    void sample(int num_fields, const fftw_real* const* src, const fftw_real* x, const fftw_real* y, size_t count, fftw_real* const* dst, SAMPLE_BOUNDARY boundary = SAMPLE_PERIODIC);
 
 };
 #endif
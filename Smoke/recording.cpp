@@ -0,0 +1,190 @@
+#include "recording.h"
+#include "model.h"
+#include <string.h>
+#include <errno.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+static const char recording_magic[8] = {'S', 'M', 'O', 'K', 'E', 'R', 'E', 'C'};
+
+//to_record, from_record: Convert between an injection and its record in a recording file
+static InjectionRecord to_record(const Injection& injection)
+{
+    InjectionRecord record;
+    record.step = injection.step;
+    record.x = injection.x;
+    record.y = injection.y;
+    record.fx = injection.fx;
+    record.fy = injection.fy;
+    record.rho = injection.rho;
+    return record;
+}
+
+static Injection from_record(const InjectionRecord& record)
+{
+    Injection injection;
+    injection.step = record.step;
+    injection.x = record.x;
+    injection.y = record.y;
+    injection.fx = record.fx;
+    injection.fy = record.fy;
+    injection.rho = record.rho;
+    return injection;
+}
+
+//write_header: Start a recording for an n x n grid
+static bool write_header(FILE* file, int n)
+{
+    RecordingHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, recording_magic, sizeof(header.magic));
+    header.version = RECORDING_VERSION;
+    header.n = n;
+    return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+InjectionRecorder::InjectionRecorder() : count(0), file(NULL)
+{
+}
+
+InjectionRecorder::~InjectionRecorder()
+{
+    close();
+}
+
+//open: Start a new recording in 'file' for an n x n grid
+bool InjectionRecorder::open(const std::string& file, int n, std::string& error)
+{
+    close();
+    this->file = fopen(file.c_str(), "wb");
+    if (!this->file || !write_header(this->file, n))
+    {
+        error = file + ": " + strerror(errno);
+        close();
+        return false;
+    }
+    count = 0;
+    return true;
+}
+
+//close: Write the buffered records and close the file
+void InjectionRecorder::close()
+{
+    if (file)
+        fclose(file);
+    file = NULL;
+}
+
+//record: Append one injection. The records are buffered, the file is only written once the buffer is full.
+void InjectionRecorder::record(const Injection& injection)
+{
+    if (!file)
+        return;
+    InjectionRecord record = to_record(injection);
+    fwrite(&record, sizeof(record), 1, file);
+    count++;
+}
+
+//read_recording: Read the injections of a recording for an n x n grid, 'file' is positioned after the magic
+static bool read_recording(FILE* file, int n, std::vector<Injection>& injections, std::string& error)
+{
+    RecordingHeader header;
+    memcpy(header.magic, recording_magic, sizeof(header.magic));
+    if (fread(&header.version, sizeof(header) - sizeof(header.magic), 1, file) != 1)
+    {
+        error = "truncated header";
+        return false;
+    }
+    if (header.version != RECORDING_VERSION)
+    {
+        error = "recording version " + std::to_string(header.version) + ", this build reads version " + std::to_string(RECORDING_VERSION);
+        return false;
+    }
+    if ((int)header.n != n)
+    {
+        error = "recorded on a " + std::to_string(header.n) + "x" + std::to_string(header.n) + " grid, not " +
+                std::to_string(n) + "x" + std::to_string(n);
+        return false;
+    }
+    InjectionRecord records[256];
+    size_t count;
+    while ((count = fread(records, sizeof(InjectionRecord), 256, file)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+            injections.push_back(from_record(records[i]));
+    }
+    return true;
+}
+
+//read_script: Read the injections of a text script, one "step x y fx fy rho" per line
+static bool read_script(const std::string& filename, std::vector<Injection>& injections, std::string& error)
+{
+    std::ifstream file(filename.c_str());
+    std::string line;
+    int line_nr = 0;
+    while (std::getline(file, line))
+    {
+        line_nr++;
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        std::istringstream fields(line);
+        Injection injection;
+        long step;
+        if (!(fields >> step >> injection.x >> injection.y >> injection.fx >> injection.fy >> injection.rho) || step < 0)
+        {
+            error = "line " + std::to_string(line_nr) + ": expected \"step x y fx fy rho\"";
+            return false;
+        }
+        injection.step = step;
+        injections.push_back(injection);
+    }
+    return true;
+}
+
+//load: Read the injections in 'file' for an n x n grid, a recording or a text script
+bool InjectionReplay::load(const std::string& file, int n, std::string& error)
+{
+    FILE* input = fopen(file.c_str(), "rb");
+    if (!input)
+    {
+        error = file + ": " + strerror(errno);
+        return false;
+    }
+    char magic[sizeof(recording_magic)];
+    bool recording = fread(magic, sizeof(magic), 1, input) == 1 && memcmp(magic, recording_magic, sizeof(magic)) == 0;
+    std::vector<Injection> loaded;
+    bool ok = recording ? read_recording(input, n, loaded, error) : read_script(file, loaded, error);
+    fclose(input);
+    for (size_t i = 0; ok && i < loaded.size(); i++)
+    {
+        if (loaded[i].x < 0 || loaded[i].x >= n || loaded[i].y < 0 || loaded[i].y >= n)
+        {
+            error = "cell (" + std::to_string(loaded[i].x) + ", " + std::to_string(loaded[i].y) + ") is outside the " +
+                    std::to_string(n) + "x" + std::to_string(n) + " grid";
+            ok = false;
+        }
+    }
+    if (!ok)
+    {
+        error = file + ": " + error;
+        return false;
+    }
+    // Injections are applied in step order, keep the ones of the same step in file order
+    std::stable_sort(loaded.begin(), loaded.end(),
+                     [](const Injection& a, const Injection& b) { return a.step < b.step; });
+    injections.swap(loaded);
+    return true;
+}
+
+//apply: Inject everything scheduled for the model's current step
+void InjectionReplay::apply(Model& model) const
+{
+    Injection key;
+    key.step = model.step;
+    auto first = std::lower_bound(injections.begin(), injections.end(), key,
+                                  [](const Injection& a, const Injection& b) { return a.step < b.step; });
+    for (auto injection = first; injection != injections.end() && injection->step == model.step; ++injection)
+        model.inject(injection->x, injection->y, injection->fx, injection->fy, injection->rho);
+}
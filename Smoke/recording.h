@@ -0,0 +1,76 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+#include <rfftw.h>              //the numerical simulation FFTW library
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class Model;
+
+#define RECORDING_VERSION 1
+
+// Injection: A force (fx, fy) and density rho injected at grid cell (x, y) before simulation step 'step'
+typedef struct injection {
+    unsigned long step;
+    int x, y;
+    fftw_real fx, fy, rho;
+} Injection;
+
+// A recording file: the header, then one fixed-size record per injection in the order they were applied, until the
+// end of the file. There is no count, so a recording cut short by a crash still replays up to its last record.
+typedef struct recording_header {
+    char magic[8];              // "SMOKEREC"
+    uint32_t version;           // RECORDING_VERSION
+    uint32_t n;                 // grid size the injections were recorded on
+} RecordingHeader;
+
+typedef struct injection_record {
+    uint32_t step;
+    uint16_t x, y;
+    float fx, fy, rho;
+} InjectionRecord;
+
+// InjectionRecorder: Appends every injection the model applies to a recording, see Model::recorder
+class InjectionRecorder {
+public:
+    InjectionRecorder();
+    ~InjectionRecorder();
+    InjectionRecorder(const InjectionRecorder&) = delete;
+    InjectionRecorder& operator=(const InjectionRecorder&) = delete;
+
+    //open: Start a new recording in 'file' for an n x n grid. Returns false, with the reason in 'error', when the
+    //      file cannot be created.
+    bool open(const std::string& file, int n, std::string& error);
+
+    //close: Write the buffered records and close the file
+    void close();
+
+    //record: Append one injection
+    void record(const Injection& injection);
+
+    bool recording() const { return file != NULL; }
+    unsigned long count;        // injections recorded since open
+
+private:
+    FILE* file;
+};
+
+// InjectionReplay: Injections read from a recording or a script, applied to the model at the steps they were recorded at
+class InjectionReplay {
+public:
+    //load: Read the injections in 'file' for an n x n grid: a recording, or a text script with one injection per line,
+    //      "step x y fx fy rho" ('#' starts a comment). Returns false, with the reason in 'error', when the file cannot
+    //      be read or an injection lies outside the grid.
+    bool load(const std::string& file, int n, std::string& error);
+
+    //apply: Inject everything scheduled for the model's current step. Works from any step, e.g. after a checkpoint was loaded.
+    void apply(Model& model) const;
+
+    size_t size() const { return injections.size(); }
+    bool empty() const { return injections.empty(); }
+
+    std::vector<Injection> injections;  // sorted by step, injections of the same step in the order they were applied
+};
+
+#endif
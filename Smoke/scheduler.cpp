@@ -0,0 +1,80 @@
+#include "scheduler.h"
+#include <algorithm>
+
+StepScheduler::StepScheduler() : steps_per_second(0.0), max_substeps(8), max_skipped_frames(4), max_backlog(0.5)
+{
+    reset();
+}
+
+//set_rate: Target number of simulation steps per wall-clock second, 0 for one step per frame
+void StepScheduler::set_rate(double steps_per_second)
+{
+    this->steps_per_second = std::max(steps_per_second, 0.0);
+    reset();
+}
+
+//reset: Start counting from now, e.g. after the simulation was paused
+void StepScheduler::reset()
+{
+    epoch = last = clock::now();
+    backlog = 0.0;
+    skipped_in_row = 0;
+    steps = dropped_steps = skipped_frames = 0;
+}
+
+//steps_due: Number of steps to run now to keep up with the wall clock, at most max_substeps
+int StepScheduler::steps_due()
+{
+    if (steps_per_second <= 0.0)
+    {
+        steps++;
+        return 1;
+    }
+    clock::time_point now = clock::now();
+    backlog += std::chrono::duration<double>(now - last).count() * steps_per_second;
+    last = now;
+
+    // Catching up with a long stall would only make the next frames stall as well
+    double max_steps = std::max(max_backlog * steps_per_second, (double)max_substeps);
+    if (backlog > max_steps)
+    {
+        dropped_steps += (unsigned long)(backlog - max_steps);
+        backlog -= (unsigned long)(backlog - max_steps);
+    }
+
+    int due = std::min((int)backlog, max_substeps);
+    backlog -= due;
+    steps += due;
+    return due;
+}
+
+//skip_frame: Whether to skip drawing after the steps that were due, because the simulation is still behind
+bool StepScheduler::skip_frame()
+{
+    if (steps_per_second > 0.0 && backlog >= 1.0 && skipped_in_row < max_skipped_frames)
+    {
+        skipped_in_row++;
+        skipped_frames++;
+        return true;
+    }
+    skipped_in_row = 0;
+    return false;
+}
+
+//time_to_next_step: Seconds until the next step is due, 0 if one is due already
+double StepScheduler::time_to_next_step()
+{
+    if (steps_per_second <= 0.0)
+        return 0.0;
+    double pending = backlog + std::chrono::duration<double>(clock::now() - last).count() * steps_per_second;
+    return pending >= 1.0 ? 0.0 : (1.0 - pending) / steps_per_second;
+}
+
+//lag: How far the simulated time is behind the wall-clock time since the last reset, in seconds
+double StepScheduler::lag()
+{
+    if (steps_per_second <= 0.0)
+        return 0.0;
+    double wall = std::chrono::duration<double>(clock::now() - epoch).count();
+    return std::max(wall - steps / steps_per_second, 0.0);
+}
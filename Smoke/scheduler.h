@@ -0,0 +1,48 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+#include <chrono>
+
+// StepScheduler: Keeps the simulation at a fixed number of steps per wall-clock second, independent of the frame rate.
+//                Every frame asks how many steps are due. When the simulation falls behind it runs several substeps
+//                per frame and skips drawing frames, and a backlog that cannot be caught up with is dropped.
+//                A rate of 0 runs one step per frame, as fast as the frames come.
+class StepScheduler {
+public:
+    StepScheduler();
+
+    //set_rate: Target number of simulation steps per wall-clock second, 0 for one step per frame
+    void set_rate(double steps_per_second);
+
+    //reset: Start counting from now, e.g. after the simulation was paused
+    void reset();
+
+    //steps_due: Number of steps to run now to keep up with the wall clock, at most max_substeps
+    int steps_due();
+
+    //skip_frame: Whether to skip drawing after the steps that were due, because the simulation is still behind.
+    //            At most max_skipped_frames frames in a row are skipped.
+    bool skip_frame();
+
+    //time_to_next_step: Seconds until the next step is due, 0 if one is due already
+    double time_to_next_step();
+
+    //lag: How far the simulated time is behind the wall-clock time since the last reset, in seconds.
+    //     Includes the dropped steps.
+    double lag();
+
+    double steps_per_second;
+    int max_substeps;               //steps per frame at most
+    int max_skipped_frames;         //frames in a row that may be skipped to catch up
+    double max_backlog;             //seconds of simulation that are caught up with at most, older steps are dropped
+    unsigned long steps;            //steps scheduled since the last reset
+    unsigned long dropped_steps;    //steps given up on since the last reset
+    unsigned long skipped_frames;   //frames skipped since the last reset
+
+private:
+    typedef std::chrono::steady_clock clock;
+    clock::time_point epoch, last;
+    double backlog;                 //steps due that did not run yet
+    int skipped_in_row;
+};
+
+#endif
@@ -0,0 +1,548 @@
+#include "simd.h"
+#include "solver.h"             //for the periodic sampling, shared with the advection
+#include <math.h>               //for various math functions
+#include <string>
+#include <algorithm>
+
+// The kernels need single precision fields and GCC/Clang's per-function target attributes
+#if defined(FFTW_ENABLE_FLOAT) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD_KERNELS
+#include <immintrin.h>
+#endif
+
+// sample_point: Scalar sampling of point p, see SampleKernel
+static inline void sample_point(int n, SAMPLE_BOUNDARY boundary, int num_fields, const fftw_real* const* src,
+                                fftw_real x, fftw_real y, fftw_real* const* dst, size_t p)
+{
+    if (boundary == SAMPLE_PERIODIC)
+    {
+        sample_periodic(Grid<0>(n), num_fields, src, x, y, dst, p);
+        return;
+    }
+    if (boundary == SAMPLE_ZERO && !(x >= 0 && x <= n-1 && y >= 0 && y <= n-1))
+    {
+        for (int k = 0; k < num_fields; k++)
+            dst[k][p] = 0;
+        return;
+    }
+    x = x < 0 ? 0 : (x > n-1 ? n-1 : x);
+    y = y < 0 ? 0 : (y > n-1 ? n-1 : y);
+    int i0 = (int)floor(x); fftw_real s = x-i0;
+    int j0 = (int)floor(y); fftw_real t = y-j0;
+    int i1 = i0+1 < n ? i0+1 : n-1;
+    int j1 = j0+1 < n ? j0+1 : n-1;
+    for (int k = 0; k < num_fields; k++)
+    {
+        const fftw_real* f0 = src[k];
+        dst[k][p] = (1-s)*((1-t)*f0[i0+n*j0]+t*f0[i0+n*j1])+s*((1-t)*f0[i1+n*j0]+t*f0[i1+n*j1]);
+    }
+}
+
+static void sample_scalar(int n, SAMPLE_BOUNDARY boundary, int num_fields, const fftw_real* const* src,
+                          const fftw_real* x, const fftw_real* y, size_t count, fftw_real* const* dst)
+{
+    for (size_t p = 0; p < count; p++)
+        sample_point(n, boundary, num_fields, src, x[p], y[p], dst, p);
+}
+
+#ifdef HAVE_SIMD_KERNELS
+
+// advect_cell: Scalar advection of cell (i, j), used for the columns that do not fill a whole vector
+static inline void advect_cell(int n, const float* centers, const float* u, const float* v, float dt,
+                               int num_fields, const float* const* src, float* const* dst, int i, int j)
+{
+    float x0 = n*(centers[i]-dt*u[i+n*j])-0.5f;
+    float y0 = n*(centers[j]-dt*v[i+n*j])-0.5f;
+    int i0 = (int)floorf(x0); float s = x0-i0;
+    i0 = (n+(i0%n))%n;
+    int i1 = (i0+1)%n;
+    int j0 = (int)floorf(y0); float t = y0-j0;
+    j0 = (n+(j0%n))%n;
+    int j1 = (j0+1)%n;
+    for (int k = 0; k < num_fields; k++)
+    {
+        const float* f0 = src[k];
+        dst[k][i+n*j] = (1-s)*((1-t)*f0[i0+n*j0]+t*f0[i0+n*j1])+s*((1-t)*f0[i1+n*j0]+t*f0[i1+n*j1]);
+    }
+}
+
+// The periodic wrap of a backtraced (integer valued) coordinate c is c - n*floor(c/n). The division is done as a
+// multiplication, which can be one off for multiples of n, so the result is corrected into [0, n) with two masks.
+// That only holds while c is exact in single precision: vectors with a coordinate that is NaN, infinite or beyond
+// WRAP_LIMIT are done by the scalar code instead, so the gathers never read outside the fields.
+static const float WRAP_LIMIT = (float)(1 << 22);
+
+__attribute__((target("avx2")))
+static void advect_rows_avx2(int n, const float* centers, const float* u, const float* v, float dt,
+                             int num_fields, const float* const* src, float* const* dst, int j_begin, int j_end)
+{
+    const __m256 vn = _mm256_set1_ps((float)n);
+    const __m256 inv_n = _mm256_set1_ps(1.0f / n);
+    const __m256 vdt = _mm256_set1_ps(dt);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 limit = _mm256_set1_ps(WRAP_LIMIT);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256i ni = _mm256_set1_epi32(n);
+    const __m256i onei = _mm256_set1_epi32(1);
+
+    for (int j = j_begin; j < j_end; j++)
+    {
+        const __m256 y = _mm256_set1_ps(centers[j]);
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 x = _mm256_loadu_ps(centers + i);
+            __m256 x0 = _mm256_sub_ps(_mm256_mul_ps(vn, _mm256_sub_ps(x, _mm256_mul_ps(vdt, _mm256_loadu_ps(u + i + n*j)))), half);
+            __m256 y0 = _mm256_sub_ps(_mm256_mul_ps(vn, _mm256_sub_ps(y, _mm256_mul_ps(vdt, _mm256_loadu_ps(v + i + n*j)))), half);
+            __m256 in_range = _mm256_and_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, x0), limit, _CMP_LT_OQ),
+                                            _mm256_cmp_ps(_mm256_andnot_ps(sign, y0), limit, _CMP_LT_OQ));
+            if (_mm256_movemask_ps(in_range) != 0xff)
+            {
+                for (int c = i; c < i + 8; c++)
+                    advect_cell(n, centers, u, v, dt, num_fields, src, dst, c, j);
+                continue;
+            }
+            __m256 fx = _mm256_floor_ps(x0);
+            __m256 fy = _mm256_floor_ps(y0);
+            __m256 s = _mm256_sub_ps(x0, fx);
+            __m256 t = _mm256_sub_ps(y0, fy);
+
+            fx = _mm256_sub_ps(fx, _mm256_mul_ps(vn, _mm256_floor_ps(_mm256_mul_ps(fx, inv_n))));
+            fx = _mm256_add_ps(fx, _mm256_and_ps(_mm256_cmp_ps(fx, zero, _CMP_LT_OQ), vn));
+            fx = _mm256_sub_ps(fx, _mm256_and_ps(_mm256_cmp_ps(fx, vn, _CMP_GE_OQ), vn));
+            fy = _mm256_sub_ps(fy, _mm256_mul_ps(vn, _mm256_floor_ps(_mm256_mul_ps(fy, inv_n))));
+            fy = _mm256_add_ps(fy, _mm256_and_ps(_mm256_cmp_ps(fy, zero, _CMP_LT_OQ), vn));
+            fy = _mm256_sub_ps(fy, _mm256_and_ps(_mm256_cmp_ps(fy, vn, _CMP_GE_OQ), vn));
+
+            __m256i i0 = _mm256_cvttps_epi32(fx);
+            __m256i j0 = _mm256_cvttps_epi32(fy);
+            __m256i i1 = _mm256_add_epi32(i0, onei);
+            __m256i j1 = _mm256_add_epi32(j0, onei);
+            i1 = _mm256_andnot_si256(_mm256_cmpeq_epi32(i1, ni), i1);
+            j1 = _mm256_andnot_si256(_mm256_cmpeq_epi32(j1, ni), j1);
+            j0 = _mm256_mullo_epi32(j0, ni);
+            j1 = _mm256_mullo_epi32(j1, ni);
+            __m256i idx00 = _mm256_add_epi32(i0, j0);
+            __m256i idx01 = _mm256_add_epi32(i0, j1);
+            __m256i idx10 = _mm256_add_epi32(i1, j0);
+            __m256i idx11 = _mm256_add_epi32(i1, j1);
+
+            __m256 anti_s = _mm256_sub_ps(one, s);
+            __m256 anti_t = _mm256_sub_ps(one, t);
+            for (int k = 0; k < num_fields; k++)
+            {
+                const float* f0 = src[k];
+                __m256 left = _mm256_add_ps(_mm256_mul_ps(anti_t, _mm256_i32gather_ps(f0, idx00, 4)),
+                                            _mm256_mul_ps(t, _mm256_i32gather_ps(f0, idx01, 4)));
+                __m256 right = _mm256_add_ps(_mm256_mul_ps(anti_t, _mm256_i32gather_ps(f0, idx10, 4)),
+                                             _mm256_mul_ps(t, _mm256_i32gather_ps(f0, idx11, 4)));
+                _mm256_storeu_ps(dst[k] + i + n*j, _mm256_add_ps(_mm256_mul_ps(anti_s, left), _mm256_mul_ps(s, right)));
+            }
+        }
+        for (; i < n; i++)
+            advect_cell(n, centers, u, v, dt, num_fields, src, dst, i, j);
+    }
+}
+
+// GCC's AVX-512 intrinsics start from deliberately undefined registers, which -Wmaybe-uninitialized reports
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+static void advect_rows_avx512(int n, const float* centers, const float* u, const float* v, float dt,
+                               int num_fields, const float* const* src, float* const* dst, int j_begin, int j_end)
+{
+    const int floor_mode = _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC;
+    const __m512 vn = _mm512_set1_ps((float)n);
+    const __m512 inv_n = _mm512_set1_ps(1.0f / n);
+    const __m512 vdt = _mm512_set1_ps(dt);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512i ni = _mm512_set1_epi32(n);
+    const __m512i onei = _mm512_set1_epi32(1);
+    const __m512i zeroi = _mm512_setzero_si512();
+    const __m512 limit = _mm512_set1_ps(WRAP_LIMIT);
+
+    for (int j = j_begin; j < j_end; j++)
+    {
+        const __m512 y = _mm512_set1_ps(centers[j]);
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512 x = _mm512_loadu_ps(centers + i);
+            __m512 x0 = _mm512_sub_ps(_mm512_mul_ps(vn, _mm512_sub_ps(x, _mm512_mul_ps(vdt, _mm512_loadu_ps(u + i + n*j)))), half);
+            __m512 y0 = _mm512_sub_ps(_mm512_mul_ps(vn, _mm512_sub_ps(y, _mm512_mul_ps(vdt, _mm512_loadu_ps(v + i + n*j)))), half);
+            __mmask16 in_range = _mm512_cmp_ps_mask(_mm512_abs_ps(x0), limit, _CMP_LT_OQ)
+                               & _mm512_cmp_ps_mask(_mm512_abs_ps(y0), limit, _CMP_LT_OQ);
+            if (in_range != 0xffff)
+            {
+                for (int c = i; c < i + 16; c++)
+                    advect_cell(n, centers, u, v, dt, num_fields, src, dst, c, j);
+                continue;
+            }
+            __m512 fx = _mm512_roundscale_ps(x0, floor_mode);
+            __m512 fy = _mm512_roundscale_ps(y0, floor_mode);
+            __m512 s = _mm512_sub_ps(x0, fx);
+            __m512 t = _mm512_sub_ps(y0, fy);
+
+            fx = _mm512_sub_ps(fx, _mm512_mul_ps(vn, _mm512_roundscale_ps(_mm512_mul_ps(fx, inv_n), floor_mode)));
+            fx = _mm512_mask_add_ps(fx, _mm512_cmp_ps_mask(fx, zero, _CMP_LT_OQ), fx, vn);
+            fx = _mm512_mask_sub_ps(fx, _mm512_cmp_ps_mask(fx, vn, _CMP_GE_OQ), fx, vn);
+            fy = _mm512_sub_ps(fy, _mm512_mul_ps(vn, _mm512_roundscale_ps(_mm512_mul_ps(fy, inv_n), floor_mode)));
+            fy = _mm512_mask_add_ps(fy, _mm512_cmp_ps_mask(fy, zero, _CMP_LT_OQ), fy, vn);
+            fy = _mm512_mask_sub_ps(fy, _mm512_cmp_ps_mask(fy, vn, _CMP_GE_OQ), fy, vn);
+
+            __m512i i0 = _mm512_cvttps_epi32(fx);
+            __m512i j0 = _mm512_cvttps_epi32(fy);
+            __m512i i1 = _mm512_add_epi32(i0, onei);
+            __m512i j1 = _mm512_add_epi32(j0, onei);
+            i1 = _mm512_mask_mov_epi32(i1, _mm512_cmpeq_epi32_mask(i1, ni), zeroi);
+            j1 = _mm512_mask_mov_epi32(j1, _mm512_cmpeq_epi32_mask(j1, ni), zeroi);
+            j0 = _mm512_mullo_epi32(j0, ni);
+            j1 = _mm512_mullo_epi32(j1, ni);
+            __m512i idx00 = _mm512_add_epi32(i0, j0);
+            __m512i idx01 = _mm512_add_epi32(i0, j1);
+            __m512i idx10 = _mm512_add_epi32(i1, j0);
+            __m512i idx11 = _mm512_add_epi32(i1, j1);
+
+            __m512 anti_s = _mm512_sub_ps(one, s);
+            __m512 anti_t = _mm512_sub_ps(one, t);
+            for (int k = 0; k < num_fields; k++)
+            {
+                const float* f0 = src[k];
+                __m512 left = _mm512_add_ps(_mm512_mul_ps(anti_t, _mm512_i32gather_ps(idx00, f0, 4)),
+                                            _mm512_mul_ps(t, _mm512_i32gather_ps(idx01, f0, 4)));
+                __m512 right = _mm512_add_ps(_mm512_mul_ps(anti_t, _mm512_i32gather_ps(idx10, f0, 4)),
+                                             _mm512_mul_ps(t, _mm512_i32gather_ps(idx11, f0, 4)));
+                _mm512_storeu_ps(dst[k] + i + n*j, _mm512_add_ps(_mm512_mul_ps(anti_s, left), _mm512_mul_ps(s, right)));
+            }
+        }
+        for (; i < n; i++)
+            advect_cell(n, centers, u, v, dt, num_fields, src, dst, i, j);
+    }
+}
+
+#pragma GCC diagnostic pop
+
+// Every AVX2 CPU also has F16C, so the conversions are selected with the AVX2 level
+
+__attribute__((target("avx2,f16c")))
+static void fields_to_half_f16c(const float* src, uint16_t* dst, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    for (; i < count; i++)
+        dst[i] = half_from_float(src[i]);
+}
+
+__attribute__((target("avx2,f16c")))
+static void fields_from_half_f16c(const uint16_t* src, float* dst, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+    for (; i < count; i++)
+        dst[i] = half_to_float(src[i]);
+}
+
+// The codes are scaled with a multiplication and an addition, not a fused multiply-add, so the result is the same
+// as decoding a single cell with HistoryField
+
+__attribute__((target("avx2")))
+static void dequantize8_avx2(const uint8_t* src, float min, float scale, float* dst, size_t count)
+{
+    const __m256 vmin = _mm256_set1_ps(min);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 code = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i))));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(vmin, _mm256_mul_ps(vscale, code)));
+    }
+    for (; i < count; i++)
+        dst[i] = min + scale * src[i];
+}
+
+__attribute__((target("avx2")))
+static void dequantize16_avx2(const uint16_t* src, float min, float scale, float* dst, size_t count)
+{
+    const __m256 vmin = _mm256_set1_ps(min);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 code = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + i))));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(vmin, _mm256_mul_ps(vscale, code)));
+    }
+    for (; i < count; i++)
+        dst[i] = min + scale * src[i];
+}
+
+// Eight 12 bit codes are twelve bytes. A byte shuffle puts the two bytes that hold every code into a 16 bit lane,
+// even codes are then in the low 12 bits of their lane and odd codes in the high 12 bits.
+
+__attribute__((target("avx2")))
+static void dequantize12_avx2(const uint8_t* src, float min, float scale, float* dst, size_t count)
+{
+    const __m256 vmin = _mm256_set1_ps(min);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m128i pairs = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    const __m256i shifts = _mm256_setr_epi32(0, 4, 0, 4, 0, 4, 0, 4);
+    const __m256i mask = _mm256_set1_epi32(0x0fff);
+    const size_t bytes = 3 * ((count + 1) / 2);
+    size_t i = 0;
+    for (; 3 * (i / 2) + 16 <= bytes; i += 8)       // the load reads four bytes past the eight codes
+    {
+        __m128i lanes = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 3 * (i / 2))), pairs);
+        __m256i codes = _mm256_and_si256(_mm256_srlv_epi32(_mm256_cvtepu16_epi32(lanes), shifts), mask);
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(vmin, _mm256_mul_ps(vscale, _mm256_cvtepi32_ps(codes))));
+    }
+    for (; i < count; i++)
+        dst[i] = min + scale * code12(src, i);
+}
+
+// Sampling uses the same periodic wrap as the advection. Points outside the grid are clamped onto it first for the
+// other boundaries, so every gather stays inside the fields; SAMPLE_ZERO then masks their values out.
+__attribute__((target("avx2")))
+static void sample_avx2(int n, SAMPLE_BOUNDARY boundary, int num_fields, const float* const* src,
+                        const float* x, const float* y, size_t count, float* const* dst)
+{
+    const __m256 vn = _mm256_set1_ps((float)n);
+    const __m256 last = _mm256_set1_ps((float)(n - 1));
+    const __m256 inv_n = _mm256_set1_ps(1.0f / n);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256i ni = _mm256_set1_epi32(n);
+    const __m256i lasti = _mm256_set1_epi32(n - 1);
+    const __m256i onei = _mm256_set1_epi32(1);
+    const __m256 limit = _mm256_set1_ps(WRAP_LIMIT);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+
+    size_t p = 0;
+    for (; p + 8 <= count; p += 8)
+    {
+        __m256 px = _mm256_loadu_ps(x + p);
+        __m256 py = _mm256_loadu_ps(y + p);
+        if (boundary == SAMPLE_PERIODIC
+            && _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, px), limit, _CMP_LT_OQ),
+                                                _mm256_cmp_ps(_mm256_andnot_ps(sign, py), limit, _CMP_LT_OQ))) != 0xff)
+        {
+            for (size_t q = p; q < p + 8; q++)
+                sample_point(n, boundary, num_fields, src, x[q], y[q], dst, q);
+            continue;
+        }
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        if (boundary == SAMPLE_ZERO)
+            inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(px, zero, _CMP_GE_OQ), _mm256_cmp_ps(px, last, _CMP_LE_OQ)),
+                                   _mm256_and_ps(_mm256_cmp_ps(py, zero, _CMP_GE_OQ), _mm256_cmp_ps(py, last, _CMP_LE_OQ)));
+        if (boundary != SAMPLE_PERIODIC)
+        {
+            px = _mm256_min_ps(_mm256_max_ps(px, zero), last);
+            py = _mm256_min_ps(_mm256_max_ps(py, zero), last);
+        }
+        __m256 fx = _mm256_floor_ps(px);
+        __m256 fy = _mm256_floor_ps(py);
+        __m256 s = _mm256_sub_ps(px, fx);
+        __m256 t = _mm256_sub_ps(py, fy);
+
+        __m256i i0, j0, i1, j1;
+        if (boundary == SAMPLE_PERIODIC)
+        {
+            fx = _mm256_sub_ps(fx, _mm256_mul_ps(vn, _mm256_floor_ps(_mm256_mul_ps(fx, inv_n))));
+            fx = _mm256_add_ps(fx, _mm256_and_ps(_mm256_cmp_ps(fx, zero, _CMP_LT_OQ), vn));
+            fx = _mm256_sub_ps(fx, _mm256_and_ps(_mm256_cmp_ps(fx, vn, _CMP_GE_OQ), vn));
+            fy = _mm256_sub_ps(fy, _mm256_mul_ps(vn, _mm256_floor_ps(_mm256_mul_ps(fy, inv_n))));
+            fy = _mm256_add_ps(fy, _mm256_and_ps(_mm256_cmp_ps(fy, zero, _CMP_LT_OQ), vn));
+            fy = _mm256_sub_ps(fy, _mm256_and_ps(_mm256_cmp_ps(fy, vn, _CMP_GE_OQ), vn));
+            i0 = _mm256_cvttps_epi32(fx);
+            j0 = _mm256_cvttps_epi32(fy);
+            i1 = _mm256_add_epi32(i0, onei);
+            j1 = _mm256_add_epi32(j0, onei);
+            i1 = _mm256_andnot_si256(_mm256_cmpeq_epi32(i1, ni), i1);
+            j1 = _mm256_andnot_si256(_mm256_cmpeq_epi32(j1, ni), j1);
+        }
+        else
+        {
+            i0 = _mm256_cvttps_epi32(fx);
+            j0 = _mm256_cvttps_epi32(fy);
+            i1 = _mm256_min_epi32(_mm256_add_epi32(i0, onei), lasti);
+            j1 = _mm256_min_epi32(_mm256_add_epi32(j0, onei), lasti);
+        }
+        j0 = _mm256_mullo_epi32(j0, ni);
+        j1 = _mm256_mullo_epi32(j1, ni);
+        __m256i idx00 = _mm256_add_epi32(i0, j0);
+        __m256i idx01 = _mm256_add_epi32(i0, j1);
+        __m256i idx10 = _mm256_add_epi32(i1, j0);
+        __m256i idx11 = _mm256_add_epi32(i1, j1);
+
+        __m256 anti_s = _mm256_sub_ps(one, s);
+        __m256 anti_t = _mm256_sub_ps(one, t);
+        for (int k = 0; k < num_fields; k++)
+        {
+            const float* f0 = src[k];
+            __m256 left = _mm256_add_ps(_mm256_mul_ps(anti_t, _mm256_i32gather_ps(f0, idx00, 4)),
+                                        _mm256_mul_ps(t, _mm256_i32gather_ps(f0, idx01, 4)));
+            __m256 right = _mm256_add_ps(_mm256_mul_ps(anti_t, _mm256_i32gather_ps(f0, idx10, 4)),
+                                         _mm256_mul_ps(t, _mm256_i32gather_ps(f0, idx11, 4)));
+            __m256 value = _mm256_add_ps(_mm256_mul_ps(anti_s, left), _mm256_mul_ps(s, right));
+            _mm256_storeu_ps(dst[k] + p, _mm256_and_ps(value, inside));
+        }
+    }
+    for (; p < count; p++)
+        sample_point(n, boundary, num_fields, src, x[p], y[p], dst, p);
+}
+
+#endif
+
+//simd_supported: The best SIMD level this CPU (and build) supports
+SIMD_LEVEL simd_supported()
+{
+#ifdef HAVE_SIMD_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+//simd_name: Human-readable name of a SIMD level
+const char* simd_name(SIMD_LEVEL level)
+{
+    switch (level)
+    {
+        case SIMD_AVX2:   return "AVX2";
+        case SIMD_AVX512: return "AVX-512";
+        case SIMD_SCALAR:
+        default:          return "scalar";
+    }
+}
+
+//parse_simd_level: Convert the name of a SIMD level to the level. Returns false for unknown names.
+bool parse_simd_level(const char* name, SIMD_LEVEL& level)
+{
+    for (int i = SIMD_SCALAR; i <= SIMD_AVX512; i++)
+    {
+        std::string lower = simd_name((SIMD_LEVEL)i);
+        lower.erase(std::remove(lower.begin(), lower.end(), '-'), lower.end());
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        if (lower == name)
+        {
+            level = (SIMD_LEVEL)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+//advect_kernel: The vectorized advection kernel for 'level', or NULL for SIMD_SCALAR or unsupported levels
+AdvectKernel advect_kernel(SIMD_LEVEL level)
+{
+    if (level > simd_supported())
+        return NULL;
+#ifdef HAVE_SIMD_KERNELS
+    switch (level)
+    {
+        case SIMD_AVX2:   return advect_rows_avx2;
+        case SIMD_AVX512: return advect_rows_avx512;
+        default:          break;
+    }
+#endif
+    return NULL;
+}
+
+//sample_kernel: The sampling kernel for 'level'. AVX-512 uses the AVX2 kernel: the gathers, not the vector width,
+//               limit the sampling.
+SampleKernel sample_kernel(SIMD_LEVEL level)
+{
+#ifdef HAVE_SIMD_KERNELS
+    if (level >= SIMD_AVX2 && simd_supported() >= SIMD_AVX2)
+        return sample_avx2;
+#endif
+    return sample_scalar;
+}
+
+//sample_fields: Sample fields like a SampleKernel, with the best kernel the CPU supports
+void sample_fields(int n, SAMPLE_BOUNDARY boundary, int num_fields, const fftw_real* const* src,
+                   const fftw_real* x, const fftw_real* y, size_t count, fftw_real* const* dst)
+{
+    static const SampleKernel kernel = sample_kernel(simd_supported());
+    kernel(n, boundary, num_fields, src, x, y, count, dst);
+}
+
+//fields_to_half, fields_from_half: Convert 'count' values to and from half precision
+void fields_to_half(const fftw_real* src, uint16_t* dst, size_t count)
+{
+#ifdef HAVE_SIMD_KERNELS
+    static const bool f16c = simd_supported() >= SIMD_AVX2;
+    if (f16c)
+    {
+        fields_to_half_f16c(src, dst, count);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++)
+        dst[i] = half_from_float((float)src[i]);
+}
+
+void fields_from_half(const uint16_t* src, fftw_real* dst, size_t count)
+{
+#ifdef HAVE_SIMD_KERNELS
+    static const bool f16c = simd_supported() >= SIMD_AVX2;
+    if (f16c)
+    {
+        fields_from_half_f16c(src, dst, count);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++)
+        dst[i] = half_to_float(src[i]);
+}
+
+//dequantize8, dequantize16: dst[i] = min + scale * src[i], for 8 and 16 bit codes
+void dequantize8(const uint8_t* src, float min, float scale, fftw_real* dst, size_t count)
+{
+#ifdef HAVE_SIMD_KERNELS
+    static const bool avx2 = simd_supported() >= SIMD_AVX2;
+    if (avx2)
+    {
+        dequantize8_avx2(src, min, scale, dst, count);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++)
+        dst[i] = min + scale * src[i];
+}
+
+void dequantize16(const uint16_t* src, float min, float scale, fftw_real* dst, size_t count)
+{
+#ifdef HAVE_SIMD_KERNELS
+    static const bool avx2 = simd_supported() >= SIMD_AVX2;
+    if (avx2)
+    {
+        dequantize16_avx2(src, min, scale, dst, count);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++)
+        dst[i] = min + scale * src[i];
+}
+
+//dequantize12: dst[i] = min + scale * code12(src, i), for 12 bit codes packed in pairs
+void dequantize12(const uint8_t* src, float min, float scale, fftw_real* dst, size_t count)
+{
+#ifdef HAVE_SIMD_KERNELS
+    static const bool avx2 = simd_supported() >= SIMD_AVX2;
+    if (avx2)
+    {
+        dequantize12_avx2(src, min, scale, dst, count);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++)
+        dst[i] = min + scale * code12(src, i);
+}
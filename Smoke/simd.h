@@ -0,0 +1,113 @@
+#ifndef SIMD_H
+#define SIMD_H
+#include <rfftw.h>              //the numerical simulation FFTW library
+#include <stdint.h>
+#include <string.h>
+#include <cstddef>
+
+// Vectorized kernels, selected at runtime for the instruction sets the CPU supports.
+// The kernels only exist for single precision (srfftw) builds on x86; otherwise the scalar code is always used.
+enum SIMD_LEVEL {SIMD_SCALAR = 0, SIMD_AVX2, SIMD_AVX512};
+
+// AdvectKernel: advects rows [j_begin, j_end) of the fields, see Model::advect. 'centers' holds the cell-center coordinates.
+typedef void (*AdvectKernel)(int n, const fftw_real* centers, const fftw_real* u, const fftw_real* v, fftw_real dt,
+                             int num_fields, const fftw_real* const* src, fftw_real* const* dst, int j_begin, int j_end);
+
+// What sampling returns for points outside the grid: the value of the periodic continuation of the fields, the value
+// at the nearest point on the edge, or zero for points outside [0, n-1] x [0, n-1].
+enum SAMPLE_BOUNDARY {SAMPLE_PERIODIC = 0, SAMPLE_CLAMP, SAMPLE_ZERO};
+
+// SampleKernel: bilinearly samples 'num_fields' n x n fields at the 'count' index coordinates (x[i], y[i]), and
+//               stores field k at point i in dst[k][i]. Cell (i, j) of a field lies at index coordinates (i, j).
+typedef void (*SampleKernel)(int n, SAMPLE_BOUNDARY boundary, int num_fields, const fftw_real* const* src,
+                             const fftw_real* x, const fftw_real* y, size_t count, fftw_real* const* dst);
+
+//simd_supported: The best SIMD level this CPU (and build) supports
+SIMD_LEVEL simd_supported();
+
+//simd_name: Human-readable name of a SIMD level
+const char* simd_name(SIMD_LEVEL level);
+
+//parse_simd_level: Convert the name of a SIMD level, lower case without dashes, to the level. Returns false for unknown names.
+bool parse_simd_level(const char* name, SIMD_LEVEL& level);
+
+//advect_kernel: The vectorized advection kernel for 'level', or NULL for SIMD_SCALAR or unsupported levels
+AdvectKernel advect_kernel(SIMD_LEVEL level);
+
+//sample_kernel: The sampling kernel for 'level'. SIMD_SCALAR and unsupported levels get the scalar kernel.
+SampleKernel sample_kernel(SIMD_LEVEL level);
+
+//sample_fields: Sample fields like a SampleKernel, with the best kernel the CPU supports
+void sample_fields(int n, SAMPLE_BOUNDARY boundary, int num_fields, const fftw_real* const* src,
+                   const fftw_real* x, const fftw_real* y, size_t count, fftw_real* const* dst);
+
+//half_from_float, half_to_float: Convert one value to and from IEEE half precision, rounding to the nearest even
+inline uint16_t half_from_float(float value)
+{
+    uint32_t x, sign;
+    memcpy(&x, &value, 4);
+    sign = x & 0x80000000u;
+    x ^= sign;
+    uint16_t half;
+    if (x >= (127u + 16) << 23)                     // too large, infinity or NaN
+        half = x > 255u << 23 ? 0x7e00 : 0x7c00;
+    else if (x < 113u << 23)                        // subnormal half: let the float adder round the mantissa
+    {
+        float f, magic = 0.5f;
+        memcpy(&f, &x, 4);
+        f += magic;
+        memcpy(&x, &f, 4);
+        half = (uint16_t)(x - 0x3f000000u);
+    }
+    else
+    {
+        uint32_t mantissa_odd = (x >> 13) & 1;
+        x += ((uint32_t)(15 - 127) << 23) + 0xfff + mantissa_odd;
+        half = (uint16_t)(x >> 13);
+    }
+    return half | (uint16_t)(sign >> 16);
+}
+
+inline float half_to_float(uint16_t half)
+{
+    const uint32_t shifted_exponent = 0x7c00u << 13;
+    uint32_t x = (half & 0x7fffu) << 13;
+    uint32_t exponent = x & shifted_exponent;
+    x += (uint32_t)(127 - 15) << 23;
+    if (exponent == shifted_exponent)               // infinity or NaN
+        x += (uint32_t)(128 - 16) << 23;
+    else if (exponent == 0)                         // zero or subnormal
+    {
+        float f, magic;
+        uint32_t magic_bits = 113u << 23;
+        x += 1u << 23;
+        memcpy(&f, &x, 4);
+        memcpy(&magic, &magic_bits, 4);
+        f -= magic;
+        memcpy(&x, &f, 4);
+    }
+    x |= (uint32_t)(half & 0x8000u) << 16;
+    float value;
+    memcpy(&value, &x, 4);
+    return value;
+}
+
+//fields_to_half, fields_from_half: Convert 'count' values to and from half precision. Uses F16C on AVX2 CPUs.
+void fields_to_half(const fftw_real* src, uint16_t* dst, size_t count);
+void fields_from_half(const uint16_t* src, fftw_real* dst, size_t count);
+
+//code12: Code i of 12 bit codes packed in pairs, two codes in three bytes
+inline unsigned int code12(const uint8_t* codes, size_t i)
+{
+    const uint8_t* pair = codes + 3 * (i / 2);
+    return i % 2 == 0 ? pair[0] | (pair[1] & 0x0f) << 8 : pair[1] >> 4 | pair[2] << 4;
+}
+
+//dequantize8, dequantize16: dst[i] = min + scale * src[i], for 8 and 16 bit codes. Uses AVX2 when the CPU has it.
+void dequantize8(const uint8_t* src, float min, float scale, fftw_real* dst, size_t count);
+void dequantize16(const uint16_t* src, float min, float scale, fftw_real* dst, size_t count);
+
+//dequantize12: dst[i] = min + scale * code12(src, i). Uses AVX2 when the CPU has it.
+void dequantize12(const uint8_t* src, float min, float scale, fftw_real* dst, size_t count);
+
+#endif
@@ -0,0 +1,142 @@
+#include "simulation.h"
+#include <chrono>
+#include <algorithm>
+
+SnapshotBuffer::SnapshotBuffer() : back_index(0), middle_index(1), front_index(2), has_new(false), has_front(false)
+{
+}
+
+//publish: Make the back buffer the latest complete snapshot
+void SnapshotBuffer::publish()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::swap(back_index, middle_index);
+    has_new = true;
+}
+
+//fresh: Whether a snapshot was published that the renderer has not taken yet
+bool SnapshotBuffer::fresh()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return has_new;
+}
+
+//front: Take the latest published snapshot, if there is a new one, and return it. NULL until the first publish.
+const FieldSnapshot* SnapshotBuffer::front()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (has_new)
+    {
+        std::swap(front_index, middle_index);
+        has_new = false;
+        has_front = true;
+    }
+    return has_front ? &buffers[front_index] : NULL;
+}
+
+SimulationThread::SimulationThread(Model* model) : lag(0.0), dropped_steps(0), model(model), quit(false), paused(false)
+{
+}
+
+SimulationThread::~SimulationThread()
+{
+    stop();
+}
+
+//start: Publish the current state of the model and start stepping
+void SimulationThread::start()
+{
+    if (running())
+        return;
+    model->capture(snapshots.back());
+    snapshots.publish();
+    quit = false;
+    thread = std::thread(&SimulationThread::loop, this);
+}
+
+void SimulationThread::stop()
+{
+    if (!running())
+        return;
+    quit = true;
+    thread.join();
+}
+
+//inject: Queue Model::inject(X, Y, fx, fy, density) for the next step
+void SimulationThread::inject(int X, int Y, fftw_real fx, fftw_real fy, fftw_real density)
+{
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    injections.push_back({X, Y, fx, fy, density});
+}
+
+//post: Queue 'edit' to run on the simulation thread, holding 'mutex', before the next step
+void SimulationThread::post(std::function<void()> edit)
+{
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    edits.push_back(edit);
+}
+
+void SimulationThread::loop()
+{
+    std::vector<PendingInjection> pending;
+    std::vector<std::function<void()>> pending_edits;
+    trace_thread_name("simulation");
+    while (!quit)
+    {
+        int due;
+        double wait = 0.001;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            pending_edits.swap(edits);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto edit = pending_edits.begin(); edit != pending_edits.end(); ++edit)
+                (*edit)();
+            if (paused)
+            {
+                scheduler.reset();
+                due = 0;
+            }
+            else if (scheduler.steps_per_second <= 0.0 && snapshots.fresh())
+                due = 0;                //one step per frame: the renderer did not take the last step yet
+            else
+            {
+                due = scheduler.steps_due();
+                if (due == 0)
+                    wait = std::min(scheduler.time_to_next_step(), 0.01);
+            }
+            lag = scheduler.lag();
+            dropped_steps = scheduler.dropped_steps;
+            if (due == 0 && !pending_edits.empty())
+            {
+                // Show the edits, e.g. a new seed point while paused, without waiting for a step
+                model->capture(snapshots.back());
+                snapshots.publish();
+            }
+        }
+        pending_edits.clear();
+        if (due == 0)
+        {
+            // Sleep, otherwise we use too much CPU.
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            pending.swap(injections);
+        }
+        {
+            // Substeps that catch up with the wall clock are published as one snapshot, which skips their frames
+            std::lock_guard<std::mutex> lock(mutex);
+            TraceScope trace("steps");
+            for (auto injection = pending.begin(); injection != pending.end(); ++injection)
+                model->inject((*injection).X, (*injection).Y, (*injection).fx, (*injection).fy, (*injection).density);
+            for (int i = 0; i < due; i++)
+                model->do_one_simulation_step(model->DIM);
+            model->capture(snapshots.back());
+        }
+        pending.clear();
+        snapshots.publish();
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef SIMULATION_THREAD_H
+#define SIMULATION_THREAD_H
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "model.h"
+#include "scheduler.h"
+
+// SnapshotBuffer: Triple buffer of field snapshots. The simulation fills the back buffer and publishes it, the
+//                 renderer draws the front buffer. Publishing and taking a snapshot only swap indices, so neither
+//                 side ever waits for the other to finish copying or drawing.
+class SnapshotBuffer {
+public:
+    SnapshotBuffer();
+
+    //back: The snapshot the simulation writes next
+    FieldSnapshot& back() { return buffers[back_index]; }
+
+    //publish: Make the back buffer the latest complete snapshot
+    void publish();
+
+    //fresh: Whether a snapshot was published that the renderer has not taken yet
+    bool fresh();
+
+    //front: Take the latest published snapshot, if there is a new one, and return it. NULL until the first publish.
+    const FieldSnapshot* front();
+
+private:
+    FieldSnapshot buffers[3];
+    int back_index, middle_index, front_index;
+    bool has_new, has_front;
+    std::mutex mutex;
+};
+
+// PendingInjection: A force and density injected by the user, applied before the next simulation step
+typedef struct pending_injection {
+    int X, Y;
+    fftw_real fx, fy, density;
+} PendingInjection;
+
+// SimulationThread: Runs the simulation steps of a model on its own thread, and publishes a snapshot of the fields
+//                   after every step. While it runs, other threads only change the model while holding 'mutex',
+//                   or through inject() and post(), which do not wait for the current step. The scheduler decides
+//                   how many steps run between two snapshots; at a rate of 0 a step runs once the renderer took the
+//                   previous snapshot.
+class SimulationThread {
+public:
+    SimulationThread(Model* model);
+    ~SimulationThread();
+
+    //start, stop: Start and stop stepping. start() publishes the current state of the model first.
+    void start();
+    void stop();
+    bool running() const { return thread.joinable(); }
+
+    //set_paused: Stop stepping without stopping the thread, like freezing the synchronous simulation
+    void set_paused(bool paused) { this->paused = paused; }
+
+    //inject: Queue Model::inject(X, Y, fx, fy, density) for the next step
+    void inject(int X, int Y, fftw_real fx, fftw_real fy, fftw_real density);
+
+    //post: Queue 'edit' to run on the simulation thread, holding 'mutex', before the next step
+    void post(std::function<void()> edit);
+
+    SnapshotBuffer snapshots;
+    StepScheduler scheduler;        //guarded by 'mutex' as well
+    std::mutex mutex;               //guards the model
+    std::atomic<double> lag;        //scheduler.lag() and scheduler.dropped_steps, readable without the lock
+    std::atomic<unsigned long> dropped_steps;
+
+private:
+    void loop();
+
+    Model* model;
+    std::thread thread;
+    std::atomic<bool> quit, paused;
+    std::mutex queue_mutex;         //guards the injections and edits queued for the next step
+    std::vector<PendingInjection> injections;
+    std::vector<std::function<void()>> edits;
+};
+
+#endif
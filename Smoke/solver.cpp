@@ -0,0 +1,33 @@
+#include "solver.h"
+
+template <int N>
+static SolverKernels make_kernels()
+{
+    SolverKernels kernels;
+    kernels.n = N;
+    kernels.add_forces = add_forces_grid<fftw_real, N>;
+    kernels.pad = pad_grid<fftw_real, N>;
+    kernels.unpad = unpad_grid<fftw_real, N>;
+    kernels.damp = damp_grid<fftw_real, N>;
+    kernels.advect = advect_grid<fftw_real, N>;
+    return kernels;
+}
+
+//solver_kernels: The kernels for an n x n grid, specialized for the powers of two from 64 to 2048
+SolverKernels solver_kernels(int n, bool generic)
+{
+    if (!generic)
+    {
+        switch (n)
+        {
+            case 64:   return make_kernels<64>();
+            case 128:  return make_kernels<128>();
+            case 256:  return make_kernels<256>();
+            case 512:  return make_kernels<512>();
+            case 1024: return make_kernels<1024>();
+            case 2048: return make_kernels<2048>();
+            default:   break;
+        }
+    }
+    return make_kernels<0>();
+}
@@ -0,0 +1,143 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+#include <rfftw.h>              //the numerical simulation FFTW library
+#include <math.h>
+#include <cstddef>
+#include "simd.h"
+
+// The loops of a simulation step that do not go through the FFT, as templates over the scalar type and the grid
+// size. The scalar type is fftw_real for the kernels the model uses, since FFTW 2 fixes the precision when it is
+// linked (srfftw or drfftw); the same templates give the double kernels in a double precision build.
+
+// Smallest and largest grid size with kernels of their own. The sizes in between that are powers of two are
+// specialized, every other size uses the generic kernels.
+#define SOLVER_MIN_SPECIALIZED 64
+#define SOLVER_MAX_SPECIALIZED 2048
+
+// Grid: The size of an n x n grid. With N > 0 the size is the power of two N, known at compile time, so loop
+//       bounds are constants and wrapping a coordinate is a bitmask. With N == 0 the size is only known at runtime.
+template <int N>
+struct Grid {
+    explicit Grid(int) {}
+    int size() const { return N; }
+    int wrap(int i) const { return i & (N - 1); }
+};
+
+template <>
+struct Grid<0> {
+    explicit Grid(int n) : n(n) {}
+    int size() const { return n; }
+    int wrap(int i) const { return (n + (i % n)) % n; }
+    int n;
+};
+
+//sample_periodic: Bilinearly sample 'num_fields' fields of the periodic grid at index coordinates (x, y), and
+//                 store field k in dst[k][p]
+template <class Real, int N>
+inline void sample_periodic(const Grid<N>& grid, int num_fields, const Real* const* src, Real x, Real y, Real* const* dst, size_t p)
+{
+    const int n = grid.size();
+    int i0 = (int)floor(x); Real s = x-i0;
+    int j0 = (int)floor(y); Real t = y-j0;
+    i0 = grid.wrap(i0);
+    j0 = grid.wrap(j0);
+    int i1 = grid.wrap(i0+1);
+    int j1 = grid.wrap(j0+1);
+    for (int k = 0; k < num_fields; k++)
+    {
+        const Real* f0 = src[k];
+        dst[k][p] = (1-s)*((1-t)*f0[i0+n*j0]+t*f0[i0+n*j1])+s*((1-t)*f0[i1+n*j0]+t*f0[i1+n*j1]);
+    }
+}
+
+//advect_grid: Scalar semi-Lagrangian advection of rows [j_begin, j_end), see AdvectKernel
+template <class Real, int N>
+void advect_grid(int n, const Real* centers, const Real* u, const Real* v, Real dt,
+                 int num_fields, const Real* const* src, Real* const* dst, int j_begin, int j_end)
+{
+    Grid<N> grid(n);
+    const int size = grid.size();
+    for (int j = j_begin; j < j_end; j++)
+    {
+        for (int i = 0; i < size; i++)
+        {
+            Real x0 = size*(centers[i]-dt*u[i+size*j])-0.5f;
+            Real y0 = size*(centers[j]-dt*v[i+size*j])-0.5f;
+            sample_periodic(grid, num_fields, src, x0, y0, dst, i+size*j);
+        }
+    }
+}
+
+//add_forces_grid: Add the forces in (vx0, vy0) to the velocity, and keep a copy of the result in (vx0, vy0)
+template <class Real, int N>
+void add_forces_grid(int n, Real* vx, Real* vy, Real* vx0, Real* vy0, Real dt)
+{
+    const int cells = Grid<N>(n).size() * Grid<N>(n).size();
+    for (int i = 0; i < cells; i++)
+    {
+        vx[i] += dt*vx0[i]; vx0[i] = vx[i]; vy[i] += dt*vy0[i]; vy0[i] = vy[i];
+    }
+}
+
+//pad_grid: Copy the velocity into the padded rows of (vx0, vy0) that the FFT works on
+template <class Real, int N>
+void pad_grid(int n, const Real* vx, const Real* vy, Real* vx0, Real* vy0)
+{
+    const int size = Grid<N>(n).size();
+    const int stride = 2*(size/2+1);            // n+2 reals for an even n, n+1 for an odd n
+    for (int j = 0; j < size; j++)
+    {
+        for (int i = 0; i < size; i++)
+        {
+            vx0[i+stride*j] = vx[i+size*j]; vy0[i+stride*j] = vy[i+size*j];
+        }
+    }
+}
+
+//unpad_grid: Copy the padded rows of (vx0, vy0) back into the velocity, normalizing the inverse FFT
+template <class Real, int N>
+void unpad_grid(int n, const Real* vx0, const Real* vy0, Real* vx, Real* vy)
+{
+    const int size = Grid<N>(n).size();
+    const int stride = 2*(size/2+1);
+    Real f = 1.0/(size*size);
+    for (int j = 0; j < size; j++)
+    {
+        for (int i = 0; i < size; i++)
+        {
+            vx[i+size*j] = f*vx0[i+stride*j];
+            vy[i+size*j] = f*vy0[i+stride*j];
+        }
+    }
+}
+
+//damp_grid: Copy the forces into (vx0, vy0) and the density into rho0, dampening both for a stable simulation
+template <class Real, int N>
+void damp_grid(int n, const Real* rho, Real* rho0, Real* fx, Real* fy, Real* vx0, Real* vy0)
+{
+    const int cells = Grid<N>(n).size() * Grid<N>(n).size();
+    for (int i = 0; i < cells; i++)
+    {
+        rho0[i]  = 0.995 * rho[i];
+        fx[i] *= 0.85;
+        fy[i] *= 0.85;
+        vx0[i]    = fx[i];
+        vy0[i]    = fy[i];
+    }
+}
+
+// SolverKernels: The loops of a simulation step, compiled for one grid size
+typedef struct solver_kernels {
+    int n;                      // grid size the kernels are specialized for, 0 for the generic kernels
+    void (*add_forces)(int n, fftw_real* vx, fftw_real* vy, fftw_real* vx0, fftw_real* vy0, fftw_real dt);
+    void (*pad)(int n, const fftw_real* vx, const fftw_real* vy, fftw_real* vx0, fftw_real* vy0);
+    void (*unpad)(int n, const fftw_real* vx0, const fftw_real* vy0, fftw_real* vx, fftw_real* vy);
+    void (*damp)(int n, const fftw_real* rho, fftw_real* rho0, fftw_real* fx, fftw_real* fy, fftw_real* vx0, fftw_real* vy0);
+    AdvectKernel advect;        // scalar advection, the SIMD kernels replace it when the CPU has them
+} SolverKernels;
+
+//solver_kernels: The kernels for an n x n grid: specialized when n is a power of two from SOLVER_MIN_SPECIALIZED
+//                to SOLVER_MAX_SPECIALIZED, generic otherwise or when 'generic' is set
+SolverKernels solver_kernels(int n, bool generic = false);
+
+#endif
@@ -0,0 +1,126 @@
+#include "timing.h"
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <algorithm>
+
+//phase_name: Name of a phase, without spaces so it can be used in CSV files
+const char* phase_name(TIMING_PHASE phase)
+{
+    switch (phase)
+    {
+        case PHASE_SET_FORCES:       return "set_forces";
+        case PHASE_ADVECTION:        return "advection";
+        case PHASE_FFT_FORWARD:      return "fft_forward";
+        case PHASE_PROJECTION:       return "projection";
+        case PHASE_FFT_INVERSE:      return "fft_inverse";
+        case PHASE_DIFFUSE_MATTER:   return "diffuse_matter";
+        case PHASE_COMPUTE_STATS:    return "compute_stats";
+        case PHASE_STREAMTUBE_FLOW:  return "streamtube_flow";
+        case PHASE_STORE_HISTORY:    return "store_history";
+        case PHASE_STEP:             return "step";
+        case PHASE_DRAW_SMOKE:       return "draw_smoke";
+        case PHASE_DRAW_VELOCITIES:  return "draw_velocities";
+        case PHASE_DRAW_STREAMTUBES: return "draw_streamtubes";
+        case PHASE_VISUALIZE:        return "visualize";
+        default:                     return "unknown";
+    }
+}
+
+PhaseTimers::PhaseTimers(size_t window) : counters(NULL), window(std::max(window, (size_t)1)), csv(NULL)
+{
+    for (int p = 0; p < NUM_PHASES; p++)
+    {
+        durations[p].reserve(this->window);
+        counts[p] = 0;
+    }
+    memset(counter_sums, 0, sizeof(counter_sums));
+}
+
+PhaseTimers::~PhaseTimers()
+{
+    close_csv();
+}
+
+//add: Record that 'phase' took 'ms' milliseconds, and the counter values changed by 'deltas' if not NULL
+void PhaseTimers::add(TIMING_PHASE phase, double ms, const CounterValues* deltas)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<double>& ring = durations[phase];
+    if (ring.size() < window)
+        ring.push_back(ms);
+    else
+        ring[counts[phase] % window] = ms;
+    counts[phase]++;
+    if (deltas)
+    {
+        for (int c = 0; c < NUM_COUNTERS; c++)
+            counter_sums[phase].totals.value[c] += deltas->value[c];
+        counter_sums[phase].count++;
+    }
+    if (csv)
+    {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - csv_start).count();
+        fprintf(csv, "%.6f,%s,%.4f\n", seconds, phase_name(phase), ms);
+    }
+}
+
+//percentile: The p-th percentile of the sorted 'values', the nearest rank
+static double percentile(const std::vector<double>& values, double p)
+{
+    size_t rank = (size_t)ceil(p / 100.0 * values.size());
+    return values[std::min(std::max(rank, (size_t)1), values.size()) - 1];
+}
+
+//stats: The percentiles of the durations of 'phase' in the window
+PhaseStats PhaseTimers::stats(TIMING_PHASE phase) const
+{
+    PhaseStats stats;
+    std::vector<double> sorted;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sorted = durations[phase];
+        stats.count = counts[phase];
+    }
+    stats.samples = sorted.size();
+    stats.p50 = stats.p95 = stats.p99 = 0.0;
+    if (sorted.empty())
+        return stats;
+    std::sort(sorted.begin(), sorted.end());
+    stats.p50 = percentile(sorted, 50);
+    stats.p95 = percentile(sorted, 95);
+    stats.p99 = percentile(sorted, 99);
+    return stats;
+}
+
+//counter_stats: The counter deltas of 'phase' summed since the start
+PhaseCounters PhaseTimers::counter_stats(TIMING_PHASE phase) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counter_sums[phase];
+}
+
+//open_csv: Append every duration from now on to 'file'
+bool PhaseTimers::open_csv(const std::string& file, std::string& error)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (csv)
+        fclose(csv);
+    csv = fopen(file.c_str(), "w");
+    if (!csv)
+    {
+        error = file + ": " + strerror(errno);
+        return false;
+    }
+    fprintf(csv, "seconds,phase,ms\n");
+    csv_start = std::chrono::steady_clock::now();
+    return true;
+}
+
+void PhaseTimers::close_csv()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (csv)
+        fclose(csv);
+    csv = NULL;
+}
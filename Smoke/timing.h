@@ -0,0 +1,125 @@
+#ifndef TIMING_H
+#define TIMING_H
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "counters.h"
+#include "trace.h"
+
+// The timed phases of a simulation step (Model::do_one_simulation_step) and of drawing a frame (Visualization::visualize).
+// PHASE_STEP and PHASE_VISUALIZE are the totals, the other phases are parts of them.
+enum TIMING_PHASE {
+    PHASE_SET_FORCES = 0,
+    PHASE_ADVECTION,            // adding the forces and advecting the velocity
+    PHASE_FFT_FORWARD,          // copying the velocity into the padded rows and transforming it
+    PHASE_PROJECTION,           // the frequency domain filter
+    PHASE_FFT_INVERSE,          // transforming back and copying out of the padded rows
+    PHASE_DIFFUSE_MATTER,
+    PHASE_COMPUTE_STATS,
+    PHASE_STREAMTUBE_FLOW,
+    PHASE_STORE_HISTORY,
+    PHASE_STEP,
+    PHASE_DRAW_SMOKE,
+    PHASE_DRAW_VELOCITIES,
+    PHASE_DRAW_STREAMTUBES,
+    PHASE_VISUALIZE,
+    NUM_PHASES
+};
+
+//phase_name: Name of a phase, without spaces so it can be used in CSV files
+const char* phase_name(TIMING_PHASE phase);
+
+// PhaseStats: Percentiles of the most recent durations of a phase, in milliseconds
+typedef struct phase_stats {
+    double p50, p95, p99;
+    size_t samples;             // durations the percentiles are taken over
+    unsigned long count;        // durations measured in total
+} PhaseStats;
+
+// PhaseCounters: Hardware counter deltas summed over the measured durations of a phase
+typedef struct phase_counters {
+    CounterValues totals;
+    unsigned long count;        // durations the deltas were summed over
+} PhaseCounters;
+
+// PhaseTimers: Keeps the last 'window' durations of every phase, and optionally appends every duration to a CSV file.
+//              Durations can be added from the simulation and the drawing thread at the same time.
+class PhaseTimers {
+public:
+    PhaseTimers(size_t window = 256);
+    ~PhaseTimers();
+    PhaseTimers(const PhaseTimers&) = delete;
+    PhaseTimers& operator=(const PhaseTimers&) = delete;
+
+    //add: Record that 'phase' took 'ms' milliseconds, and the counter values changed by 'deltas' if not NULL
+    void add(TIMING_PHASE phase, double ms, const CounterValues* deltas = NULL);
+
+    //stats: The percentiles of the durations of 'phase' in the window
+    PhaseStats stats(TIMING_PHASE phase) const;
+
+    //counter_stats: The counter deltas of 'phase' summed since the start
+    PhaseCounters counter_stats(TIMING_PHASE phase) const;
+
+    //open_csv: Append every duration from now on to 'file' as a line "seconds,phase,ms", where 'seconds' counts from
+    //          the moment the file was opened. Returns false, with the reason in 'error', when it cannot be created.
+    bool open_csv(const std::string& file, std::string& error);
+    void close_csv();
+
+    // Hardware counters read around every timed phase, NULL to not read any. The counters only count the thread that
+    // opened them, so they may only be set when all timed phases run on that thread, e.g. in the headless driver.
+    PerfCounters* counters;
+
+private:
+    mutable std::mutex mutex;
+    size_t window;
+    std::vector<double> durations[NUM_PHASES];  // ring of the last 'window' durations of every phase
+    unsigned long counts[NUM_PHASES];
+    PhaseCounters counter_sums[NUM_PHASES];
+    FILE* csv;
+    std::chrono::steady_clock::time_point csv_start;
+};
+
+// ScopedTimer: Adds the time between its construction and destruction to a phase, together with the change of the
+//              hardware counters when the timers have them, and records it as a trace event when tracing is enabled.
+//              Does nothing, not even reading the clock, when 'timers' is NULL and tracing is off.
+class ScopedTimer {
+public:
+    ScopedTimer(PhaseTimers* timers, TIMING_PHASE phase) : timers(timers), phase(phase), traced(trace_enabled())
+    {
+        if (timers && timers->counters)
+            timers->counters->read(start_counters);
+        if (timers || traced)
+            start = std::chrono::steady_clock::now();
+    }
+    ~ScopedTimer()
+    {
+        if (!timers && !traced)
+            return;
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        if (timers && timers->counters)
+        {
+            CounterValues deltas;
+            timers->counters->read(deltas);
+            for (int c = 0; c < NUM_COUNTERS; c++)
+                deltas.value[c] -= start_counters.value[c];
+            timers->add(phase, std::chrono::duration<double, std::milli>(end - start).count(), &deltas);
+        }
+        else if (timers)
+            timers->add(phase, std::chrono::duration<double, std::milli>(end - start).count());
+        if (traced)
+            trace_event(phase_name(phase), start, end);
+    }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    PhaseTimers* timers;
+    TIMING_PHASE phase;
+    bool traced;
+    std::chrono::steady_clock::time_point start;
+    CounterValues start_counters;
+};
+
+#endif
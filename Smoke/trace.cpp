@@ -0,0 +1,173 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+std::atomic<bool> tracing(false);
+
+// TraceEvent: One complete event, in nanoseconds since tracing started
+typedef struct trace_record {
+    const char* name;
+    int64_t begin, end;
+} TraceEvent;
+
+// ThreadTrace: The ring of events of one thread. Only its own thread writes the ring; 'count' is published after
+//              every event, so a dump knows which events are complete and which ones were overwritten meanwhile.
+typedef struct thread_events {
+    int tid;
+    std::vector<TraceEvent> events;
+    std::atomic<unsigned long> count;
+} ThreadTrace;
+
+// The threads seen so far, their names, and the ring of every thread that recorded an event. Rings are never freed,
+// a thread that is still running at exit may write to its ring while it is dumped.
+static std::mutex registry_mutex;
+static std::vector<std::string> thread_names;
+static std::vector<ThreadTrace*> thread_traces;
+static std::string trace_file;
+static size_t trace_capacity;
+static std::chrono::steady_clock::time_point trace_origin;
+static std::atomic<int> next_tid(0);
+
+static thread_local int thread_tid = -1;
+static thread_local ThreadTrace* thread_trace = NULL;
+
+//current_tid: Small number of the calling thread, assigned on first use
+static int current_tid()
+{
+    if (thread_tid < 0)
+        thread_tid = next_tid++;
+    return thread_tid;
+}
+
+static void dump_at_exit()
+{
+    std::string error;
+    if (!trace_dump(error))
+        fprintf(stderr, "Could not write trace %s\n", error.c_str());
+}
+
+//trace_start: Start recording, keeping the last 'capacity' events of every thread
+void trace_start(const std::string& file, size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if (tracing)
+        return;
+    trace_file = file;
+    trace_capacity = capacity > 0 ? capacity : 1;
+    trace_origin = std::chrono::steady_clock::now();
+    atexit(dump_at_exit);
+    tracing = true;
+}
+
+//trace_thread_name: Name the calling thread in the trace
+void trace_thread_name(const char* name)
+{
+    int tid = current_tid();
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if (thread_names.size() <= (size_t)tid)
+        thread_names.resize(tid + 1);
+    thread_names[tid] = name;
+}
+
+//trace_event: Record that 'name' ran on the calling thread from 'begin' to 'end'
+void trace_event(const char* name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end)
+{
+    ThreadTrace* trace = thread_trace;
+    if (!trace)
+    {
+        // The first event of this thread allocates its ring, the only time recording takes the lock
+        trace = new ThreadTrace;
+        trace->tid = current_tid();
+        trace->count = 0;
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        trace->events.resize(trace_capacity);
+        thread_traces.push_back(trace);
+        thread_trace = trace;
+    }
+    unsigned long count = trace->count.load(std::memory_order_relaxed);
+    TraceEvent& event = trace->events[count % trace->events.size()];
+    event.name = name;
+    event.begin = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - trace_origin).count();
+    event.end = std::chrono::duration_cast<std::chrono::nanoseconds>(end - trace_origin).count();
+    trace->count.store(count + 1, std::memory_order_release);
+}
+
+//write_string: Write 's' as a JSON string
+static void write_string(FILE* out, const char* s)
+{
+    fputc('"', out);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', out);
+        if ((unsigned char)*s >= ' ')
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+//trace_dump: Write the recorded events to the trace file
+bool trace_dump(std::string& error)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if (!tracing)
+        return true;
+    std::string temporary = trace_file + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "w");
+    if (!out)
+    {
+        error = temporary + ": " + strerror(errno);
+        return false;
+    }
+    int pid = getpid();
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (size_t tid = 0; tid < thread_names.size(); tid++)
+    {
+        if (thread_names[tid].empty())
+            continue;
+        fprintf(out, "%s{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": ",
+                first ? "" : ",\n", pid, (int)tid);
+        write_string(out, thread_names[tid].c_str());
+        fprintf(out, "}}");
+        first = false;
+    }
+    std::vector<TraceEvent> events;
+    for (ThreadTrace* trace : thread_traces)
+    {
+        // Copy the ring, then drop the events that its thread may have overwritten during the copy. Slot
+        // now % capacity may be in the middle of being written, before 'count' is published, so it is dropped too.
+        size_t capacity = trace->events.size();
+        unsigned long end = trace->count.load(std::memory_order_acquire);
+        unsigned long begin = end > capacity ? end - capacity : 0;
+        events.clear();
+        for (unsigned long i = begin; i < end; i++)
+            events.push_back(trace->events[i % capacity]);
+        unsigned long now = trace->count.load(std::memory_order_acquire);
+        unsigned long valid = now + 1 > capacity ? now + 1 - capacity : 0;
+        for (unsigned long i = std::max(begin, valid); i < end; i++)
+        {
+            const TraceEvent& event = events[i - begin];
+            fprintf(out, "%s{\"ph\": \"X\", \"name\": ", first ? "" : ",\n");
+            write_string(out, event.name);
+            fprintf(out, ", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    pid, trace->tid, event.begin / 1000.0, (event.end - event.begin) / 1000.0);
+            first = false;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    bool ok = fclose(out) == 0 && rename(temporary.c_str(), trace_file.c_str()) == 0;
+    if (!ok)
+    {
+        error = trace_file + ": " + strerror(errno);
+        unlink(temporary.c_str());
+    }
+    return ok;
+}
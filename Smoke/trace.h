@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Tracing: Opt-in recording of timed events for the Chrome trace-event format, which chrome://tracing and Perfetto
+// open. Every thread writes its events into a ring of its own without locking, so tracing hardly disturbs the
+// timing it records. The rings keep the most recent events; trace_dump writes them out.
+
+extern std::atomic<bool> tracing;
+
+//trace_enabled: Whether events are recorded
+inline bool trace_enabled() { return tracing.load(std::memory_order_relaxed); }
+
+//trace_start: Start recording, keeping the last 'capacity' events of every thread. The events are written to 'file'
+//             by trace_dump, and at exit.
+void trace_start(const std::string& file, size_t capacity = 1 << 16);
+
+//trace_thread_name: Name the calling thread in the trace. Can be called before tracing starts.
+void trace_thread_name(const char* name);
+
+//trace_event: Record that 'name' ran on the calling thread from 'begin' to 'end'. 'name' must stay valid until the
+//             trace is dumped, e.g. a string literal.
+void trace_event(const char* name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end);
+
+//trace_dump: Write the recorded events to the trace file. Recording goes on while and after they are written.
+//            Returns false, with the reason in 'error', when the file cannot be written.
+bool trace_dump(std::string& error);
+
+// TraceScope: Records the time between its construction and destruction as an event, when tracing is enabled
+class TraceScope {
+public:
+    TraceScope(const char* name) : name(trace_enabled() ? name : NULL)
+    {
+        if (this->name)
+            begin = std::chrono::steady_clock::now();
+    }
+    ~TraceScope()
+    {
+        if (name)
+            trace_event(name, begin, std::chrono::steady_clock::now());
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name;
+    std::chrono::steady_clock::time_point begin;
+};
+
+#endif
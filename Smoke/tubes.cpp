@@ -0,0 +1,531 @@
+#include "tubes.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+
+// Number of tubes whose velocity is sampled in one batch
+#define TUBE_BATCH 64
+
+// SliceInterval: The velocity between two consecutive time slices, decoded. 'steady' when there is no earlier
+//                slice, so the velocity of the later slice holds for the whole interval.
+typedef struct slice_interval {
+    const fftw_real* x0, *y0, *x1, *y1;
+    bool steady;
+    int DIM;
+} SliceInterval;
+
+// is_finite: Whether 'x' is neither infinite nor NaN, tested on its bits because -ffast-math lets the compiler assume
+//            it always is
+static bool is_finite(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return (bits & 0x7ff0000000000000ULL) != 0x7ff0000000000000ULL;
+}
+
+// sample: Velocity at the 'count' grid coordinates (x[i], y[i]) at time tau of the interval, from 0 at the earlier
+//         slice to 1 at the later one. Outside the grid, and at coordinates that are not finite, the velocity is 0.
+static void sample(const SliceInterval& interval, const double* x, const double* y, double tau, int count, double* u, double* v)
+{
+    fftw_real px[TUBE_BATCH], py[TUBE_BATCH], values[4][TUBE_BATCH];
+    fftw_real* dst[4] = {values[0], values[1], values[2], values[3]};
+    if (count <= 0)
+        return;
+    for (int p = 0; p < count; p++)
+    {
+        // The sampler would index the grid with a NaN, which -ffast-math does not see as outside
+        bool finite = is_finite(x[p]) && is_finite(y[p]);
+        px[p] = finite ? x[p] : -1;
+        py[p] = finite ? y[p] : -1;
+    }
+    if (interval.steady || tau >= 1.0)
+    {
+        const fftw_real* src[2] = {interval.x1, interval.y1};
+        sample_fields(interval.DIM, SAMPLE_ZERO, 2, src, px, py, count, dst);
+        for (int p = 0; p < count; p++)
+        {
+            u[p] = values[0][p];
+            v[p] = values[1][p];
+        }
+        return;
+    }
+    const fftw_real* src[4] = {interval.x0, interval.y0, interval.x1, interval.y1};
+    sample_fields(interval.DIM, SAMPLE_ZERO, 4, src, px, py, count, dst);
+    for (int p = 0; p < count; p++)
+    {
+        u[p] = values[0][p] + tau * (values[2][p] - values[0][p]);
+        v[p] = values[1][p] + tau * (values[3][p] - values[1][p]);
+    }
+}
+
+static inline void sample(const SliceInterval& interval, double x, double y, double tau, double& u, double& v)
+{
+    sample(interval, &x, &y, tau, 1, &u, &v);
+}
+
+// advance: Move the 'count' particles at (x[i], y[i]) through the interval, which lasts dt * disp_factor, with one
+//          step of a fixed step integrator. Every stage samples all particles at once. Returns the number of
+//          velocity samples per particle, and their velocity at the start of the interval in (u, v).
+static unsigned int advance(const SliceInterval& interval, TUBE_INTEGRATOR integrator, double dt, int disp_factor,
+                            int count, double* x, double* y, double* u, double* v)
+{
+    double scale = dt * disp_factor;
+    double sx[TUBE_BATCH], sy[TUBE_BATCH], ku[3][TUBE_BATCH], kv[3][TUBE_BATCH];
+    switch (integrator)
+    {
+        case TUBE_RK2:
+            sample(interval, x, y, 0.0, count, u, v);
+            for (int p = 0; p < count; p++)
+            {
+                sx[p] = x[p] + 0.5 * scale * u[p];
+                sy[p] = y[p] + 0.5 * scale * v[p];
+            }
+            sample(interval, sx, sy, 0.5, count, ku[0], kv[0]);
+            for (int p = 0; p < count; p++)
+            {
+                x[p] += scale * ku[0][p];
+                y[p] += scale * kv[0][p];
+            }
+            return 2;
+        case TUBE_RK4:
+            sample(interval, x, y, 0.0, count, u, v);
+            for (int p = 0; p < count; p++)
+            {
+                sx[p] = x[p] + 0.5 * scale * u[p];
+                sy[p] = y[p] + 0.5 * scale * v[p];
+            }
+            sample(interval, sx, sy, 0.5, count, ku[0], kv[0]);
+            for (int p = 0; p < count; p++)
+            {
+                sx[p] = x[p] + 0.5 * scale * ku[0][p];
+                sy[p] = y[p] + 0.5 * scale * kv[0][p];
+            }
+            sample(interval, sx, sy, 0.5, count, ku[1], kv[1]);
+            for (int p = 0; p < count; p++)
+            {
+                sx[p] = x[p] + scale * ku[1][p];
+                sy[p] = y[p] + scale * kv[1][p];
+            }
+            sample(interval, sx, sy, 1.0, count, ku[2], kv[2]);
+            for (int p = 0; p < count; p++)
+            {
+                x[p] += scale * (u[p] + 2.0 * ku[0][p] + 2.0 * ku[1][p] + ku[2][p]) / 6.0;
+                y[p] += scale * (v[p] + 2.0 * kv[0][p] + 2.0 * kv[1][p] + kv[2][p]) / 6.0;
+            }
+            return 4;
+        case TUBE_EULER:
+        default:
+            sample(interval, x, y, 1.0, count, u, v);
+            for (int p = 0; p < count; p++)
+            {
+                x[p] = x[p] + u[p] * dt * disp_factor;
+                y[p] = y[p] + v[p] * dt * disp_factor;
+            }
+            return 1;
+    }
+}
+
+// Dormand-Prince 5(4) coefficients. The fifth order solution is used, the difference with the embedded fourth
+// order solution estimates the error. The last stage is the first stage of the next step.
+static const double dp_c[7] = {0.0, 1.0 / 5, 3.0 / 10, 4.0 / 5, 8.0 / 9, 1.0, 1.0};
+static const double dp_a[7][6] = {
+    {0.0},
+    {1.0 / 5},
+    {3.0 / 40, 9.0 / 40},
+    {44.0 / 45, -56.0 / 15, 32.0 / 9},
+    {19372.0 / 6561, -25360.0 / 2187, 64448.0 / 6561, -212.0 / 729},
+    {9017.0 / 3168, -355.0 / 33, 46732.0 / 5247, 49.0 / 176, -5103.0 / 18656},
+    {35.0 / 384, 0.0, 500.0 / 1113, 125.0 / 192, -2187.0 / 6784, 11.0 / 84}};
+static const double dp_e[7] = {71.0 / 57600, 0.0, -71.0 / 16695, 71.0 / 1920, -17253.0 / 339200, 22.0 / 525, -1.0 / 40};
+
+// Smallest step TUBE_RK45 takes, in time slices. Steps this small are accepted whatever their error.
+#define TUBE_MIN_STEP (1.0 / 1024)
+
+// advance_adaptive: Move a particle at (x, y) through the interval with TUBE_RK45. Every particle takes its own
+//                   steps, so they are sampled one at a time. 'step' is the step size it starts with, and is updated
+//                   for the next interval. Returns the number of velocity samples, and the velocity at the start of
+//                   the interval in (u, v). When the error or the step size stops being finite, e.g. in a velocity
+//                   field that blew up, the particle stays where the last good step left it and 'stopped' is set;
+//                   the step control would otherwise never finish the interval.
+static unsigned int advance_adaptive(const SliceInterval& interval, double tolerance, double dt, int disp_factor,
+                                     double& x, double& y, double& step, double& u, double& v, bool& stopped)
+{
+    double scale = dt * disp_factor;
+    double ku[7], kv[7];
+    unsigned int samples = 1;
+    sample(interval, x, y, 0.0, u, v);
+    ku[0] = u;
+    kv[0] = v;
+    double tau = 0.0;
+    double h = std::min(std::max(step, TUBE_MIN_STEP), 1.0);
+    while (tau < 1.0)
+    {
+        double h_step = std::min(h, 1.0 - tau);
+        for (int s = 1; s < 7; s++)
+        {
+            double dx = 0.0, dy = 0.0;
+            for (int k = 0; k < s; k++)
+            {
+                dx += dp_a[s][k] * ku[k];
+                dy += dp_a[s][k] * kv[k];
+            }
+            sample(interval, x + h_step * scale * dx, y + h_step * scale * dy, tau + dp_c[s] * h_step, ku[s], kv[s]);
+        }
+        samples += 6;
+        double error_x = 0.0, error_y = 0.0;
+        for (int k = 0; k < 7; k++)
+        {
+            error_x += dp_e[k] * ku[k];
+            error_y += dp_e[k] * kv[k];
+        }
+        double error = h_step * fabs(scale) * std::max(fabs(error_x), fabs(error_y));
+        if (!is_finite(error) || !is_finite(h))
+        {
+            step = 1.0;
+            stopped = true;
+            return samples;
+        }
+        if (error <= tolerance || h_step <= TUBE_MIN_STEP)
+        {
+            // The fifth order solution is the point where the last stage was sampled
+            for (int k = 0; k < 6; k++)
+            {
+                x += h_step * scale * dp_a[6][k] * ku[k];
+                y += h_step * scale * dp_a[6][k] * kv[k];
+            }
+            tau = h_step < 1.0 - tau ? tau + h_step : 1.0;
+            ku[0] = ku[6];
+            kv[0] = kv[6];
+        }
+        // A step that was only shortened to end on the slice says little about the next one
+        double factor = error > 0.0 ? 0.9 * pow(tolerance / error, 0.2) : 5.0;
+        if (h_step == h || error > tolerance)
+            h = std::max(h_step * std::min(std::max(factor, 0.2), 5.0), TUBE_MIN_STEP);
+    }
+    step = h;
+    stopped = false;
+    return samples;
+}
+
+StreamTubes::StreamTubes() : evaluations(0), capacity(0), traced_factor(0), method(TUBE_EULER), method_tolerance(1e-3)
+{
+}
+
+//add: Add a tube seeded at grid coordinates (x, y), that goes -z time slices back
+void StreamTubes::add(double x, double y, double z)
+{
+    seed_x.push_back(x);
+    seed_y.push_back(y);
+    seed_z.push_back(z);
+    tail_start.push_back(0);
+    tail_length.push_back(0);
+    traced.push_back(0);
+    traced_slices.push_back(0);
+    step_size.push_back(1.0);
+    tail_x.resize(seed_x.size() * capacity);
+    tail_y.resize(seed_x.size() * capacity);
+    tail_magnitude.resize(seed_x.size() * capacity);
+}
+
+//add_rake: Add 'count' tubes evenly spaced on the line from (x0, y0) to (x1, y1)
+void StreamTubes::add_rake(double x0, double y0, double x1, double y1, int count, double z)
+{
+    for (int i = 0; i < count; i++)
+    {
+        double t = count > 1 ? (double)i / (count - 1) : 0.5;
+        add(x0 + t * (x1 - x0), y0 + t * (y1 - y0), z);
+    }
+}
+
+//add_grid: Add nx x ny tubes evenly spaced over the rectangle from (x0, y0) to (x1, y1)
+void StreamTubes::add_grid(double x0, double y0, double x1, double y1, int nx, int ny, double z)
+{
+    for (int j = 0; j < ny; j++)
+    {
+        double t = ny > 1 ? (double)j / (ny - 1) : 0.5;
+        add_rake(x0, y0 + t * (y1 - y0), x1, y0 + t * (y1 - y0), nx, z);
+    }
+}
+
+//remove_last, clear: Remove the newest tube, or all tubes
+void StreamTubes::remove_last()
+{
+    if (empty())
+        return;
+    seed_x.pop_back();
+    seed_y.pop_back();
+    seed_z.pop_back();
+    tail_start.pop_back();
+    tail_length.pop_back();
+    traced.pop_back();
+    traced_slices.pop_back();
+    step_size.pop_back();
+    tail_x.resize(seed_x.size() * capacity);
+    tail_y.resize(seed_x.size() * capacity);
+    tail_magnitude.resize(seed_x.size() * capacity);
+}
+
+void StreamTubes::clear()
+{
+    while (!empty())
+        remove_last();
+}
+
+//set_last_z: Let the newest tube go -z time slices back. Its tail is traced again.
+void StreamTubes::set_last_z(double z)
+{
+    if (empty())
+        return;
+    seed_z.back() = z;
+    tail_length.back() = 0;
+    traced.back() = 0;
+}
+
+//set_integrator: Select how the tubes are integrated, tracing the tails again when it changes
+void StreamTubes::set_integrator(TUBE_INTEGRATOR integrator, double tolerance)
+{
+    if (integrator == method && tolerance == method_tolerance)
+        return;
+    method = integrator;
+    method_tolerance = tolerance;
+    reset();
+}
+
+//reset: Forget all tails, so every tube is traced from scratch at the next step
+void StreamTubes::reset()
+{
+    std::fill(tail_length.begin(), tail_length.end(), 0);
+    std::fill(traced.begin(), traced.end(), 0);
+}
+
+void StreamTubes::resize_tails(unsigned int capacity)
+{
+    this->capacity = capacity;
+    tail_x.assign(seed_x.size() * capacity, 0.0);
+    tail_y.assign(seed_x.size() * capacity, 0.0);
+    tail_magnitude.assign(seed_x.size() * capacity, 0.0);
+    reset();
+}
+
+Point3d StreamTubes::seed(int tube) const
+{
+    Point3d seed = {seed_x[tube], seed_y[tube], seed_z[tube], 0.0};
+    return seed;
+}
+
+Point3d StreamTubes::point(int tube, int k) const
+{
+    size_t i = tube * (size_t)capacity + (tail_start[tube] + k) % capacity;
+    Point3d point = {tail_x[i], tail_y[i], seed_z[tube] + k + 1, tail_magnitude[i]};
+    return point;
+}
+
+//append: Add a point to the tail of 'tube', dropping the oldest point when the tail is full
+void StreamTubes::append(int tube, double x, double y, double magnitude)
+{
+    if (tail_length[tube] == capacity)
+    {
+        tail_start[tube] = (tail_start[tube] + 1) % capacity;
+        tail_length[tube]--;
+    }
+    size_t i = tube * (size_t)capacity + (tail_start[tube] + tail_length[tube]) % capacity;
+    tail_x[i] = x;
+    tail_y[i] = y;
+    tail_magnitude[i] = magnitude;
+    tail_length[tube]++;
+}
+
+//trace: Extend every tube with the time slices stored in 'history' since the previous trace
+void StreamTubes::trace(const HistoryRing& history, int DIM, double dt, int disp_factor, WorkerPool& workers)
+{
+    unsigned int slices = history.size();
+    unsigned long pushed = history.pushed();
+    int tubes = size();
+    if (history.capacity() != capacity)
+        resize_tails(history.capacity());
+    if (disp_factor != traced_factor)
+    {
+        reset();
+        traced_factor = disp_factor;
+    }
+
+    // Where every tube starts: from its seed when it is traced from scratch, otherwise from the end of its tail
+    begin.resize(tubes);
+    position_x.resize(tubes);
+    position_y.resize(tubes);
+    tube_evaluations.assign(tubes, 0);
+    unsigned int earliest = slices;
+    for (int t = 0; t < tubes; t++)
+    {
+        unsigned int back = std::min((unsigned int)std::max(-(int)seed_z[t], 0), slices);
+        if (!traced[t] || traced_slices[t] > pushed || pushed - traced_slices[t] > slices)
+        {
+            tail_start[t] = tail_length[t] = 0;
+            step_size[t] = 1.0;
+            begin[t] = slices - back;
+        }
+        else
+            begin[t] = slices - (unsigned int)(pushed - traced_slices[t]);
+        if (tail_length[t] == 0)
+        {
+            position_x[t] = seed_x[t];
+            position_y[t] = seed_y[t];
+        }
+        else
+        {
+            Point3d last = point(t, tail_length[t] - 1);
+            position_x[t] = last.x;
+            position_y[t] = last.y;
+        }
+        earliest = std::min(earliest, begin[t]);
+    }
+
+    const fftw_real* previous_x = NULL, *previous_y = NULL, *current_x = NULL, *current_y = NULL;
+    size_t cells = (size_t)DIM * DIM;
+    if (history.format() != HISTORY_FLOAT)
+    {
+        decoded[0].resize(2 * cells);
+        decoded[1].resize(2 * cells);
+    }
+    // prefetch_rows: Read slices [from, to) of a history file ahead of the tracer, only the rows the tubes that are
+    //                traced by then can reach: their span now, widened by a row for every slice until 'to'
+    auto prefetch_rows = [&](unsigned int slice, unsigned int from, unsigned int to) {
+        double low = DIM, high = -1.0;
+        for (int t = 0; t < tubes; t++)
+        {
+            if (begin[t] < std::min(to, slices))
+            {
+                low = std::min(low, position_y[t]);
+                high = std::max(high, position_y[t]);
+            }
+        }
+        int margin = (int)(to - slice);
+        if (high >= low)
+            history.prefetch(from, to, (int)floor(low) - margin, (int)ceil(high) + 1 + margin);
+    };
+    for (unsigned int slice = earliest; slice < slices; slice++)
+    {
+        // A history file is read ahead of the tracer: the first window, including the slice before it that the
+        // first step starts at, is asked for together with the next one
+        if (history.mapped())
+        {
+            if (slice == earliest)
+                prefetch_rows(slice, slice > 0 ? slice - 1 : slice, slice + 2 * HISTORY_PREFETCH);
+            else if ((slice - earliest) % HISTORY_PREFETCH == 0)
+                prefetch_rows(slice, slice + HISTORY_PREFETCH, slice + 2 * HISTORY_PREFETCH);
+        }
+        // The step onto this slice starts at the previous one. Compressed slices are decoded once for all tubes.
+        if (history.format() == HISTORY_FLOAT)
+        {
+            previous_x = (const fftw_real*)history.vx(slice > 0 ? slice - 1 : slice).data;
+            previous_y = (const fftw_real*)history.vy(slice > 0 ? slice - 1 : slice).data;
+            current_x = (const fftw_real*)history.vx(slice).data;
+            current_y = (const fftw_real*)history.vy(slice).data;
+        }
+        else
+        {
+            if (slice == earliest && slice > 0)
+                history.decode(slice - 1, decoded[0].data(), decoded[0].data() + cells);
+            std::swap(decoded[0], decoded[1]);
+            history.decode(slice, decoded[0].data(), decoded[0].data() + cells);
+            current_x = decoded[0].data();
+            current_y = decoded[0].data() + cells;
+            previous_x = slice > 0 ? decoded[1].data() : current_x;
+            previous_y = slice > 0 ? decoded[1].data() + cells : current_y;
+        }
+        SliceInterval interval = {previous_x, previous_y, current_x, current_y, slice == 0, DIM};
+        workers.run(0, tubes, [&](int t_begin, int t_end) {
+            int batch[TUBE_BATCH];
+            double x[TUBE_BATCH], y[TUBE_BATCH], u[TUBE_BATCH], v[TUBE_BATCH];
+            bool stopped[TUBE_BATCH];
+            for (int t = t_begin; t < t_end; )
+            {
+                // Collect the next batch of tubes that have reached this slice
+                int count = 0;
+                for (; t < t_end && count < TUBE_BATCH; t++)
+                {
+                    if (begin[t] <= slice)
+                        batch[count++] = t;
+                }
+                for (int p = 0; p < count; p++)
+                {
+                    x[p] = position_x[batch[p]];
+                    y[p] = position_y[batch[p]];
+                }
+                if (method == TUBE_RK45)
+                {
+                    for (int p = 0; p < count; p++)
+                        tube_evaluations[batch[p]] += advance_adaptive(interval, method_tolerance, dt, disp_factor,
+                                                                       x[p], y[p], step_size[batch[p]], u[p], v[p], stopped[p]);
+                }
+                else
+                {
+                    unsigned int samples = advance(interval, method, dt, disp_factor, count, x, y, u, v);
+                    for (int p = 0; p < count; p++)
+                    {
+                        tube_evaluations[batch[p]] += samples;
+                        stopped[p] = !is_finite(x[p]) || !is_finite(y[p]) || !is_finite(u[p]) || !is_finite(v[p]);
+                    }
+                }
+                for (int p = 0; p < count; p++)
+                {
+                    int tube = batch[p];
+                    if (stopped[p])
+                    {
+                        // The tail ends here for this trace; the next trace continues from its last point
+                        begin[tube] = slices;
+                        continue;
+                    }
+                    position_x[tube] = x[p];
+                    position_y[tube] = y[p];
+                    double magnitude = (u[p] * u[p] + v[p] * v[p]) * 10e4;
+                    append(tube, x[p], y[p], magnitude > 20 ? 20 : magnitude);
+                }
+            }
+        });
+    }
+
+    // Keep the last -z points of every tail
+    evaluations = 0;
+    for (int t = 0; t < tubes; t++)
+    {
+        evaluations += tube_evaluations[t];
+        unsigned int back = std::min((unsigned int)std::max(-(int)seed_z[t], 0), slices);
+        if (tail_length[t] > back)
+        {
+            tail_start[t] = (tail_start[t] + tail_length[t] - back) % capacity;
+            tail_length[t] = back;
+        }
+        traced[t] = 1;
+        traced_slices[t] = pushed;
+    }
+}
+
+//tube_integrator_name: Human-readable name of a stream tube integrator
+const char* tube_integrator_name(TUBE_INTEGRATOR integrator)
+{
+    switch (integrator)
+    {
+        case TUBE_RK2:  return "rk2";
+        case TUBE_RK4:  return "rk4";
+        case TUBE_RK45: return "rk45";
+        case TUBE_EULER:
+        default:        return "euler";
+    }
+}
+
+//parse_tube_integrator: Convert the name of an integrator to the integrator. Returns false for unknown names.
+bool parse_tube_integrator(const char* name, TUBE_INTEGRATOR& integrator)
+{
+    for (int i = TUBE_EULER; i <= TUBE_RK45; i++)
+    {
+        if (std::string(tube_integrator_name((TUBE_INTEGRATOR)i)) == name)
+        {
+            integrator = (TUBE_INTEGRATOR)i;
+            return true;
+        }
+    }
+    return false;
+}
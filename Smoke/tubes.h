@@ -0,0 +1,95 @@
+#ifndef TUBES_H
+#define TUBES_H
+#include <vector>
+#include "history.h"
+#include "workers.h"
+
+typedef struct point3d {
+    double x, y, z;
+    double magnitude;
+} Point3d;
+
+// How a stream tube follows the velocity from one time slice to the next. Euler samples only the newer slice, the
+// Runge-Kutta methods sample the velocity linearly interpolated in time between the two slices.
+// TUBE_RK45 is the adaptive Dormand-Prince method, which takes as many steps per slice as its tolerance requires.
+enum TUBE_INTEGRATOR {TUBE_EULER = 0, TUBE_RK2, TUBE_RK4, TUBE_RK45};
+
+// StreamTubes: All stream tubes, stored as a structure of arrays. A tube has a seed (x, y) that goes -z time slices
+//              back, and a tail of at most 'capacity' points, kept as a ring at offset tube * capacity of the tail arrays.
+//              Point k of a tail lies at time seed z + k + 1.
+class StreamTubes {
+public:
+    StreamTubes();
+
+    int size() const { return (int)seed_x.size(); }
+    bool empty() const { return seed_x.empty(); }
+
+    //add: Add a tube seeded at grid coordinates (x, y), that goes -z time slices back
+    void add(double x, double y, double z);
+
+    //add_rake: Add 'count' tubes evenly spaced on the line from (x0, y0) to (x1, y1)
+    void add_rake(double x0, double y0, double x1, double y1, int count, double z);
+
+    //add_grid: Add nx x ny tubes evenly spaced over the rectangle from (x0, y0) to (x1, y1)
+    void add_grid(double x0, double y0, double x1, double y1, int nx, int ny, double z);
+
+    //remove_last, clear: Remove the newest tube, or all tubes
+    void remove_last();
+    void clear();
+
+    //set_last_z: Let the newest tube go -z time slices back. Its tail is traced again.
+    void set_last_z(double z);
+
+    //set_integrator: Select how the tubes are integrated. 'tolerance' is the largest error in cells per time slice
+    //                that TUBE_RK45 accepts. The tails are traced again when either changes.
+    void set_integrator(TUBE_INTEGRATOR integrator, double tolerance);
+    TUBE_INTEGRATOR integrator() const { return method; }
+    double tolerance() const { return method_tolerance; }
+
+    //reset: Forget all tails, so every tube is traced from scratch at the next step
+    void reset();
+
+    //seed, length, point: The seed of a tube, the number of points of its tail, and point k of the tail
+    Point3d seed(int tube) const;
+    int length(int tube) const { return tail_length[tube]; }
+    Point3d point(int tube, int k) const;
+
+    //trace: Extend every tube with the time slices stored in 'history' since the previous trace. A tube follows the
+    //       path of the particle that left its seed when it was traced from scratch, through the last -z time slices.
+    //       Tubes are traced from scratch when they are new, when 'disp_factor' or the integrator changes, or when
+    //       slices they have not seen already left the history.
+    //       The loop runs over the time slices, and every slice is sampled for all tubes at once by the workers,
+    //       so it passes through the cache only once.
+    void trace(const HistoryRing& history, int DIM, double dt, int disp_factor, WorkerPool& workers);
+
+    unsigned long evaluations;                              // velocity samples taken by the last trace
+
+private:
+    void append(int tube, double x, double y, double magnitude);
+    void resize_tails(unsigned int capacity);
+
+    std::vector<double> seed_x, seed_y, seed_z;
+    std::vector<double> tail_x, tail_y, tail_magnitude;     // size() * capacity points
+    std::vector<unsigned int> tail_start, tail_length;
+    std::vector<char> traced;                               // whether the tail is up to date with 'traced_slices'
+    std::vector<unsigned long> traced_slices;               // HistoryRing::pushed() when the tail was last extended
+    unsigned int capacity;                                  // points per tail
+    int traced_factor;                                      // displacement factor of all traced tails
+    TUBE_INTEGRATOR method;
+    double method_tolerance;
+    std::vector<double> step_size;                          // TUBE_RK45: last step of every tube, in time slices
+
+    // Per trace: first time slice of every tube and its current position
+    std::vector<unsigned int> begin;
+    std::vector<double> position_x, position_y;
+    std::vector<unsigned int> tube_evaluations;
+    std::vector<fftw_real> decoded[2];                      // compressed history: the current and the previous slice
+};
+
+//tube_integrator_name: Human-readable name of a stream tube integrator
+const char* tube_integrator_name(TUBE_INTEGRATOR integrator);
+
+//parse_tube_integrator: Convert the name of an integrator to the integrator. Returns false for unknown names.
+bool parse_tube_integrator(const char* name, TUBE_INTEGRATOR& integrator);
+
+#endif
@@ -1,3 +1,4 @@
+#define GL_GLEXT_PROTOTYPES             //vertex buffer objects, core since OpenGL 1.5
 #include "visualization.h"
 #include "model.h"
 #include "GL/glui.h"
@@ -6,91 +7,95 @@
 #define UNSETBIT(a, n) (a) &= ~(1 << (n))
 #define CHECKBIT(a, n) (a) & (1 << n)
 
-void Visualization::determineValuesMinMax(Model* model, int dataset_idx, std::vector<fftw_real>& values, fftw_real *min, fftw_real* max)
+void Visualization::determineValuesMinMax(const FieldSnapshot* frame, int dataset_idx, std::vector<fftw_real>& values, fftw_real *min, fftw_real* max)
 {
 	//determineValuesMinMax fills the values vector and determins min and max
 	values.clear();
-	int dim = model->DIM * 2 * (model->DIM /2+1);
+	int dim = frame->DIM * frame->DIM;
 	switch (dataset_idx)
 	{
 	case FLUID_VELOCITY:
 		// Calculate magnitudes
 		for (int i = 0; i < dim; i++)
 		{
-			values.push_back((fftw_real)sqrt(model->vx[i] * model->vx[i] + model->vy[i] * model->vy[i]));
+			values.push_back((fftw_real)sqrt(frame->vx[i] * frame->vx[i] + frame->vy[i] * frame->vy[i]));
 		}    			
-		*min = model->min_velo;
-		*max = model->max_velo;
+		*min = frame->stats.velocity.min;
+		*max = frame->stats.velocity.max;
 
 		break;
 	case FORCE_FIELD:
 		// Calculate magnitudes    
     	for (int i = 0; i < dim; i++)
     	{
-    		values.push_back((fftw_real)sqrt(model->fx[i] * model->fx[i] + model->fy[i] * model->fy[i]));
+    		values.push_back((fftw_real)sqrt(frame->fx[i] * frame->fx[i] + frame->fy[i] * frame->fy[i]));
     	}
-    	*min = model->min_force;
-    	*max = model->max_force;
+    	*min = frame->stats.force.min;
+    	*max = frame->stats.force.max;
 
 		break;
 	case DIVERGENCE_FORCE:
-		divergence(model->fx, model->fy, values, model);
-		*min = model->min_div;
-		*max = model->max_div;
+		divergence(frame->fx, frame->fy, values, frame->DIM);
+		*min = frame->stats.div_force.min;
+		*max = frame->stats.div_force.max;
 		break;
 	case DIVERGENCE_VELOCITY:
-		divergence(model->vx, model->vy, values, model);
-		*min = model->min_div;
-		*max = model->max_div;
+		divergence(frame->vx, frame->vy, values, frame->DIM);
+		*min = frame->stats.div_velocity.min;
+		*max = frame->stats.div_velocity.max;
 		break;
 	case FLUID_DENSITY:
 	default:
-		for(int i = 0; i < (model->DIM * model->DIM); ++i)
-			values.push_back(model->rho[i]);
+		for(int i = 0; i < dim; ++i)
+			values.push_back(frame->rho[i]);
 
-		*min = model->min_rho;
-		*max = model->max_rho;
+		*min = frame->stats.rho.min;
+		*max = frame->stats.rho.max;
 	}
 
 }
-//visualize: This is the main visualization function
-void Visualization::visualize(Model* model)
+//visualize: This is the main visualization function. Draws 'frame' in a window of winWidth x winHeight pixels.
+void Visualization::visualize(const FieldSnapshot* frame, int winWidth, int winHeight)
 {
-    fftw_real  wn = (fftw_real)model->winWidth / (fftw_real)(model->DIM + 1)*0.8;   // Grid cell width
-    fftw_real  hn = (fftw_real)model->winHeight / (fftw_real)(model->DIM + 1);  // Grid cell height
+    ScopedTimer visualize_timer(timers, PHASE_VISUALIZE);
+    fftw_real  wn = (fftw_real)winWidth / (fftw_real)(frame->DIM + 1)*0.8;   // Grid cell width
+    fftw_real  hn = (fftw_real)winHeight / (fftw_real)(frame->DIM + 1);  // Grid cell height
 	std::vector<fftw_real> color_map_values;
     // color_map_values is filled with scalar values
-    determineValuesMinMax(model, scalar_dataset_idx, color_map_values, &min, &max);
+    determineValuesMinMax(frame, scalar_dataset_idx, color_map_values, &min, &max);
     if (drawMatter || drawIsolines)
     {	
     	// Initialize a vector of length numCells with value 0
-    	std::vector<fftw_real> height_values(model->DIM * model-> DIM, 0);
+    	std::vector<fftw_real> height_values(frame->DIM * frame->DIM, 0);
     	fftw_real min_height = 0, max_height = 1;
     	if (drawHeightplot)
-    		determineValuesMinMax(model, height_dataset_idx, height_values, &min_height, &max_height);
-        draw_smoke(wn, hn, model->DIM, color_map_values, height_values, min, max, min_height, max_height);
+    		determineValuesMinMax(frame, height_dataset_idx, height_values, &min_height, &max_height);
+        ScopedTimer timer(timers, PHASE_DRAW_SMOKE);
+        draw_smoke(wn, hn, frame->DIM, color_map_values, height_values, min, max, min_height, max_height);
     }
     if (drawHedgehogs)
     {
     	// Vector values
-    	fftw_real* direction_x;
-    	fftw_real* direction_y;
+    	const fftw_real* direction_x;
+    	const fftw_real* direction_y;
 		switch (vector_dataset_idx)
     	{
     	case FORCE_FIELD:
-    		direction_x = model->fx;
-    		direction_y = model->fy;
+    		direction_x = frame->fx;
+    		direction_y = frame->fy;
     		break;
     	case FLUID_VELOCITY:
     	default:
-    		direction_x = model->vx;
-    		direction_y = model->vy;
+    		direction_x = frame->vx;
+    		direction_y = frame->vy;
     	}
-        draw_velocities(wn, hn, model->DIM, direction_x, direction_y, color_map_values, min, max);
+        ScopedTimer timer(timers, PHASE_DRAW_VELOCITIES);
+        draw_velocities(wn, hn, frame->DIM, direction_x, direction_y, color_map_values, min, max);
     }
     if (enableStreamtubes)
     {
-    	draw_streamtubes(&(model->streamTubes), wn, hn);
+    	ScopedTimer timer(timers, PHASE_DRAW_STREAMTUBES);
+    	draw_streamtubes(frame->streamTubes, wn, hn);
     }
 }
 //-----------COLOR MAPS ----------//
@@ -153,6 +158,7 @@ void Visualization::create_textures(){
 		glTexEnvf(GL_TEXTURE_ENV,GL_TEXTURE_ENV_MODE,GL_REPLACE);
 
 		float textureImage[3*numColors];
+		color_lut[i].resize(3*numColors);				//The same texels as bytes, for draw_image
 
 		color_map_idx = (COLORMAP_TYPE)i;								//Activate the i-th colormap
 
@@ -194,6 +200,8 @@ void Visualization::create_textures(){
 			textureImage[3*j]   = R;
 			textureImage[3*j+1] = G;
 			textureImage[3*j+2] = B;
+			for (int k = 0; k < 3; ++k)
+				color_lut[i][3*j+k] = (unsigned char)(std::min(std::max(textureImage[3*j+k], 0.0f), 1.0f) * 255 + 0.5f);
 		}	
 		glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB, numColors, 0, GL_RGB, GL_FLOAT, textureImage);
 	}	
@@ -372,20 +380,67 @@ void Visualization::draw_color_legend(float min, float max)
 	glEnd();
 }
 
+//draw_timings: Draw the p50, p95 and p99 duration of every phase in 'timers' left of the color legend
+void Visualization::draw_timings(const PhaseTimers& timers)
+{
+	int tx, ty, tw, th;
+	GLUI_Master.get_viewport_area( &tx, &ty, &tw, &th );
+	// A table left of the legend and its numbers, from the top down. The font is proportional, so every
+	// column starts at a fixed offset.
+	const float columns[4] = {0.0f, 170.0f, 240.0f, 310.0f};
+	float x = tw * 0.9 - 440;
+	float y = th - 24;
+	char text[4][32];
+	glColor3f(1.0f, 1.0f, 1.0f);
+	snprintf(text[0], 32, "phase (ms)");
+	snprintf(text[1], 32, "p50");
+	snprintf(text[2], 32, "p95");
+	snprintf(text[3], 32, "p99");
+	for (int c = 0; c < 4; ++c)
+		display_text(x + columns[c], y, text[c]);
+	for (int p = 0; p < NUM_PHASES; ++p)
+	{
+		PhaseStats stats = timers.stats((TIMING_PHASE)p);
+		if (stats.samples == 0)
+			continue;
+		y -= 20;
+		snprintf(text[0], 32, "%s", phase_name((TIMING_PHASE)p));
+		snprintf(text[1], 32, "%.2f", stats.p50);
+		snprintf(text[2], 32, "%.2f", stats.p95);
+		snprintf(text[3], 32, "%.2f", stats.p99);
+		for (int c = 0; c < 4; ++c)
+			display_text(x + columns[c], y, text[c]);
+	}
+}
+
 // Draw smoke
-void Visualization::draw_smoke(fftw_real wn, fftw_real hn, int DIM, std::vector<fftw_real> color_map_values, std::vector<fftw_real> height_values, fftw_real min_color, fftw_real max_color, fftw_real min_height, fftw_real max_height)
+void Visualization::draw_smoke(fftw_real wn, fftw_real hn, int DIM, const std::vector<fftw_real>& color_map_values, const std::vector<fftw_real>& height_values, fftw_real min_color, fftw_real max_color, fftw_real min_height, fftw_real max_height)
 {
 	int i, j;
     fftw_real vy0, vy1, vy2, vy3;
-    fftw_real height0, height1, height2, height3;
+
+    // The scalar of every vertex, shared by the triangles and the isolines
+    mesh.values.resize(DIM * DIM);
+    for (i = 0; i < DIM * DIM; i++)
+    {
+        if (clamping == 1)
+            mesh.values[i] = clamp(color_map_values[i], min_clamp_value, max_clamp_value);
+        else
+            mesh.values[i] = scale(color_map_values[i], min_color, max_color);
+    }
 
     if(useTextures){
 		glEnable(GL_TEXTURE_1D);
 		glBindTexture(GL_TEXTURE_1D,texture_id[color_map_idx]);	
 	}
  	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
- 	
-    for (j = 0; j < DIM - 1; j++)            //draw smoke
+
+    if (drawMatter && flatImage && !drawHeightplot)
+        draw_image(wn, hn, DIM);
+    else if (drawMatter)
+        draw_mesh(wn, hn, DIM, height_values, min_height, max_height);
+
+    for (j = 0; j < DIM - 1 && drawIsolines; j++)            //draw isolines
     {
         for (i = 0; i < DIM - 1; i++)
         {
@@ -397,81 +452,17 @@ void Visualization::draw_smoke(fftw_real wn, fftw_real hn, int DIM, std::vector<
             double py1 = hn + (fftw_real)(j + 1) * hn;
             int idx1 = ((j + 1) * DIM) + i;
 
-            double px2 = wn + (fftw_real)(i + 1) * wn;
-            double py2 = hn + (fftw_real)(j + 1) * hn;
-            int idx2 = ((j + 1) * DIM) + (i + 1);
-
             double px3 = wn + (fftw_real)(i + 1) * wn;
             double py3 = hn + (fftw_real)j * hn;
             int idx3 = (j * DIM) + (i + 1);
 
-            if (clamping == 1)
-            {  // Clamp
-                vy0 = clamp(color_map_values.at(idx0), min_clamp_value, max_clamp_value);
-                vy1 = clamp(color_map_values.at(idx1), min_clamp_value, max_clamp_value);
-                vy2 = clamp(color_map_values.at(idx2), min_clamp_value, max_clamp_value);
-                vy3 = clamp(color_map_values.at(idx3), min_clamp_value, max_clamp_value);
-            }
-            else
-            {  // Scale
-                vy0 = scale(color_map_values.at(idx0), min_color, max_color);
-                vy1 = scale(color_map_values.at(idx1), min_color, max_color);
-                vy2 = scale(color_map_values.at(idx2), min_color, max_color);
-                vy3 = scale(color_map_values.at(idx3), min_color, max_color);
-            }
-
-            if (heightClamping)
-            {
-            	// Clamp heights
-            	height0 = clamp(height_values.at(idx0), min_height_clamp_value, max_height_clamp_value) * height_scale;
-	           	height1 = clamp(height_values.at(idx1), min_height_clamp_value, max_height_clamp_value) * height_scale;
-	           	height2 = clamp(height_values.at(idx2), min_height_clamp_value, max_height_clamp_value) * height_scale;
-	           	height3 = clamp(height_values.at(idx3), min_height_clamp_value, max_height_clamp_value) * height_scale;
-            } else {
-            	// Scale heights
-            	height0 = scale(height_values.at(idx0), min_height, max_height) * height_scale;
-	           	height1 = scale(height_values.at(idx1), min_height, max_height) * height_scale;
-	           	height2 = scale(height_values.at(idx2), min_height, max_height) * height_scale;
-	           	height3 = scale(height_values.at(idx3), min_height, max_height) * height_scale;
-            }
+            int idx2 = ((j + 1) * DIM) + (i + 1);
 
-           	
+            vy0 = mesh.values[idx0];
+            vy1 = mesh.values[idx1];
+            vy2 = mesh.values[idx2];
+            vy3 = mesh.values[idx3];
 
-            if (drawMatter)
-            {
-				glBegin(GL_TRIANGLES);
-				if(useTextures) {
-					glTexCoord1f(vy0);
-					glVertex3f(px0, py0, height0);
-					glTexCoord1f(vy1);
-					glVertex3f(px1, py1, height1);
-					glTexCoord1f(vy2);
-					glVertex3f(px2, py2, height2);
-					glTexCoord1f(vy0);
-					glVertex3f(px0, py0, height0);
-					glTexCoord1f(vy2);
-					glVertex3f(px2, py2, height2);
-					glTexCoord1f(vy3);
-					glVertex3f(px3, py3, height3);
-				} else {
-					float R, G, B;
-					set_colormap(vy0, R, G, B); glColor3f(R, G, B);
-					glVertex3f(px0, py0, height0);
-					set_colormap(vy1, R, G, B); glColor3f(R, G, B);
-					glVertex3f(px1, py1, height1);
-					set_colormap(vy2, R, G, B); glColor3f(R, G, B);
-					glVertex3f(px2, py2, height2);
-					set_colormap(vy0, R, G, B); glColor3f(R, G, B);
-					glVertex3f(px0, py0, height0);
-					set_colormap(vy2, R, G, B); glColor3f(R, G, B);
-					glVertex3f(px2, py2, height2);
-					set_colormap(vy3, R, G, B); glColor3f(R, G, B);
-					glVertex3f(px3, py3, height3);
-				}
-				glEnd();
-            }
-			if (drawIsolines)
-            {
         		if (!multipleIsolines)
         		{
         			num_isoline_value = 1;
@@ -597,122 +588,260 @@ void Visualization::draw_smoke(fftw_real wn, fftw_real hn, int DIM, std::vector<
 	            	}
 	            	glEnd();
             	}
-            }
         }
     }
     if (useTextures)
 		glDisable(GL_TEXTURE_1D);	
 }
 
+//draw_mesh: Draw the cells of the grid as colored triangles from 'mesh', with one indexed call
+void Visualization::draw_mesh(fftw_real wn, fftw_real hn, int DIM, const std::vector<fftw_real>& height_values, fftw_real min_height, fftw_real max_height)
+{
+    int num_vertices = DIM * DIM;
+    if (!mesh.buffers[0])
+        glGenBuffers(4, mesh.buffers);
+    if (mesh.DIM != DIM)
+    {
+        // Two triangles per cell, with the corners in the order of the former immediate mode triangles
+        std::vector<unsigned int> indices;
+        indices.reserve(6 * (DIM - 1) * (DIM - 1));
+        for (int j = 0; j < DIM - 1; j++)
+        {
+            for (int i = 0; i < DIM - 1; i++)
+            {
+                unsigned int idx0 = j * DIM + i, idx1 = (j + 1) * DIM + i;
+                unsigned int idx2 = (j + 1) * DIM + i + 1, idx3 = j * DIM + i + 1;
+                unsigned int cell[6] = {idx0, idx1, idx2, idx0, idx2, idx3};
+                indices.insert(indices.end(), cell, cell + 6);
+            }
+        }
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.buffers[3]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        mesh.DIM = DIM;
+        mesh.num_indices = indices.size();
+        mesh.wn = mesh.hn = 0;
+    }
+
+    // The fixed function pipeline takes the height as z coordinate, so a height plot uploads the positions every frame
+    bool flat = !drawHeightplot;
+    if (!flat || !mesh.flat || mesh.wn != wn || mesh.hn != hn)
+    {
+        mesh.positions.resize(3 * num_vertices);
+        for (int j = 0; j < DIM; j++)
+        {
+            for (int i = 0; i < DIM; i++)
+            {
+                int idx = j * DIM + i;
+                float height = 0;
+                if (!flat && heightClamping)
+                    height = clamp(height_values[idx], min_height_clamp_value, max_height_clamp_value) * height_scale;
+                else if (!flat)
+                    height = scale(height_values[idx], min_height, max_height) * height_scale;
+                mesh.positions[3 * idx] = wn + (fftw_real)i * wn;
+                mesh.positions[3 * idx + 1] = hn + (fftw_real)j * hn;
+                mesh.positions[3 * idx + 2] = height;
+            }
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.buffers[0]);
+        glBufferData(GL_ARRAY_BUFFER, mesh.positions.size() * sizeof(float), &mesh.positions[0], flat ? GL_STATIC_DRAW : GL_STREAM_DRAW);
+        mesh.wn = wn;
+        mesh.hn = hn;
+        mesh.flat = flat;
+    }
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.buffers[0]);
+    glVertexPointer(3, GL_FLOAT, 0, 0);
+    if (useTextures)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.buffers[1]);
+        glBufferData(GL_ARRAY_BUFFER, num_vertices * sizeof(float), &mesh.values[0], GL_STREAM_DRAW);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexCoordPointer(1, GL_FLOAT, 0, 0);
+    }
+    else
+    {
+        mesh.colors.resize(3 * num_vertices);
+        for (int idx = 0; idx < num_vertices; idx++)
+            set_colormap(mesh.values[idx], mesh.colors[3 * idx], mesh.colors[3 * idx + 1], mesh.colors[3 * idx + 2]);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.buffers[2]);
+        glBufferData(GL_ARRAY_BUFFER, mesh.colors.size() * sizeof(float), &mesh.colors[0], GL_STREAM_DRAW);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glColorPointer(3, GL_FLOAT, 0, 0);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.buffers[3]);
+    glDrawElements(GL_TRIANGLES, mesh.num_indices, GL_UNSIGNED_INT, 0);
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+//draw_image: Draw the flat grid as one quad, with a 2D texture of the colors of the vertices uploaded at once
+void Visualization::draw_image(fftw_real wn, fftw_real hn, int DIM)
+{
+    mesh.image.resize(3 * DIM * DIM);
+    const std::vector<unsigned char>& lut = color_lut[color_map_idx];
+    int lut_size = lut.size() / 3;
+    for (int idx = 0; idx < DIM * DIM; idx++)
+    {
+        unsigned char* rgb = &mesh.image[3 * idx];
+        if (useTextures && lut_size > 0)
+        {
+            // The texel that the nearest lookup in the color map texture picks
+            float texel = mesh.values[idx] * lut_size;
+            int t = texel > 0 ? (texel < lut_size ? (int)texel : lut_size - 1) : 0;
+            rgb[0] = lut[3 * t];
+            rgb[1] = lut[3 * t + 1];
+            rgb[2] = lut[3 * t + 2];
+        }
+        else
+        {
+            float R, G, B;
+            set_colormap(mesh.values[idx], R, G, B);
+            rgb[0] = (unsigned char)(std::min(std::max(R, 0.0f), 1.0f) * 255 + 0.5f);
+            rgb[1] = (unsigned char)(std::min(std::max(G, 0.0f), 1.0f) * 255 + 0.5f);
+            rgb[2] = (unsigned char)(std::min(std::max(B, 0.0f), 1.0f) * 255 + 0.5f);
+        }
+    }
+
+    if (!mesh.image_texture)
+    {
+        glGenTextures(1, &mesh.image_texture);
+        glBindTexture(GL_TEXTURE_2D, mesh.image_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    }
+    glBindTexture(GL_TEXTURE_2D, mesh.image_texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (mesh.image_DIM != DIM)
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, DIM, DIM, 0, GL_RGB, GL_UNSIGNED_BYTE, &mesh.image[0]);
+        mesh.image_DIM = DIM;
+    }
+    else
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, DIM, DIM, GL_RGB, GL_UNSIGNED_BYTE, &mesh.image[0]);
+
+    // The texel centers lie on the grid points, so the quad spans from the first to the last grid point like the mesh.
+    // The colors are blended between the grid points, like the triangles without textures do.
+    float s0 = 0.5f / DIM, s1 = (DIM - 0.5f) / DIM;
+    glEnable(GL_TEXTURE_2D);
+    glBegin(GL_QUADS);
+    glTexCoord2f(s0, s0); glVertex2f(wn, hn);
+    glTexCoord2f(s1, s0); glVertex2f(wn * DIM, hn);
+    glTexCoord2f(s1, s1); glVertex2f(wn * DIM, hn * DIM);
+    glTexCoord2f(s0, s1); glVertex2f(wn, hn * DIM);
+    glEnd();
+    glDisable(GL_TEXTURE_2D);
+}
+
 double Visualization::interpolate(double v1, double v2, double iso)
 {
 	return (v1 - iso) / (v1 - v2);
 }
 
-void Visualization::draw_velocities(fftw_real wn, fftw_real hn, int DIM, fftw_real* direction_x, fftw_real* direction_y, std::vector<fftw_real> scalar_values, fftw_real min_color, fftw_real max_color)
+void Visualization::draw_velocities(fftw_real wn, fftw_real hn, int DIM, const fftw_real* direction_x, const fftw_real* direction_y, const std::vector<fftw_real>& scalar_values, fftw_real min_color, fftw_real max_color)
 {	
 	int i, j;
 	float R, G, B;
 	float x_scale_factor = ((float)DIM / num_x_glyphs);
 	float y_scale_factor = ((float)DIM / num_y_glyphs);
+	size_t glyphs = (size_t)num_x_glyphs * num_y_glyphs;
+	glyph_x.resize(glyphs);
+	glyph_y.resize(glyphs);
+	glyph_values.resize(3 * glyphs);
+
+	// Place all glyphs, then sample the velocity and the scalar at their grid coordinates in one batch
 	for (i = 0; i < num_x_glyphs; i++)
 	{
 		for (j = 0; j < num_y_glyphs; j++)
 		{
-			float x_start, y_start;
+			size_t g = i * (size_t)num_y_glyphs + j;
  			switch(glyph_location_idx)
  			{
  			case JITTER:
-				x_start = (wn + (fftw_real)i * wn) * x_scale_factor + jitter_displacement[i*num_x_glyphs + j] * jitter;
-				y_start = (hn + (fftw_real)j * hn) * y_scale_factor + jitter_displacement[j*num_y_glyphs + i] * jitter;
+				glyph_x[g] = (wn + (fftw_real)i * wn) * x_scale_factor + jitter_displacement[i*num_x_glyphs + j] * jitter;
+				glyph_y[g] = (hn + (fftw_real)j * hn) * y_scale_factor + jitter_displacement[j*num_y_glyphs + i] * jitter;
  				break;
  			case UNIFORM:
  			default:
-				x_start = (wn + (fftw_real)i * wn) * x_scale_factor;
-				y_start = (hn + (fftw_real)j * hn) * y_scale_factor;
+				glyph_x[g] = (wn + (fftw_real)i * wn) * x_scale_factor;
+				glyph_y[g] = (hn + (fftw_real)j * hn) * y_scale_factor;
  				break;
  			}
-			int floor_x_index = i * x_scale_factor;
-			int ceil_x_index = (floor_x_index + 1) % DIM;
-			int floor_y_index = j * y_scale_factor;
-			int ceil_y_index = (floor_y_index + 1) % DIM;
-
-			float alpha = (x_start - (wn + (fftw_real)floor_x_index * wn)) / ((float)wn);
-			float beta = (y_start - (hn + (fftw_real)floor_y_index * hn)) / ((float)hn);
-			float anti_alpha = 1.0 - alpha;
-			float anti_beta = 1.0 - beta;
-
-			float value_x = (anti_alpha * anti_beta * direction_x[floor_y_index * DIM + floor_x_index] + 
-				             alpha      * beta      * direction_x[ceil_y_index * DIM + ceil_x_index] + 
-				             anti_alpha * beta      * direction_x[floor_y_index * DIM + ceil_x_index] + 
-				             alpha      * anti_beta * direction_x[ceil_y_index * DIM + floor_x_index]);
-
-			float value_y = (anti_alpha * anti_beta * direction_y[floor_y_index * DIM + floor_x_index] + 
-				             alpha      * beta      * direction_y[ceil_y_index * DIM + ceil_x_index] + 
-				             anti_alpha * beta      * direction_y[floor_y_index * DIM + ceil_x_index] + 
-				             alpha      * anti_beta * direction_y[ceil_y_index * DIM + floor_x_index]);
-
-			float scalar = (anti_alpha * anti_beta * scalar_values.at(floor_y_index * DIM + floor_x_index) + 
-				             alpha      * beta      * scalar_values.at(ceil_y_index * DIM + ceil_x_index) + 
-				             anti_alpha * beta      * scalar_values.at(floor_y_index * DIM + ceil_x_index) + 
-				             alpha      * anti_beta * scalar_values.at(ceil_y_index * DIM + floor_x_index));
-
-			if (clamping == 1)
-            {  // Clamp
-                scalar = clamp(scalar, min_clamp_value, max_clamp_value);
-            }
-            else
-            {  // Scale
-                scalar = scale(scalar, min_color, max_color);
-            }
+			// Grid point (i, j) is drawn at ((i + 1) * wn, (j + 1) * hn)
+			glyph_x[g] = glyph_x[g] / wn - 1;
+			glyph_y[g] = glyph_y[g] / hn - 1;
+		}
+	}
+	const fftw_real* fields[3] = {direction_x, direction_y, scalar_values.data()};
+	fftw_real* samples[3] = {glyph_values.data(), glyph_values.data() + glyphs, glyph_values.data() + 2 * glyphs};
+	sample_fields(DIM, SAMPLE_PERIODIC, 3, fields, glyph_x.data(), glyph_y.data(), glyphs, samples);
 
- 			
-			float x_end = x_start + vec_length * value_x;
-			float y_end = y_start + vec_length * value_y;
+	for (size_t g = 0; g < glyphs; g++)
+	{
+		float x_start = (glyph_x[g] + 1) * wn;
+		float y_start = (glyph_y[g] + 1) * hn;
+		float value_x = samples[0][g];
+		float value_y = samples[1][g];
+		float scalar = samples[2][g];
+
+		if (clamping == 1)
+        {  // Clamp
+            scalar = clamp(scalar, min_clamp_value, max_clamp_value);
+        }
+        else
+        {  // Scale
+            scalar = scale(scalar, min_color, max_color);
+        }
 
+ 		
+		float x_end = x_start + vec_length * value_x;
+		float y_end = y_start + vec_length * value_y;
 
-			direction_to_color(value_x, value_y, color_dir);
-			set_colormap(scalar, R, G, B);
-			glColor3f(R, G, B);
-			switch(glyph_shape)
-			{
-			case LINES:
-				glBegin(GL_LINES);
-				glVertex2f(x_start, y_start);
-				glVertex2f(x_end, y_end);
-				glEnd();
-				break;
-			case ARROWS:
-				draw_arrow(x_start, y_start, x_end, y_end, 4);
-				break;		  
-			case TRIANGLES:
-		  		draw_triangle(x_start, y_start, x_end, y_end);
-		  		break;
-			}
+
+		direction_to_color(value_x, value_y, color_dir);
+		set_colormap(scalar, R, G, B);
+		glColor3f(R, G, B);
+		switch(glyph_shape)
+		{
+		case LINES:
+			glBegin(GL_LINES);
+			glVertex2f(x_start, y_start);
+			glVertex2f(x_end, y_end);
+			glEnd();
+			break;
+		case ARROWS:
+			draw_arrow(x_start, y_start, x_end, y_end, 4);
+			break;		  
+		case TRIANGLES:
+	  		draw_triangle(x_start, y_start, x_end, y_end);
+	  		break;
 		}
 	}
 }
 
-void Visualization::divergence(fftw_real* f_x, fftw_real* f_y, std::vector<fftw_real>& diff, Model* model)
+void Visualization::divergence(const fftw_real* f_x, const fftw_real* f_y, std::vector<fftw_real>& diff, int DIM)
 {
+	// The min and max of the divergence are part of the snapshot's stats, see Model::compute_stats
 	fftw_real prev_x, prev_y, next_x, next_y, divergence;
-	model->max_div = -FLT_MAX;
-	model->min_div = FLT_MAX;
-	for (int j = 0; j < model->DIM; ++j)
+	for (int j = 0; j < DIM; ++j)
 	{
-		for (int i = 0; i < model->DIM; ++i)
+		for (int i = 0; i < DIM; ++i)
 		{			 
 			// Calculate previous and next for derivative
-			prev_x = f_x[((i - 1 + model->DIM) % model->DIM) + j * model->DIM];
-			next_x = f_x[((i + 1) % model->DIM) + j * model->DIM];
+			prev_x = f_x[((i - 1 + DIM) % DIM) + j * DIM];
+			next_x = f_x[((i + 1) % DIM) + j * DIM];
 
-			prev_y = f_y[i + ((j - 1 + model->DIM) % model->DIM) * model->DIM];
-			next_y = f_y[i + ((j + 1) % model->DIM) * model->DIM];
+			prev_y = f_y[i + ((j - 1 + DIM) % DIM) * DIM];
+			next_y = f_y[i + ((j + 1) % DIM) * DIM];
 			
 			divergence = next_x - prev_x + next_y - prev_y;
 			diff.push_back(divergence);
-			model->max_div = std::max(divergence, model->max_div);
-			model->min_div = std::min(divergence, model->min_div);
 		}
 	}
 }
@@ -779,28 +908,26 @@ void Visualization::draw_triangle(int x_start, int y_start, int x_end, int y_end
 	glPopMatrix();
 }
 
-void Visualization::addSeedPoint(std::list<streamTube>* streamTubes, double x, double y, double z)
+void Visualization::addSeedPoint(StreamTubes* streamTubes, double x, double y, double z)
 {
-	//C++11 magic! 
-	streamTubes->push_back({{x, y, z}, {}});
+	streamTubes->add(x, y, z);
 }
 
-void Visualization::removeSeedPoint(std::list<streamTube>* streamTubes)
+void Visualization::removeSeedPoint(StreamTubes* streamTubes)
 {
-	if(!streamTubes->empty())
-		streamTubes->pop_back();
+	streamTubes->remove_last();
 }
 
-void Visualization::draw_streamtubes(std::list<streamTube>* streamTubes, fftw_real wn, fftw_real hn )
+void Visualization::draw_streamtubes(const StreamTubes* streamTubes, fftw_real wn, fftw_real hn )
 {
 	glEnable( GL_LIGHTING );
     glEnable( GL_LIGHT0 );
     glEnable (GL_COLOR_MATERIAL);
 
-	for (auto streamtube = streamTubes->begin(); streamtube != streamTubes->end(); ++streamtube)
+	for (int streamtube = 0; streamtube < streamTubes->size(); ++streamtube)
 	{
 		//Draw the seed as sphere first
-		Point3d seed = (*streamtube).seed;
+		Point3d seed = streamTubes->seed(streamtube);
 		glColor3f(1, 1, 1);
 		glPushMatrix();
 		//glutSolidSphere draws a sphere at the origin, so translate to the correct location
@@ -814,9 +941,9 @@ void Visualization::draw_streamtubes(std::list<streamTube>* streamTubes, fftw_re
 		GLUquadric* quad = gluNewQuadric();
 		gluQuadricDrawStyle(quad, GLU_FILL);
 		gluQuadricNormals(quad, GLU_SMOOTH);
-		for (auto tubepoint = (*streamtube).tail.begin(); tubepoint != (*streamtube).tail.end(); ++tubepoint)
+		for (int tubepoint = 0; tubepoint < streamTubes->length(streamtube); ++tubepoint)
 		{
-			Point3d point = *tubepoint;
+			Point3d point = streamTubes->point(streamtube, tubepoint);
 			//Draw a line between the previous point and current point
 			//After drawing set the previous point to the current and draw next
 			glPushMatrix();
@@ -843,12 +970,7 @@ void Visualization::draw_streamtubes(std::list<streamTube>* streamTubes, fftw_re
     glDisable (GL_COLOR_MATERIAL);
 }
 
-void Visualization::set_last_z_value(std::list<streamTube>* streamTubes, double zval)
+void Visualization::set_last_z_value(StreamTubes* streamTubes, double zval)
 {
-	if (!streamTubes->empty())
-	{
-		streamTube& streamtube = streamTubes->back();
-		streamtube.seed.z = zval;
-		streamtube.tail.clear();
-	}
+	streamTubes->set_last_z(zval);
 }
\ No newline at end of file
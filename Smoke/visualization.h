@@ -10,6 +10,24 @@
 #include "GL/glui.h"
 #define NUM_COLORMAPS 4
 
+// SmokeMesh: The triangles of the colored grid of draw_smoke, kept in vertex buffers between frames. The indices only
+//            change with the grid size, the positions with the window size and the height plot, so a frame usually
+//            uploads just the scalar of every vertex. Without height plot the grid can instead be drawn as an image,
+//            one texel per vertex, on a single quad.
+typedef struct smoke_mesh {
+    unsigned int buffers[4];                // positions, texture coordinates, colors, triangle indices; 0 until first drawn
+    int DIM;                                // grid the indices were built for, 0 when none
+    int num_indices;
+    fftw_real wn, hn;                       // cell size the positions were built for
+    bool flat;                              // whether the positions were built with height 0
+    std::vector<float> positions;           // x, y, z of every vertex
+    std::vector<float> values;              // scalar of every vertex, clamped or scaled to the color map
+    std::vector<float> colors;              // RGB of every vertex, when not drawing with textures
+    unsigned int image_texture;             // 2D texture of the image, 0 until first drawn
+    int image_DIM;                          // size of image_texture, 0 when none
+    std::vector<unsigned char> image;       // RGB of every vertex
+} SmokeMesh;
+
 using namespace std;
 class Visualization {
 private:
@@ -53,16 +71,23 @@ public:
     int enableStreamtubes;
     int zval;
     float jitter;
+    PhaseTimers* timers;        //receives the duration of every drawing phase when set
+    int showTimings;            //toggles on/off the overlay with the phase timings
+    SmokeMesh mesh;             //vertex buffers of draw_smoke
+    int flatImage;              //draws the smoke as one textured quad when the height plot is off
+    std::vector<unsigned char> color_lut[NUM_COLORMAPS];  //RGB texels of the color map textures, to color on the CPU
     enum COLORMAP_TYPE {COLOR_BLACKWHITE = 0, COLOR_RAINBOW, COLOR_BIPOLAR, COLOR_ZEBRA};
     enum DATASET_TYPE {FLUID_DENSITY, FLUID_VELOCITY, FORCE_FIELD, DIVERGENCE_VELOCITY, DIVERGENCE_FORCE};
     enum SAMPLING_TYPE {UNIFORM, JITTER};
     enum GLYPH_TYPE {LINES, ARROWS, TRIANGLES};
     std::vector<float> jitter_displacement;
+    std::vector<fftw_real> glyph_x, glyph_y;   //grid coordinates of the glyphs
+    std::vector<fftw_real> glyph_values;       //velocity x, velocity y and scalar sampled at every glyph
 
 
     //------ VISUALIZATION CODE STARTS HERE -----------------------------------------------------------------
 
-    void determineValuesMinMax(Model* model, int dataset_idx, std::vector<fftw_real>& values, fftw_real *min, fftw_real* max);
+    void determineValuesMinMax(const FieldSnapshot* frame, int dataset_idx, std::vector<fftw_real>& values, fftw_real *min, fftw_real* max);
 
     Visualization(int a_color_dir,
             int a_color_map_idx,
@@ -96,12 +121,27 @@ public:
             lower_isoline_value(0.01),
             upper_isoline_value(0.02),
             enableStreamtubes(1),
-            zval(-50)
+            zval(-50),
+            timers(NULL),
+            showTimings(0),
+            flatImage(1)
              {
         vec_length = vec_base_length * vec_scale;
-        for (int i = 0; i < 200*200; ++i)
+        init_jitter(50);
+        for (int b = 0; b < 4; ++b)
+            mesh.buffers[b] = 0;
+        mesh.DIM = 0;
+        mesh.num_indices = 0;
+        mesh.wn = mesh.hn = 0;
+        mesh.flat = true;
+        mesh.image_texture = 0;
+        mesh.image_DIM = 0;
+    }
+    //init_jitter: Generate a random displacement for every glyph of a DIM x DIM sampling grid
+    void init_jitter(int DIM) {
+        jitter_displacement.clear();
+        for (int i = 0; i < DIM*DIM; ++i)
             jitter_displacement.push_back(RandomFloat(-1, 1));
-
     }
     float RandomFloat(float a, float b) {
         float random = ((float) rand()) / (float) RAND_MAX;
@@ -109,7 +149,8 @@ public:
         float r = random * diff;
         return a + r;
     }
-    void visualize(Model* model);
+    //visualize: Draw 'frame' in a window of winWidth x winHeight pixels
+    void visualize(const FieldSnapshot* frame, int winWidth, int winHeight);
     //rainbow: Implements a color palette, mapping the scalar 'value' to a rainbow color RGB
     void rainbow(float value, float* R, float* G, float* B);
 
@@ -126,13 +167,22 @@ public:
     // Draw color legend
     void draw_color_legend(float minRho, float maxRho);
 
+    //draw_timings: Draw the p50, p95 and p99 duration of every phase in 'timers' left of the color legend
+    void draw_timings(const PhaseTimers& timers);
+
     //draw smoke
-    void draw_smoke(fftw_real wn, fftw_real hn, int DIM, std::vector<fftw_real> color_map_values, std::vector<fftw_real> height_values, fftw_real min_color, fftw_real max_color, fftw_real min_height, fftw_real max_height);
+    void draw_smoke(fftw_real wn, fftw_real hn, int DIM, const std::vector<fftw_real>& color_map_values, const std::vector<fftw_real>& height_values, fftw_real min_color, fftw_real max_color, fftw_real min_height, fftw_real max_height);
+
+    //draw_mesh: Draw the cells of the grid as colored triangles from 'mesh', with one indexed call
+    void draw_mesh(fftw_real wn, fftw_real hn, int DIM, const std::vector<fftw_real>& height_values, fftw_real min_height, fftw_real max_height);
+
+    //draw_image: Draw the flat grid as one quad, with a 2D texture of the colors of the vertices uploaded at once
+    void draw_image(fftw_real wn, fftw_real hn, int DIM);
 
     //draw velocities
-    void draw_velocities(fftw_real wn, fftw_real hn, int DIM, fftw_real* direction_x, fftw_real* direction_y, std::vector<fftw_real> scalar_values, fftw_real min_color, fftw_real max_color);
+    void draw_velocities(fftw_real wn, fftw_real hn, int DIM, const fftw_real* direction_x, const fftw_real* direction_y, const std::vector<fftw_real>& scalar_values, fftw_real min_color, fftw_real max_color);
 
-    void divergence(fftw_real* f_x, fftw_real* f_y, std::vector<fftw_real>& grad, Model* model);
+    void divergence(const fftw_real* f_x, const fftw_real* f_y, std::vector<fftw_real>& grad, int DIM);
 
     float calc_angle(float x_dif, float y_dif);
 
@@ -151,10 +201,10 @@ public:
     float scale(float x, fftw_real min, fftw_real max);
     double interpolate(double v1, double v2, double iso);
 
-    void addSeedPoint(std::list<streamTube>* streamTubes, double x, double y, double z);
-    void removeSeedPoint(std::list<streamTube>* streamTubes);
-    void draw_streamtubes(std::list<streamTube>* streamTubes, fftw_real wn, fftw_real hn);
-    void set_last_z_value(std::list<streamTube>* streamTubes, double zval);
+    void addSeedPoint(StreamTubes* streamTubes, double x, double y, double z);
+    void removeSeedPoint(StreamTubes* streamTubes);
+    void draw_streamtubes(const StreamTubes* streamTubes, fftw_real wn, fftw_real hn);
+    void set_last_z_value(StreamTubes* streamTubes, double zval);
 };
 
 #endif
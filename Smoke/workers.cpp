@@ -0,0 +1,105 @@
+#include "workers.h"
+#include "trace.h"
+#include <stdio.h>
+
+WorkerPool::WorkerPool(int num_workers) : num_workers(0), job(NULL), job_begin(0), job_end(0), generation(0), busy(0), quit(false)
+{
+    resize(num_workers);
+}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+void WorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    start_cv.notify_all();
+    for (auto thread = threads.begin(); thread != threads.end(); ++thread)
+        (*thread).join();
+    threads.clear();
+    quit = false;
+}
+
+//resize: Change the number of workers (including the calling thread), at least 1
+void WorkerPool::resize(int n)
+{
+    if (n < 1)
+        n = 1;
+    if (n == num_workers)
+        return;
+    stop();
+    num_workers = n;
+    // Worker 0 is the thread that calls run()
+    for (int i = 1; i < num_workers; ++i)
+        threads.push_back(std::thread(&WorkerPool::work, this, i, generation));
+}
+
+//run: Split [begin, end) into one contiguous chunk per worker and call job(chunk_begin, chunk_end)
+//     for every chunk. Returns when all chunks are done.
+void WorkerPool::run(int begin, int end, const std::function<void(int, int)>& f)
+{
+    if (num_workers == 1 || end - begin < 2)
+    {
+        f(begin, end);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &f;
+        job_begin = begin;
+        job_end = end;
+        busy = num_workers - 1;
+        generation++;
+    }
+    start_cv.notify_all();
+
+    {
+        TraceScope trace("rows");
+        f(begin, begin + (long)(end - begin) / num_workers);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this] { return busy == 0; });
+    job = NULL;
+}
+
+void WorkerPool::work(int worker, unsigned long seen)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "worker %d", worker);
+    trace_thread_name(name);
+    for (;;)
+    {
+        const std::function<void(int, int)>* f;
+        int begin, end;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cv.wait(lock, [this, seen] { return quit || generation != seen; });
+            if (quit)
+                return;
+            seen = generation;
+            f = job;
+            begin = job_begin;
+            end = job_end;
+        }
+        // Chunk boundaries are computed the same way for every worker, so the chunks never overlap
+        int length = end - begin;
+        int chunk_begin = begin + (long)length * worker / num_workers;
+        int chunk_end = begin + (long)length * (worker + 1) / num_workers;
+        if (chunk_begin < chunk_end)
+        {
+            TraceScope trace("rows");
+            (*f)(chunk_begin, chunk_end);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy--;
+        }
+        done_cv.notify_one();
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+// WorkerPool: A fixed set of threads that split a range of rows between them.
+//             The calling thread always takes the first chunk, so a pool of size 1 runs everything serially.
+class WorkerPool {
+public:
+    WorkerPool(int num_workers = 1);
+    ~WorkerPool();
+
+    //resize: Change the number of workers (including the calling thread), at least 1
+    void resize(int num_workers);
+    int size() const { return num_workers; }
+
+    //run: Split [begin, end) into one contiguous chunk per worker and call job(chunk_begin, chunk_end)
+    //     for every chunk. Returns when all chunks are done.
+    void run(int begin, int end, const std::function<void(int, int)>& job);
+
+private:
+    void stop();
+    void work(int worker, unsigned long seen);
+
+    int num_workers;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_cv, done_cv;
+    const std::function<void(int, int)>* job;
+    int job_begin, job_end;
+    unsigned long generation;       // incremented for every job, so workers know there is new work
+    int busy;                       // number of workers that still have to finish the current job
+    bool quit;
+};
+
+#endif